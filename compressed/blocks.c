@@ -0,0 +1,153 @@
+/*
+ * blocks.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Decoder for block-indexed compressed payloads. See blocks.h
+ * for the layout.
+ */
+
+#include <bootkit/runtime.h>
+#include <bootkit/compressed/quicklz.h>
+
+#include "lzss.h"
+#include "blocks.h"
+
+/*
+ * block_payload_check
+ *
+ * Validates the header and the offset table so the decoders below
+ * don't have to. Must be called before anything else.
+ */
+boolean_t block_payload_check(block_payload_t* payload, uint32_t payload_size, uint32_t decomp_size)
+{
+	uint32_t table_end;
+	uint32_t i;
+
+	if (payload_size < sizeof(block_payload_t)) {
+		printf(KERR "block payload too small (0x%x bytes)\n", payload_size);
+		return false;
+	}
+
+	if (payload->magic != kBlockPayloadMagic) {
+		printf(KERR "bad block payload magic 0x%08x\n", payload->magic);
+		return false;
+	}
+
+	if (payload->codec != kBlockCodecLZSS && payload->codec != kBlockCodecQLZ) {
+		printf(KERR "unknown block codec %u\n", payload->codec);
+		return false;
+	}
+
+	if (payload->decomp_size != decomp_size) {
+		printf(KERR "block payload size mismatch (BLK:0x%08x IMGX:0x%08x)\n",
+			payload->decomp_size,
+			decomp_size);
+		return false;
+	}
+
+	if (payload->block_size == 0 || payload->nblocks == 0 ||
+		payload->nblocks != decomp_size / payload->block_size + (decomp_size % payload->block_size != 0))
+	{
+		printf(KERR "bad block geometry (%u blocks of 0x%x)\n",
+			payload->nblocks,
+			payload->block_size);
+		return false;
+	}
+
+	/* The table has to fit before its size can be worked out */
+	if (payload->nblocks >= (payload_size - sizeof(block_payload_t)) / sizeof(uint32_t)) {
+		printf(KERR "block offset table out of bounds\n");
+		return false;
+	}
+
+	table_end = sizeof(block_payload_t) + (payload->nblocks + 1) * sizeof(uint32_t);
+
+	if (table_end > payload_size || payload->offsets[0] < table_end ||
+		payload->offsets[payload->nblocks] > payload_size)
+	{
+		printf(KERR "block offset table out of bounds\n");
+		return false;
+	}
+
+	for (i = 0; i < payload->nblocks; i++) {
+		if (payload->offsets[i+1] < payload->offsets[i]) {
+			printf(KERR "block %u has a negative length\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * block_payload_decode_block
+ *
+ * Decodes block 'index' to its place in 'image', which points to the
+ * start of the whole decompressed payload. Reentrant as long as each
+ * caller has its own QLZ state. Returns non-zero if the block didn't
+ * decode to the expected size.
+ */
+int block_payload_decode_block(block_payload_t* payload, uint32_t index, uint8_t* image, qlz_state_decompress* state)
+{
+	uint8_t* src = (uint8_t*)payload + payload->offsets[index];
+	uint32_t src_len = payload->offsets[index+1] - payload->offsets[index];
+	uint32_t dst_off = index * payload->block_size;
+	uint32_t dst_len = payload->decomp_size - dst_off;
+	uint32_t produced;
+
+	if (dst_len > payload->block_size) {
+		dst_len = payload->block_size;
+	}
+
+	if (src_len == dst_len) {
+		/* Stored */
+		bcopy((void*)src, (void*)(image + dst_off), dst_len);
+		return 0;
+	}
+
+	if (payload->codec == kBlockCodecLZSS) {
+		produced = decompress_lzss(image + dst_off, src, src_len);
+	}
+	else {
+		if (qlz_size_compressed((const char*)src) != src_len ||
+			qlz_size_decompressed((const char*)src) != dst_len)
+		{
+			return 1;
+		}
+
+		produced = qlz_decompress((const char*)src, (void*)(image + dst_off), state);
+	}
+
+	return (produced != dst_len);
+}
+
+/*
+ * block_payload_decode_range
+ *
+ * Decodes only the blocks covering [offset, offset+len) of the
+ * decompressed payload.
+ */
+int block_payload_decode_range(block_payload_t* payload, uint8_t* image, uint32_t offset, uint32_t len, qlz_state_decompress* state)
+{
+	uint32_t first;
+	uint32_t last;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (offset >= payload->decomp_size || len > payload->decomp_size - offset) {
+		return 1;
+	}
+
+	first = offset / payload->block_size;
+	last = (offset + len - 1) / payload->block_size;
+
+	for (; first <= last; first++) {
+		if (block_payload_decode_block(payload, first, image, state)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * blocks.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Block-indexed compressed payloads.
+ *
+ * The payload is cut into blocks of 'block_size' decompressed bytes
+ * (the last one may be shorter), each compressed on its own. A table
+ * of 'nblocks+1' offsets follows the header; block 'i' occupies
+ * [offsets[i], offsets[i+1]) counted from the start of the header.
+ * A block whose compressed length equals its decompressed length is
+ * stored as is.
+ *
+ * Since blocks don't share any decoder state they can be decoded in
+ * any order, on any core, or only the ones covering a given range.
+ *
+ * Shared with tools/mkblocks.c, which builds them.
+ */
+
+#ifndef _BLOCKS_H
+#define _BLOCKS_H
+
+#ifndef HOST_CODE
+#define HOST_CODE 0
+#endif
+
+#if HOST_CODE
+#include <stdint.h>
+#else
+#include <bootkit/runtime.h>
+#include <bootkit/compressed/quicklz.h>
+#endif
+
+#define kBlockPayloadMagic ((uint32_t)'XBLK')
+
+enum {
+	kBlockCodecLZSS = 1,
+	kBlockCodecQLZ = 2
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t codec;
+	uint32_t block_size;
+	uint32_t nblocks;
+	uint32_t decomp_size;
+	uint32_t offsets[];
+} block_payload_t;
+
+#if !HOST_CODE
+extern boolean_t block_payload_check(block_payload_t* payload, uint32_t payload_size, uint32_t decomp_size);
+extern int block_payload_decode_block(block_payload_t* payload, uint32_t index, uint8_t* image, qlz_state_decompress* state);
+extern int block_payload_decode_range(block_payload_t* payload, uint8_t* image, uint32_t offset, uint32_t len, qlz_state_decompress* state);
+#endif
+
+#endif
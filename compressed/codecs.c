@@ -0,0 +1,291 @@
+/*
+ * codecs.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Payload codec table. See codecs.h.
+ */
+
+#include <bootkit/runtime.h>
+#include <bootkit/compressed/quicklz.h>
+
+#include "lzss.h"
+#include "blocks.h"
+#include "codecs.h"
+
+/*---------------------------------------------------------------*/
+/* LZSS */
+
+static int lzss_check(const uint8_t* payload, uint32_t payload_size, uint32_t decomp_size)
+{
+	/* No header to look at */
+	return 0;
+}
+
+static uint32_t lzss_state_size(const uint8_t* payload)
+{
+	return 0;
+}
+
+static int lzss_decode(const uint8_t* payload,
+	uint32_t payload_size,
+	uint8_t* dst,
+	uint32_t decomp_size,
+	void* state)
+{
+	/*
+	 * Commands are padded to a word, and LZSS has no end marker,
+	 * so the padding can decode to a few extra bytes.
+	 */
+	return ((uint32_t)decompress_lzss(dst, (uint8_t*)payload, payload_size) < decomp_size);
+}
+
+static void lzss_stream_init_codec(void* state, uint8_t* dst, uint32_t dst_size)
+{
+	lzss_stream_init((lzss_stream_t*)state, dst, dst_size);
+}
+
+static int lzss_stream_feed_codec(void* state, const uint8_t* src, uint32_t len)
+{
+	lzss_stream_t* stream = (lzss_stream_t*)state;
+
+	if (lzss_stream_feed(stream, src, len))
+		return 1;
+
+	/* Past the output only the word padding of the command may follow */
+	return (stream->excess > 3);
+}
+
+static uint32_t lzss_stream_produced_codec(void* state)
+{
+	return lzss_stream_produced((lzss_stream_t*)state);
+}
+
+/*---------------------------------------------------------------*/
+/* QuickLZ */
+
+static int qlz_check(const uint8_t* payload, uint32_t payload_size, uint32_t decomp_size)
+{
+	unsigned int qlz_len;
+
+	if (payload_size < 9 || qlz_size_compressed((const char*)payload) > payload_size) {
+		printf(KERR "QLZ payload truncated (0x%x bytes)\n", payload_size);
+		return 1;
+	}
+
+	qlz_len = qlz_size_decompressed((const char*)payload);
+
+	if (qlz_len != decomp_size) {
+		printf(KERR "QLZ decomp size mismatch (QLZ:0x%08x IMGX:0x%08x)\n",
+			qlz_len,
+			decomp_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t qlz_state_size(const uint8_t* payload)
+{
+	return sizeof(qlz_state_decompress);
+}
+
+static int qlz_decode(const uint8_t* payload,
+	uint32_t payload_size,
+	uint8_t* dst,
+	uint32_t decomp_size,
+	void* state)
+{
+	size_t produced = qlz_decompress((const char*)payload,
+		(void*)dst,
+		(qlz_state_decompress*)state);
+
+	return (produced != decomp_size);
+}
+
+/*---------------------------------------------------------------*/
+/* block-indexed */
+
+static int blocks_check(const uint8_t* payload, uint32_t payload_size, uint32_t decomp_size)
+{
+	return !block_payload_check((block_payload_t*)payload, payload_size, decomp_size);
+}
+
+static uint32_t blocks_state_size(const uint8_t* payload)
+{
+	if (((block_payload_t*)payload)->codec == kBlockCodecQLZ)
+		return sizeof(qlz_state_decompress);
+
+	return 0;
+}
+
+static int blocks_decode_range(const uint8_t* payload,
+	uint8_t* dst,
+	uint32_t offset,
+	uint32_t len,
+	void* state)
+{
+	return block_payload_decode_range((block_payload_t*)payload,
+		dst,
+		offset,
+		len,
+		(qlz_state_decompress*)state);
+}
+
+static int blocks_decode(const uint8_t* payload,
+	uint32_t payload_size,
+	uint8_t* dst,
+	uint32_t decomp_size,
+	void* state)
+{
+	return blocks_decode_range(payload, dst, 0, decomp_size, state);
+}
+
+static uint32_t blocks_count(const uint8_t* payload)
+{
+	return ((block_payload_t*)payload)->nblocks;
+}
+
+static int blocks_decode_block(const uint8_t* payload, uint32_t index, uint8_t* dst, void* state)
+{
+	return block_payload_decode_block((block_payload_t*)payload,
+		index,
+		dst,
+		(qlz_state_decompress*)state);
+}
+
+/*---------------------------------------------------------------*/
+
+/* Looked up in order, the first codec whose flag is set wins */
+static const codec_t gCodecs[] = {
+	{
+		.name = "LZSS",
+		.proc = KPROC(LZSS),
+		.flag = kCodecFlagLZSS,
+		.caps = kCodecCanStream,
+		.check = lzss_check,
+		.state_size = lzss_state_size,
+		.decode = lzss_decode,
+		.stream_state_size = sizeof(lzss_stream_t),
+		.stream_init = lzss_stream_init_codec,
+		.stream_feed = lzss_stream_feed_codec,
+		.stream_produced = lzss_stream_produced_codec
+	},
+	{
+		.name = "QLZ",
+		.proc = KPROC3(QLZ),
+		.flag = kCodecFlagQLZ,
+		.caps = kCodecCanInPlace,
+		.check = qlz_check,
+		.state_size = qlz_state_size,
+		.decode = qlz_decode
+	},
+	{
+		.name = "BLKS",
+		.proc = KPROC(BLKS),
+		.flag = kCodecFlagBlocks,
+		.caps = kCodecCanParallel | kCodecCanRange,
+		.check = blocks_check,
+		.state_size = blocks_state_size,
+		.decode = blocks_decode,
+		.decode_range = blocks_decode_range,
+		.block_count = blocks_count,
+		.decode_block = blocks_decode_block
+	}
+};
+
+#define CODEC_COUNT (sizeof(gCodecs) / sizeof(gCodecs[0]))
+
+/*
+ * codec_for_flags
+ *
+ * The codec a command's flags select, NULL if the payload is stored.
+ */
+const codec_t* codec_for_flags(uint32_t flags)
+{
+	uint32_t i;
+
+	for (i = 0; i < CODEC_COUNT; i++) {
+		if (flags & gCodecs[i].flag)
+			return &gCodecs[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * codec_flags
+ *
+ * Every flag bit that selects a codec.
+ */
+uint32_t codec_flags(void)
+{
+	uint32_t flags = 0;
+	uint32_t i;
+
+	for (i = 0; i < CODEC_COUNT; i++)
+		flags |= gCodecs[i].flag;
+
+	return flags;
+}
+
+/*
+ * codec_payload_size
+ *
+ * Size of the encoded payload proper in 'size' bytes of command
+ * payload, without the in-place trailer.
+ */
+uint32_t codec_payload_size(uint32_t flags, uint32_t size)
+{
+	if ((flags & kCodecFlagInPlace) && size >= sizeof(codec_inplace_trailer_t))
+		return size - sizeof(codec_inplace_trailer_t);
+
+	return size;
+}
+
+/*
+ * codec_check_trailer
+ *
+ * Validates the in-place trailer of a payload that says it has one.
+ */
+int codec_check_trailer(uint32_t flags, const uint8_t* payload, uint32_t size)
+{
+	codec_inplace_trailer_t trailer;
+
+	if (!(flags & kCodecFlagInPlace))
+		return 0;
+
+	if (size < sizeof(codec_inplace_trailer_t)) {
+		printf(KERR "payload too small for an in-place trailer (0x%x bytes)\n", size);
+		return 1;
+	}
+
+	/* Trailers aren't necessarily aligned */
+	bcopy((void*)(payload + size - sizeof(trailer)), (void*)&trailer, sizeof(trailer));
+
+	if (trailer.magic != kCodecInPlaceMagic) {
+		printf(KERR "bad in-place trailer magic 0x%08x\n", trailer.magic);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * codec_inplace_room
+ *
+ * Bytes an in-place decode needs from the start of its output. A
+ * payload that grew when it was compressed needs its own size.
+ * Callers compare it against the room they have, so a margin that
+ * overflows comes back as all the address space.
+ */
+uint32_t codec_inplace_room(uint32_t payload_size, uint32_t decomp_size, uint32_t margin)
+{
+	uint32_t room = decomp_size + margin;
+
+	if (room < decomp_size) {
+		/* Can't be satisfied */
+		return 0xFFFFFFFF;
+	}
+
+	return (room < payload_size) ? payload_size : room;
+}
@@ -0,0 +1,112 @@
+/*
+ * codecs.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Table of the payload codecs the loader understands.
+ *
+ * A codec is selected by a flag bit in the command that carries the
+ * payload and says what it can do beyond decoding a whole payload
+ * from one buffer to another, so the loader can pick how to run it
+ * (stream it off storage, split it over CPUs, decode only part of
+ * it) without knowing which codec it is. Adding a codec only needs
+ * an entry in the table in codecs.c.
+ */
+
+#ifndef _CODECS_H
+#define _CODECS_H
+
+#include <bootkit/runtime.h>
+
+/* Command flag bits, shared by every command with a payload */
+#define kCodecFlagLZSS 0x100
+#define kCodecFlagQLZ 0x400
+#define kCodecFlagBlocks 0x1000
+
+/* Payload ends with a codec_inplace_trailer_t, see below */
+#define kCodecFlagInPlace 0x4000
+
+/* Capabilities */
+enum {
+	kCodecCanStream = 0x1,   /* can be fed the payload a chunk at a time */
+	kCodecCanParallel = 0x2, /* made of blocks that decode on their own */
+	kCodecCanRange = 0x4,    /* can decode part of the output */
+	kCodecCanInPlace = 0x8   /* decodes forward over its own input */
+};
+
+/*
+ * In-place decoding.
+ *
+ * A payload of a kCodecCanInPlace codec can be decoded into the
+ * range it is read into, if it is put at the tail of a range of
+ * 'decomp_size + margin' bytes. The decoder writes behind what it has
+ * already read and the margin (worked out by the packer, which can
+ * simulate the decode) keeps the two from meeting. Block payloads
+ * can't, their header is read all through the decode.
+ *
+ * Packers that know the margin set kCodecFlagInPlace and append the
+ * trailer to the payload. Everything but the in-place path ignores it.
+ */
+#define kCodecInPlaceMagic ((uint32_t)'PLNI')
+
+typedef struct {
+	uint32_t margin;
+	uint32_t magic;
+} codec_inplace_trailer_t;
+
+typedef struct _codec_t {
+	const char* name;
+	const char* proc; /* progress line prefix */
+	uint32_t flag;
+	uint32_t caps;
+
+	/*
+	 * Cheap header checks, done before committing to decode.
+	 * Returns non-zero (after saying why) if the payload is bad.
+	 */
+	int (*check)(const uint8_t* payload, uint32_t payload_size, uint32_t decomp_size);
+
+	/*
+	 * Bytes of decoder state one decode (or one parallel worker)
+	 * needs for this payload, zero for none.
+	 */
+	uint32_t (*state_size)(const uint8_t* payload);
+
+	/*
+	 * Decodes a checked payload. Doesn't allocate or print so it is
+	 * safe on a worker. Returns non-zero on a size mismatch.
+	 */
+	int (*decode)(const uint8_t* payload,
+		uint32_t payload_size,
+		uint8_t* dst,
+		uint32_t decomp_size,
+		void* state);
+
+	/* kCodecCanRange: decodes at least [offset, offset+len) of the output */
+	int (*decode_range)(const uint8_t* payload,
+		uint8_t* dst,
+		uint32_t offset,
+		uint32_t len,
+		void* state);
+
+	/* kCodecCanParallel: independent units, decodable in any order */
+	uint32_t (*block_count)(const uint8_t* payload);
+	int (*decode_block)(const uint8_t* payload, uint32_t index, uint8_t* dst, void* state);
+
+	/*
+	 * kCodecCanStream. Output stops at 'dst_size' bytes, feed returns
+	 * non-zero once the payload goes on past that.
+	 */
+	uint32_t stream_state_size;
+	void (*stream_init)(void* state, uint8_t* dst, uint32_t dst_size);
+	int (*stream_feed)(void* state, const uint8_t* src, uint32_t len);
+	uint32_t (*stream_produced)(void* state);
+} codec_t;
+
+extern const codec_t* codec_for_flags(uint32_t flags);
+extern uint32_t codec_flags(void);
+
+extern uint32_t codec_payload_size(uint32_t flags, uint32_t size);
+extern int codec_check_trailer(uint32_t flags, const uint8_t* payload, uint32_t size);
+extern uint32_t codec_inplace_room(uint32_t payload_size, uint32_t decomp_size, uint32_t margin);
+
+#endif
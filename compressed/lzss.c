@@ -28,6 +28,8 @@
 
 #include <bootkit/runtime.h>
 
+#include "lzss.h"
+
 #define BASE 65521L /* largest prime smaller than 65536 */
 #define NMAX 5000  
 // NMAX (was 5521) the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1
@@ -141,3 +143,117 @@ int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen)
     return dst - dststart;
 }
 
+/*
+ * Streaming variant of the above. The decoder state lives in
+ * 'lzss_stream_t' so a token split across two chunks is picked
+ * up where the previous call left off. Unlike the above it never
+ * writes past the end of the output, and fails with a match that
+ * would.
+ */
+
+enum {
+    kLZSSStateToken = 0,  /* next token, may need a new flag byte */
+    kLZSSStateBit,        /* flag byte loaded, token body pending */
+    kLZSSStateMatchHigh   /* have the low byte of a match reference */
+};
+
+void lzss_stream_init(lzss_stream_t* stream, uint8_t* dst, uint32_t dstlen)
+{
+    int i;
+
+    for (i = 0; i < N - F; i++)
+        stream->text_buf[i] = ' ';
+
+    stream->dst = dst;
+    stream->dststart = dst;
+    stream->dstend = dst + dstlen;
+    stream->excess = 0;
+    stream->overrun = 0;
+    stream->flags = 0;
+    stream->r = N - F;
+    stream->state = kLZSSStateToken;
+    stream->match_lo = 0;
+}
+
+int lzss_stream_feed(lzss_stream_t* stream, const uint8_t* src, uint32_t srclen)
+{
+    const uint8_t *srcend = src + srclen;
+    uint8_t *text_buf = stream->text_buf;
+    uint8_t *dst = stream->dst;
+    uint8_t *dstend = stream->dstend;
+    unsigned int flags = stream->flags;
+    int state = stream->state;
+    int r = stream->r;
+    int i, j, k, c;
+
+    if (stream->overrun)
+        return -1;
+
+    while (src < srcend) {
+        if (dst == dstend) {
+            /* Output is full, what's left should be padding */
+            stream->excess += (uint32_t)(srcend - src);
+            break;
+        }
+
+        if (state == kLZSSStateToken) {
+            if (((flags >>= 1) & 0x100) == 0) {
+                flags = *src++ | 0xFF00;
+                if (src == srcend) {
+                    state = kLZSSStateBit;
+                    break;
+                }
+            }
+            state = kLZSSStateBit;
+        }
+
+        if (state == kLZSSStateBit) {
+            if (flags & 1) {
+                c = *src++;
+                *dst++ = c;
+                text_buf[r++] = c;
+                r &= (N - 1);
+                state = kLZSSStateToken;
+                continue;
+            }
+
+            i = *src++;
+            if (src == srcend) {
+                stream->match_lo = i;
+                state = kLZSSStateMatchHigh;
+                break;
+            }
+        }
+        else {
+            /* kLZSSStateMatchHigh */
+            i = stream->match_lo;
+        }
+
+        j = *src++;
+        i |= ((j & 0xF0) << 4);
+        j  =  (j & 0x0F) + THRESHOLD;
+        if (j >= dstend - dst) {
+            stream->overrun = 1;
+            break;
+        }
+        for (k = 0; k <= j; k++) {
+            c = text_buf[(i + k) & (N - 1)];
+            *dst++ = c;
+            text_buf[r++] = c;
+            r &= (N - 1);
+        }
+        state = kLZSSStateToken;
+    }
+
+    stream->dst = dst;
+    stream->flags = flags;
+    stream->state = state;
+    stream->r = r;
+
+    return stream->overrun ? -1 : 0;
+}
+
+uint32_t lzss_stream_produced(lzss_stream_t* stream)
+{
+    return (uint32_t)(stream->dst - stream->dststart);
+}
@@ -0,0 +1,42 @@
+/*
+ * lzss.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * LZSS decompressor interface.
+ */
+
+#ifndef _LZSS_H
+#define _LZSS_H
+
+#include <bootkit/runtime.h>
+
+#define LZSS_RING_SIZE 4096 /* N */
+#define LZSS_MATCH_MAX 18   /* F */
+
+/*
+ * Resumable LZSS decoder state. Lets the caller feed the
+ * compressed stream in arbitrary chunks (for example, as they
+ * come off the storage device) instead of having the whole
+ * compressed blob in memory. Output stops at 'dstend'; input
+ * that arrives after that is only counted, in 'excess'.
+ */
+typedef struct {
+	uint8_t text_buf[LZSS_RING_SIZE + LZSS_MATCH_MAX - 1];
+	uint8_t* dst;
+	uint8_t* dststart;
+	uint8_t* dstend;
+	uint32_t excess;
+	int overrun;
+	unsigned int flags;
+	int r;
+	int state;
+	int match_lo;
+} lzss_stream_t;
+
+extern int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen);
+
+extern void lzss_stream_init(lzss_stream_t* stream, uint8_t* dst, uint32_t dstlen);
+extern int lzss_stream_feed(lzss_stream_t* stream, const uint8_t* src, uint32_t srclen);
+extern uint32_t lzss_stream_produced(lzss_stream_t* stream);
+
+#endif
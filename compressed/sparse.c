@@ -0,0 +1,129 @@
+/*
+ * sparse.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Expands sparse images. See sparse.h for the layout.
+ */
+
+#include <bootkit/runtime.h>
+
+#include "sparse.h"
+
+/*
+ * sparse_block_length
+ *
+ * Length of block 'i', only the last one can be short.
+ */
+static uint32_t sparse_block_length(sparse_image_t* img, uint32_t i)
+{
+	uint32_t off = i * img->block_size;
+	uint32_t len = img->image_size - off;
+
+	return (len > img->block_size) ? img->block_size : len;
+}
+
+/*
+ * sparse_image_check
+ *
+ * Validates the header and makes sure all the stored blocks are
+ * inside the 'size' bytes of the image. Must be called before
+ * expanding it.
+ */
+boolean_t sparse_image_check(sparse_image_t* img, uint32_t size)
+{
+	uint32_t table_end;
+	uint32_t stored = 0;
+	uint32_t i;
+
+	if (size < sizeof(sparse_image_t)) {
+		printf(KERR "sparse image too small (0x%x bytes)\n", size);
+		return false;
+	}
+
+	if (img->magic != kSparseImageMagic) {
+		printf(KERR "bad sparse image magic 0x%08x\n", img->magic);
+		return false;
+	}
+
+	if (img->block_size == 0 || (img->block_size & 3) || img->nblocks == 0 ||
+		img->nblocks != img->image_size / img->block_size + (img->image_size % img->block_size != 0))
+	{
+		printf(KERR "bad sparse geometry (%u blocks of 0x%x)\n",
+			img->nblocks,
+			img->block_size);
+		return false;
+	}
+
+	table_end = sizeof(sparse_image_t) + sparse_bitmap_words(img->nblocks) * sizeof(uint32_t);
+
+	if (table_end > size || img->data_offset < table_end || img->data_offset > size) {
+		printf(KERR "sparse bitmap out of bounds\n");
+		return false;
+	}
+
+	for (i = 0; i < img->nblocks; i++) {
+		if (sparse_block_stored(img, i))
+			stored += sparse_block_length(img, i);
+	}
+
+	if (stored > size - img->data_offset) {
+		printf(KERR "sparse image truncated (0x%x bytes stored, 0x%x present)\n",
+			stored,
+			size - img->data_offset);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * sparse_image_expand
+ *
+ * Expands a checked sparse image to 'dst'. Runs of stored blocks
+ * are copied and runs of elided ones are zeroed with one call each,
+ * so the arch string routines get long stretches to work with.
+ */
+void sparse_image_expand(sparse_image_t* img, uint8_t* dst)
+{
+	uint8_t* src = (uint8_t*)img + img->data_offset;
+	uint32_t i = 0;
+
+	while (i < img->nblocks) {
+		boolean_t stored = sparse_block_stored(img, i) ? true : false;
+		uint32_t run = 0;
+		uint32_t j = i;
+
+		/* Whole bitmap words at a time when possible */
+		while (j < img->nblocks) {
+			if ((j % 32) == 0 && j + 32 <= img->nblocks &&
+				img->bitmap[j / 32] == (stored ? 0xFFFFFFFF : 0))
+			{
+				run += img->block_size * 32;
+				j += 32;
+			}
+			else if ((sparse_block_stored(img, j) ? true : false) == stored) {
+				run += sparse_block_length(img, j);
+				j++;
+			}
+			else {
+				break;
+			}
+		}
+
+		if (j == img->nblocks) {
+			/* The last block may be short */
+			run = img->image_size - (i * img->block_size);
+		}
+
+		if (stored) {
+			bcopy((void*)src, (void*)dst, run);
+			src += run;
+		}
+		else {
+			bzero((void*)dst, run);
+		}
+
+		dst += run;
+		i = j;
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * sparse.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Sparse images.
+ *
+ * Most of an HFS+ ramdisk is unused allocation blocks, which are all
+ * zeroes. A sparse image cuts the image into blocks of 'block_size'
+ * bytes and only stores the ones that aren't all zero. A bitmap of
+ * 'nblocks' bits follows the header, bit 'i' (bit i%32 of word i/32)
+ * set means block 'i' is stored. The stored blocks follow, in order,
+ * at 'data_offset' from the start of the header. The last block is
+ * short if 'image_size' isn't a multiple of the block size.
+ *
+ * Shared with tools/mksparse.c, which builds them.
+ */
+
+#ifndef _SPARSE_H
+#define _SPARSE_H
+
+#ifndef HOST_CODE
+#define HOST_CODE 0
+#endif
+
+#if HOST_CODE
+#include <stdint.h>
+#else
+#include <bootkit/runtime.h>
+#endif
+
+#define kSparseImageMagic ((uint32_t)'SPRS')
+
+typedef struct {
+	uint32_t magic;
+	uint32_t block_size;
+	uint32_t nblocks;
+	uint32_t image_size;
+	uint32_t data_offset;
+	uint32_t bitmap[];
+} sparse_image_t;
+
+#define sparse_bitmap_words(nblocks) (((nblocks) + 31) / 32)
+#define sparse_block_stored(img, i) ((img)->bitmap[(i) / 32] & (1U << ((i) % 32)))
+
+#if !HOST_CODE
+extern boolean_t sparse_image_check(sparse_image_t* img, uint32_t size);
+extern void sparse_image_expand(sparse_image_t* img, uint8_t* dst);
+#endif
+
+#endif
@@ -9,21 +9,27 @@
 #include <bootkit/mach-o/macho_loader.h>
 #include <bootkit/mach-o/macho.h>
 
+#include "macho_index.h"
+
 
 #define vhead(x) ((mach_header_t*)(x->base))
 #define fhead(x) ((mach_header_t*)(x->file))
 
 #define check_align(x) ((x & 0xfff) == 0)
 
-#define for_each_lc(lcp, head) \
-	for ( \
-			uint32_t XXi = 0; XXi < head->ncmds; \
-			XXi++, lcp = (struct load_command*)add_ptr2(lcp, lcp->cmdsize) \
-		)
-
 #define for_each_section(sect, seg) sect = (struct section*)((uintptr_t)seg + sizeof(struct segment_command)); \
 for (uint32_t XXi = 0; XXi < seg->nsects; XXi++, sect++)
 
+typedef struct _mach_sym_entry {
+	uint32_t addr; /* without the thumb bit */
+	uint32_t sym;  /* index into the symtab */
+} mach_sym_entry_t;
+
+typedef struct _mach_name_entry {
+	uint32_t hash;
+	uint32_t sym;  /* index into the symtab, ~0 for empty */
+} mach_name_entry_t;
+
 /* Binary search */
 const struct nlist* binary_search_toc(const char* key,
 									  const char stringPool[],
@@ -44,57 +50,40 @@ const struct nlist* binary_search(const char* key,
  */
 loader_return_t mach_file_vmsize(mach_loader_context_t* file, uint32_t* sz)
 {
-	mach_header_t* head = fhead(file);
-	struct load_command* lcp = (struct load_command*)(head+1);
+	mach_lc_index_t* index = mach_file_index(file);
 	uint32_t sc = 0;
-	uint32_t seg_count = 0;
-	uint32_t has_symtab = 0;
 	
-	for_each_lc(lcp, head)
+	if (!index) {
+		/* Not made by mach_file_init */
+		return LOADER_MALFORMED;
+	}
+	
+	for (uint32_t i = 0; i < index->nsegments; i++)
 	{
-		/* Only interested in segments */
-		if (lcp->cmd == LC_SEGMENT)
+		struct segment_command* cmd = index->segments[i];
+		
+		if (file->filetype == MH_EXECUTE)
+		{
+			/* Simple - just add the VM sizes up */
+			sc += cmd->vmsize;
+		}
+		else
 		{
-			struct segment_command* cmd = (struct segment_command*)lcp;
+			struct section* sect;
 			
-			if (file->filetype == MH_EXECUTE)
-			{
-				/* Simple - just add the VM sizes up */
-				sc += cmd->vmsize;
-			}
-			else if (file->filetype == MH_OBJECT)
-			{
-				struct section* sect;
-				
-				if (seg_count) {
-					/* Object files can only have one segment */
-					return LOADER_OBJECT_BADSEGMENT;
-				}
-				
-				/*
-				 * This is more complicated. To find out the total VM
-				 * size for an object file we need to examine the sections.
-				 */
-				for_each_section(sect, cmd)
-				{
-					sc += sect->size;
-				}
-				
-				seg_count++;
-			}
-			else
+			/*
+			 * This is more complicated. To find out the total VM
+			 * size for an object file we need to examine the sections.
+			 * mach_file_init made sure there is only one segment.
+			 */
+			for_each_section(sect, cmd)
 			{
-				return LOADER_BADFILETYPE;
+				sc += sect->size;
 			}
 		}
-		else if (lcp->cmd == LC_SYMTAB)
-		{
-			/* This file has a symtab */
-			has_symtab = 1;
-		}
 	}
 	
-	if (file->filetype == MH_OBJECT && !has_symtab) {
+	if (file->filetype == MH_OBJECT && !index->symtab) {
 		/* Object file without symtab has to be malformed! */
 		return LOADER_NOSYMTAB;
 	}
@@ -146,134 +135,83 @@ boolean_t mach_file_is_prelinked(mach_loader_context_t* file)
  */
 loader_return_t mach_file_map(mach_loader_context_t* file, uint8_t* load_addr, uint32_t vmsize)
 {
-	mach_header_t* head = fhead(file);
-	struct load_command* lcp = (struct load_command*)(head+1);
-	uint32_t seg_count = 0;
+	mach_lc_index_t* index = mach_file_index(file);
 	uint32_t vm_bias = file->vm_bias;
 	
-	for_each_lc(lcp, head)
+	if (!index) {
+		return LOADER_MALFORMED;
+	}
+	
+	for (uint32_t i = 0; i < index->nsegments; i++)
 	{
-		/* Only interested in segments */
-		if (lcp->cmd == LC_SEGMENT)
+		struct segment_command* cmd = index->segments[i];
+		
+		if (file->filetype == MH_EXECUTE)
 		{
-			struct segment_command* cmd = (struct segment_command*)lcp;
+			struct section* sect;
 			
-			if (file->filetype == MH_EXECUTE)
+			/*
+			 * For executable images, we need to map entrie
+			 * segments and zero out deltas.
+			 */
+			
+			uint32_t delta = cmd->vmsize - cmd->filesize;
+			uint32_t actual_vmaddr;
+			
+			if (vm_bias == 0 && i == 0 && cmd->vmaddr != 0)
 			{
-				struct section* sect;
-				
-				/*
-				 * For executable images, we need to map entrie
-				 * segments and zero out deltas.
-				 */
-				
-				uint32_t delta = cmd->vmsize - cmd->filesize;
-				uint32_t actual_vmaddr;
-				
-				if (vm_bias == 0 && seg_count == 0 && cmd->vmaddr != 0)
-				{
-					/* How strange ... */
-					return LOADER_EXEC_UNSUPPORTED;
-				}
-				
-				actual_vmaddr = cmd->vmaddr - vm_bias;
+				/* How strange ... */
+				return LOADER_EXEC_UNSUPPORTED;
+			}
+			
+			actual_vmaddr = cmd->vmaddr - vm_bias;
 
-				if (cmd->filesize) {
-					void* src = (void*)add_ptr2(file->file, cmd->fileoff);
-					void* dst = (void*)add_ptr2(load_addr, actual_vmaddr);
+			if (cmd->filesize) {
+				void* src = (void*)add_ptr2(file->file, cmd->fileoff);
+				void* dst = (void*)add_ptr2(load_addr, actual_vmaddr);
 
-					/* Copy from source file */
-					bcopy(src, dst, cmd->filesize);
+				/* Copy from source file */
+				bcopy(src, dst, cmd->filesize);
 
-					printf("[MAP:%s]: copy 0x%08x =(%u)=> 0x%08x\n",
-						cmd->segname,
-						src,
-						cmd->filesize,
-						dst);
-				}
-				
-				if (delta && cmd->vmsize > cmd->filesize) {
-					void* dst = (void*)add_ptr3(load_addr, actual_vmaddr, cmd->filesize);
+				printf("[MAP:%s]: copy 0x%08x =(%u)=> 0x%08x\n",
+					cmd->segname,
+					src,
+					cmd->filesize,
+					dst);
+			}
+			
+			if (delta && cmd->vmsize > cmd->filesize) {
+				void* dst = (void*)add_ptr3(load_addr, actual_vmaddr, cmd->filesize);
 
-					printf("[MAP:%s]: zero 0x%08x (%u)\n",
-						cmd->segname, dst, delta);
+				printf("[MAP:%s]: zero 0x%08x (%u)\n",
+					cmd->segname, dst, delta);
 
-					/* Zero out the rest */
-					bzero(dst, delta);
-				}
-				
-				if (strncmp(cmd->segname, kPrelinkInfoSegment, 15) == 0) {
-					/* If the prelink segment has stuff in it, then this
-					 * is a prelinked kernel image */
-	
-					if (cmd->vmsize != 0) {
-						file->is_prelinked = true;
-					}
-				}
-				
-				/*
-				 * Examine ObjC metadata,
-				 */
-				for_each_section(sect, cmd)
-				{
-					
-				}
-				
-				seg_count++;
+				/* Zero out the rest */
+				bzero(dst, delta);
 			}
-			else if (file->filetype == MH_OBJECT)
+			
+			/*
+			 * Examine ObjC metadata,
+			 */
+			for_each_section(sect, cmd)
 			{
-				struct section* sect;
-				
-				if (seg_count) {
-					/* Object files can only have one segment */
-					return LOADER_OBJECT_BADSEGMENT;
-				}
-				
-				/* Save the first segment for convinience */
-				file->first_segment = cmd;
-				
-				/*
-				 * For object files, we map stuff section by
-				 * section. We also take note of the string section
-				 * ordinal as we will need it later.
-				 */
 				
-				for_each_section(sect, cmd)
-				{
-					_map_section(file, sect, load_addr);
-				}
-				
-				seg_count++;
-			}
-			else
-			{
-				return LOADER_BADFILETYPE;
 			}
 		}
-		else if (lcp->cmd == LC_UNIXTHREAD)
-		{
-			thread_command_t* th = (thread_command_t*)lcp;
-			file->entry_point = th->state.pc;
-		}
-		else if (lcp->cmd == LC_DYSYMTAB)
-		{
-			file->dsymtab = (struct dysymtab_command*)lcp;
-		}
-		else if (lcp->cmd == LC_DYLD_INFO || lcp->cmd == LC_DYLD_INFO_ONLY)
+		else
 		{
-			file->dyld_info = (struct dyld_info_command*)lcp;
-			file->compressed = 1;
+			struct section* sect;
 			
-			return LOADER_EXEC_UNSUPPORTED;
-		}
-		else if (lcp->cmd == LC_SYMTAB)
-		{
-			file->symtab = (struct symtab_command*)lcp;
+			/*
+			 * For object files, we map stuff section by
+			 * section. We also take note of the string section
+			 * ordinal as we will need it later.
+			 */
 			
-			/* Load symtab stuff */
-			file->string_base = (char*)add_ptr2(file->file, file->symtab->stroff);
-			file->symbol_base = (struct nlist *)add_ptr2(file->file, file->symtab->symoff);
+			for_each_section(sect, cmd)
+			{
+				_map_section(file, sect, load_addr);
+			}
 		}
 	}
 	
@@ -284,152 +222,243 @@ loader_return_t mach_file_map(mach_loader_context_t* file, uint8_t* load_addr, u
 	return LOADER_SUCCESS;
 }
 
-#define MAX_SECT_TAB 10
+/*
+ * _sym_entry_above
+ *
+ * Ordering for the address index. Where two symbols share an
+ * address, the external one sorts last so lookups prefer it.
+ */
+static boolean_t
+_sym_entry_above(mach_loader_context_t* file, mach_sym_entry_t* a, mach_sym_entry_t* b)
+{
+	if (a->addr != b->addr) {
+		return a->addr > b->addr;
+	}
+	
+	return (file->symbol_base[a->sym].n_type & N_EXT) >
+		(file->symbol_base[b->sym].n_type & N_EXT);
+}
+
+static void
+_sym_sift_down(mach_loader_context_t* file, mach_sym_entry_t* syms, uint32_t root, uint32_t count)
+{
+	for (;;)
+	{
+		uint32_t child = root * 2 + 1;
+		mach_sym_entry_t tmp;
+		
+		if (child >= count) {
+			return;
+		}
+		
+		if (child + 1 < count && _sym_entry_above(file, &syms[child + 1], &syms[child])) {
+			child++;
+		}
+		
+		if (!_sym_entry_above(file, &syms[child], &syms[root])) {
+			return;
+		}
+		
+		tmp = syms[root];
+		syms[root] = syms[child];
+		syms[child] = tmp;
+		
+		root = child;
+	}
+}
 
 /*
- * _symtab_find_symbol
+ * _symtab_build_index
  *
- * Looks up a symbol by its address in a symbol table. It's
- * fairly slow at it walks over each symbol.
+ * Builds the address index over every symbol that is defined in
+ * a section, leaving out debugger (N_STAB) entries. It's sorted in
+ * place with a heapsort, so it takes no room other than itself.
+ * It lives as long as the context, mach_file_destroy frees it.
  */
-static const struct nlist *
-_symtab_find_symbol(mach_loader_context_t* file, uint32_t entry)
+static loader_return_t
+_symtab_build_index(mach_loader_context_t* file)
 {
+	mach_lc_index_t* index = mach_file_index(file);
+	mach_sym_entry_t* syms;
+	uint32_t count = 0;
+	
+	if (!file->symtab || !file->symbol_base) {
+		return LOADER_NOSYMTAB;
+	}
+	
+	if (file->symtab->nsyms > 0xFFFFFFFF / sizeof(mach_sym_entry_t)) {
+		return LOADER_MALFORMED;
+	}
+	
+	syms = (mach_sym_entry_t*)malloc(sizeof(mach_sym_entry_t) * file->symtab->nsyms);
+	if (!syms) {
+		return LOADER_OUTOFBOUNDS;
+	}
+	
 	for (uint32_t i = 0; i < file->symtab->nsyms; i++)
 	{
 		struct nlist* sym = &file->symbol_base[i];
 		
-		if (sym->n_desc & N_ARM_THUMB_DEF) {
-			entry = entry & ~1;
+		if ((sym->n_type & N_STAB) || (sym->n_type & N_TYPE) != N_SECT) {
+			continue;
 		}
 		
-		if (sym->n_value == entry && !(sym->n_type & N_STAB)) {
-			return sym;
+		if ((uint32_t)sym->n_un.n_strx >= file->symtab->strsize) {
+			continue;
+		}
+		
+		/* Thumb functions have bit 0 set in their address */
+		syms[count].addr = sym->n_value;
+		if (sym->n_desc & N_ARM_THUMB_DEF) {
+			syms[count].addr &= ~1;
 		}
+		
+		syms[count].sym = i;
+		count++;
 	}
 	
-	return NULL;
+	for (uint32_t i = count / 2; i > 0; i--) {
+		_sym_sift_down(file, syms, i - 1, count);
+	}
+	
+	for (uint32_t i = count; i > 1; i--) {
+		mach_sym_entry_t tmp = syms[0];
+		
+		syms[0] = syms[i - 1];
+		syms[i - 1] = tmp;
+		
+		_sym_sift_down(file, syms, 0, i - 1);
+	}
+	
+	index->syms = syms;
+	index->nsyms = count;
+	
+	return LOADER_SUCCESS;
 }
 
-
 /*
- * _sect_by_ordinal
+ * _sect_by_index
  *
- * Gets a section from a segment with a given ordinal.
+ * Gets a section by its ordinal in the whole file (as in n_sect).
  */
 static struct section*
-_sect_by_ordinal(mach_loader_context_t* file, struct segment_command* seg, uint32_t ordinal)
+_sect_by_index(mach_loader_context_t* file, uint32_t ordinal)
 {
-	struct section* sect = (struct section*)(seg+1);
-	return &sect[ordinal-1];
+	mach_lc_index_t* index = mach_file_index(file);
+	
+	if (ordinal == 0 || ordinal > index->nsections) {
+		return NULL;
+	}
+	
+	ordinal--;
+	
+	for (uint32_t i = 0; i < index->nsegments; i++)
+	{
+		struct segment_command* seg = index->segments[i];
+		
+		if (ordinal < seg->nsects) {
+			return &((struct section*)(seg+1))[ordinal];
+		}
+		
+		ordinal -= seg->nsects;
+	}
+	
+	return NULL;
 }
 
-#define is_bad_addr(file, addr) ((uintptr_t)addr < (uintptr_t)file->base || (uintptr_t)addr > add_ptr2(file->base, file->vmsize))
-#define is_bad_file_addr(file, addr) (0)
-
 /*
- * _relocate_sect
+ * mach_file_symbol_for_address
  *
- * Relocates a section with a given ordinal with a delta
- * of the current context's 'loader_bias'. This has the main guts
- * of the object section relocator.
+ * Finds the symbol an address is in, and how far into it the
+ * address is. The address is slid by the loader bias, like the
+ * ones mach_file_find_symbol hands out. The first lookup builds
+ * the address index.
  */
-static loader_return_t
-_relocate_sect(mach_loader_context_t* file, struct segment_command* seg, uint32_t ordinal)
+loader_return_t mach_file_symbol_for_address(mach_loader_context_t* file,
+	uint32_t addr,
+	const char** name,
+	uint32_t* offset)
 {
-	struct section* sect = _sect_by_ordinal(file, seg, ordinal);
-	struct relocation_info* rbase = NULL;
-	
-	/* The relocation info stuff is in the source file */
-	rbase = (struct relocation_info *)add_ptr2(file->file, sect->reloff);
+	mach_lc_index_t* index = mach_file_index(file);
+	const struct nlist* sym;
+	struct section* sect;
+	uint32_t low = 0;
+	uint32_t high;
 	
-	printf("_relocate_sect: %d %s\n", ordinal, sect->sectname);
+	if (!index) {
+		return LOADER_MALFORMED;
+	}
 	
-	/* Relocation iterator */
-	for (uint32_t i = 0; i < sect->nreloc; i++)
-	{
-		/*
-		 * This makes the assumption that sections are contigious
-		 * and are mapped in bias+vmaddr. This would be more flexible
-		 * if we built a section table with a bias for each section which
-		 * would allow scattered sections, but I'm not bothered.
-		 */
-		
-		struct relocation_info* rinfo = &rbase[i]; /* Relocation offset */
-		uint32_t* entry; /* Absolute address of the patch point */
-		
-		/* Relocation sanity */
-		if (is_bad_file_addr(file, rinfo)) {
-			return LOADER_OUTOFBOUNDS;
-		}
-		if (rinfo->r_address & R_SCATTERED) {
-			/* We don't support scattered relocations */
-			return LOADER_BADRELOC;
-		}
-		if (rinfo->r_length != 2) {
-			/* Bad size, probably unsupported file */
-			return LOADER_BADRELOC;
-		}
-		if (rinfo->r_type != GENERIC_RELOC_VANILLA) {
-			/*
-			 * PC relative relocations do not need to be modified
-			 * unless we're scattering sections (which we're not).
-			 * If this is a non-PC relative strange relocation, bail out.
-			 */
-			
-			if (rinfo->r_pcrel) {
-				continue;
-			}
-			else {
-				return LOADER_BADRELOC;
-			}
-		}
+	if (!index->syms) {
+		loader_return_t ret = _symtab_build_index(file);
 		
-		entry = (uint32_t*)add_ptr3(rinfo->r_address, sect->addr, file->base);
-		if (is_bad_addr(file, entry)) {
-			/* Wait a second ... */
-			return LOADER_OUTOFBOUNDS;
+		if (ret != LOADER_SUCCESS) {
+			return ret;
 		}
+	}
+	
+	addr = (uint32_t)((loader_bias_t)addr - file->loader_bias);
+	high = index->nsyms;
+	
+	/* Last entry at or below the address */
+	while (low < high)
+	{
+		uint32_t mid = (low + high) / 2;
 		
-		if (rinfo->r_extern) {
-			/* External (unresolved) symbol entry */
-			
-			//uint32_t sn = rinfo->r_symbolnum; /* Symbol index */
-			
-			return LOADER_BADRELOC;
+		if (index->syms[mid].addr <= addr) {
+			low = mid + 1;
 		}
 		else {
-			/* Internal symbol */
-			
-			uint32_t ordinal = rinfo->r_symbolnum; /* Section ordinal */
-			
-			if (ordinal == R_ABS) {
-				/* Absolute relocs not supported */
-				return LOADER_BADRELOC;
-			}
-			
-			/*
-			 * Entry points to a symbol address that we can slide
-			 * by a given bias, therefore relocating the entry. We
-			 * could also do a symbol lookup by its address, if we wanted.
-			 */
-			
-			*entry += (uint32_t)file->loader_bias;
+			high = mid;
 		}
 	}
 	
+	if (low == 0) {
+		return LOADER_SYMBOL_NOT_FOUND;
+	}
+	
+	sym = &file->symbol_base[index->syms[low - 1].sym];
+	
+	/* Past the end of the symbol's section isn't in the symbol */
+	sect = _sect_by_index(file, sym->n_sect);
+	if (sect && (addr < sect->addr || addr - sect->addr >= sect->size)) {
+		return LOADER_SYMBOL_NOT_FOUND;
+	}
+	
+	*name = file->string_base + sym->n_un.n_strx;
+	*offset = addr - index->syms[low - 1].addr;
+	
 	return LOADER_SUCCESS;
 }
 
+/*
+ * _sect_by_ordinal
+ *
+ * Gets a section from a segment with a given ordinal.
+ */
+static struct section*
+_sect_by_ordinal(mach_loader_context_t* file, struct segment_command* seg, uint32_t ordinal)
+{
+	struct section* sect = (struct section*)(seg+1);
+	return &sect[ordinal-1];
+}
+
+#define MAX_SECT_TAB 10
+
 /*
  * mach_file_relocate_object
  *
  * Relocate all symbols in the object file in accordance
- * with the loader bias.
+ * with the loader bias. All sections are checked before
+ * any of them is patched (see macho_reloc.c).
  */
 loader_return_t mach_file_relocate_object(mach_loader_context_t* file)
 {
 	struct segment_command* cmd;
+	mach_reloc_plan_t plan;
+	memory_region_t mark;
+	loader_return_t ret;
+	uint32_t nrel = 0;
 	
 	if (file->filetype != MH_OBJECT) {
 		/* This only works on objects */
@@ -437,17 +466,36 @@ loader_return_t mach_file_relocate_object(mach_loader_context_t* file)
 	}
 	
 	cmd = file->first_segment;
+	if (!cmd) {
+		return LOADER_OBJECT_BADSEGMENT;
+	}
 	
 	for (uint32_t i = 0; i < cmd->nsects; i++) {
-		loader_return_t ret = _relocate_sect(file, cmd, i+1);
+		nrel += _sect_by_ordinal(file, cmd, i+1)->nreloc;
+	}
+	
+	scratch_mark(&mark);
+	
+	ret = mach_reloc_plan_init(&plan, nrel);
+	
+	for (uint32_t i = 0; i < cmd->nsects && ret == LOADER_SUCCESS; i++) {
+		struct section* sect = _sect_by_ordinal(file, cmd, i+1);
 		
-		if (ret != LOADER_SUCCESS) {
-			/* We fucked up ... */
-			return ret;
-		}
+		/* The relocation info stuff is in the source file */
+		ret = mach_reloc_plan_add(file,
+			&plan,
+			(struct relocation_info *)add_ptr2(file->file, sect->reloff),
+			sect->nreloc,
+			(uint8_t*)add_ptr2(file->base, sect->addr));
 	}
 	
-	return LOADER_SUCCESS;
+	if (ret == LOADER_SUCCESS) {
+		mach_reloc_plan_apply(file, &plan);
+	}
+	
+	scratch_release(&mark);
+	
+	return ret;
 }
 
 /*
@@ -458,60 +506,58 @@ loader_return_t mach_file_relocate_object(mach_loader_context_t* file)
  */
 loader_return_t mach_file_relocate_executable(mach_loader_context_t* file)
 {
+	struct relocation_info* rbase;
+	mach_reloc_plan_t plan;
+	memory_region_t mark;
+	loader_return_t ret;
+	
 	if (file->filetype != MH_EXECUTE) {
 		/* This only works on execs */
 		return LOADER_BADFILETYPE;
 	}
 	
+	if (!mach_file_index(file)) {
+		return LOADER_MALFORMED;
+	}
+	
+	if (mach_file_index(file)->dyld_info) {
+		/* Newer toolchains, rebase opcodes instead of relocations */
+		return mach_file_rebase(file);
+	}
+	
 	if (file->dsymtab == NULL) {
 		/* No symtab, wut? */
 		return LOADER_EXEC_UNSUPPORTED;
 	}
 	
-	struct relocation_info* rbase;
-	
 	/* The relocation info stuff is in the source file */
-	rbase = (struct relocation_info *)add_ptr2(file->file, file->dsymtab->locreloff);
+	rbase = (struct relocation_info *)mach_file_data(file,
+		file->dsymtab->locreloff,
+		file->dsymtab->nlocrel * sizeof(struct relocation_info));
 	
-	/* Relocation iterator */
-	for (uint32_t i = 0; i < file->dsymtab->nlocrel; i++)
-	{
-		struct relocation_info* rinfo = &rbase[i]; /* Relocation offset */
-		if (is_bad_file_addr(file, rinfo)) {
-			return LOADER_OUTOFBOUNDS;
-		}
-		
-		if (rinfo->r_address & R_SCATTERED)
-		{
-			/* Handle a scattered relocation */
-			return LOADER_BADRELOC;
-		}
-		else
-		{
-			/* Handle a regular relocation */
-			if (rinfo->r_length != 2) {
-				/* Bad size, probably unsupported file */
-				return LOADER_BADRELOC;
-			}
-			if (rinfo->r_type != GENERIC_RELOC_VANILLA) {
-				/* Unsupported relocation type */
-				return LOADER_BADRELOC;
-			}
-			if (rinfo->r_symbolnum == R_ABS) {
-				return LOADER_BADRELOC;
-			}
-			
-			/* Relocate */
-			uint32_t* pp = (uint32_t*)add_ptr2(file->base, rinfo->r_address);
-			if (is_bad_addr(file, pp)) {
-				return LOADER_OUTOFBOUNDS;
-			}
-			
-			*pp = (uint32_t)((loader_bias_t)*pp + file->loader_bias);
-		}
+	if (!rbase && file->dsymtab->nlocrel) {
+		return LOADER_MALFORMED;
 	}
 	
-	return LOADER_SUCCESS;
+	scratch_mark(&mark);
+	
+	ret = mach_reloc_plan_init(&plan, file->dsymtab->nlocrel);
+	
+	if (ret == LOADER_SUCCESS) {
+		ret = mach_reloc_plan_add(file,
+			&plan,
+			rbase,
+			file->dsymtab->nlocrel,
+			file->base);
+	}
+	
+	if (ret == LOADER_SUCCESS) {
+		mach_reloc_plan_apply(file, &plan);
+	}
+	
+	scratch_release(&mark);
+	
+	return ret;
 }
 
 /*
@@ -532,13 +578,201 @@ loader_return_t mach_file_get_entry_point(mach_loader_context_t* file, uint32_t*
 	return LOADER_SUCCESS;
 }
 
+/*
+ * _name_hash
+ *
+ * FNV-1a, good enough for symbol names and cheap to do per lookup.
+ */
+static uint32_t
+_name_hash(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	
+	return hash;
+}
+
+/*
+ * _export_symbol
+ *
+ * Gets the 'i'th exported symbol of the file, through the dylib
+ * table of contents if it has one, or from the extdef range of the
+ * symtab if not. Returns the symtab index, or ~0 if it's bogus.
+ */
+static uint32_t
+_export_symbol(mach_loader_context_t* file, const struct dylib_table_of_contents* toc, uint32_t i)
+{
+	uint32_t sym;
+	
+	if (toc) {
+		sym = toc[i].symbol_index;
+	}
+	else {
+		sym = file->dsymtab->iextdefsym + i;
+	}
+	
+	if (sym >= file->symtab->nsyms ||
+		(uint32_t)file->symbol_base[sym].n_un.n_strx >= file->symtab->strsize)
+	{
+		return ~0;
+	}
+	
+	return sym;
+}
+
+/*
+ * _mapped_file_ptr
+ *
+ * Finds where a file offset ended up in an image that was mapped
+ * by mach_file_map with 'load_addr' for the VM bias.
+ */
+static void*
+_mapped_file_ptr(mach_loader_context_t* file, uint32_t off, uint32_t size)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	
+	for (uint32_t i = 0; i < index->nsegments; i++)
+	{
+		struct segment_command* cmd = index->segments[i];
+		
+		if (off >= cmd->fileoff &&
+			size <= cmd->filesize &&
+			off - cmd->fileoff <= cmd->filesize - size)
+		{
+			return (void*)add_ptr3(file->base, cmd->vmaddr - file->vm_bias, off - cmd->fileoff);
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * mach_file_data
+ *
+ * Gets 'size' bytes at file offset 'off', wherever they are.
+ */
+void*
+mach_file_data(mach_loader_context_t* file, uint32_t off, uint32_t size)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	
+	if (!index) {
+		return NULL;
+	}
+	
+	if (index->mapped) {
+		return _mapped_file_ptr(file, off, size);
+	}
+	
+	return (void*)add_ptr2(file->file, off);
+}
+
+/*
+ * _exports_build_index
+ *
+ * Builds a hash table over the exported symbols, so every lookup
+ * after it is a hash and (usually) a single strcmp. The table is
+ * at most half full. The export counts are checked against the
+ * symtab here, before anything is sized by them. The table lives as
+ * long as the context, mach_file_destroy frees it.
+ */
+static loader_return_t
+_exports_build_index(mach_loader_context_t* file, const struct dylib_table_of_contents* toc)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	uint32_t nsyms = file->symtab->nsyms;
+	uint32_t count = toc ? file->dsymtab->ntoc : file->dsymtab->nextdefsym;
+	mach_name_entry_t* names;
+	uint32_t size = 16;
+	
+	if (!toc && file->dsymtab->iextdefsym > nsyms) {
+		return LOADER_MALFORMED;
+	}
+	
+	if (count > (toc ? nsyms : nsyms - file->dsymtab->iextdefsym) ||
+		count > 0xFFFFFFFF / (4 * sizeof(mach_name_entry_t)))
+	{
+		return LOADER_MALFORMED;
+	}
+	
+	while (size < count * 2) {
+		size <<= 1;
+	}
+	
+	names = (mach_name_entry_t*)malloc(sizeof(mach_name_entry_t) * size);
+	if (!names) {
+		return LOADER_OUTOFBOUNDS;
+	}
+	
+	memset((void*)names, 0xff, sizeof(mach_name_entry_t) * size);
+	
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t sym = _export_symbol(file, toc, i);
+		uint32_t hash;
+		uint32_t slot;
+		
+		if (sym == ~0) {
+			continue;
+		}
+		
+		hash = _name_hash(file->string_base + file->symbol_base[sym].n_un.n_strx);
+		slot = hash & (size - 1);
+		
+		while (names[slot].sym != ~0) {
+			slot = (slot + 1) & (size - 1);
+		}
+		
+		names[slot].hash = hash;
+		names[slot].sym = sym;
+	}
+	
+	index->names = names;
+	index->names_mask = size - 1;
+	
+	return LOADER_SUCCESS;
+}
+
+static const struct nlist*
+_exports_lookup(mach_loader_context_t* file, const char* name)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	uint32_t hash = _name_hash(name);
+	uint32_t slot = hash & index->names_mask;
+	
+	for (; index->names[slot].sym != ~0; slot = (slot + 1) & index->names_mask)
+	{
+		const struct nlist* sym = &file->symbol_base[index->names[slot].sym];
+		
+		if (index->names[slot].hash == hash &&
+			strcmp(file->string_base + sym->n_un.n_strx, name) == 0)
+		{
+			return sym;
+		}
+	}
+	
+	return NULL;
+}
+
 /*
  * mach_file_find_symbol
  *
- * Finds an exported symbol.
+ * Finds an exported symbol. The first lookup builds a hash table
+ * over the exports. If there's no room for it, this falls back to
+ * a binary search.
  */
 loader_return_t mach_file_find_symbol(mach_loader_context_t* file, const char* name, uint32_t* sym)
 {
+	const struct dylib_table_of_contents* toc = NULL;
+	mach_lc_index_t* index = mach_file_index(file);
+	
+	if (!index) {
+		return LOADER_MALFORMED;
+	}
 	if (file->filetype != MH_EXECUTE) {
 		/* This only works on execs */
 		return LOADER_BADFILETYPE;
@@ -551,20 +785,48 @@ loader_return_t mach_file_find_symbol(mach_loader_context_t* file, const char* n
 		return LOADER_MALFORMED;
 	}
 	
+	if (file->dsymtab->tocoff != 0)
+	{
+		toc = (const struct dylib_table_of_contents*)mach_file_data(file,
+			file->dsymtab->tocoff,
+			file->dsymtab->ntoc * sizeof(struct dylib_table_of_contents));
+		
+		if (!toc) {
+			return LOADER_MALFORMED;
+		}
+	}
+	
 	const struct nlist* s = NULL;
+	loader_return_t ret = LOADER_SUCCESS;
+	
+	if (!index->names) {
+		ret = _exports_build_index(file, toc);
+	}
 	
-	if (file->dsymtab->tocoff == 0)
+	if (ret == LOADER_MALFORMED)
+	{
+		return ret;
+	}
+	else if (ret == LOADER_SUCCESS)
+	{
+		s = _exports_lookup(file, name);
+	}
+	else if (toc)
+	{
+		s = binary_search_toc(name,
+							  file->string_base,
+							  file->symbol_base,
+							  toc,
+							  file->dsymtab->ntoc,
+							  file->dsymtab->ntoc);
+	}
+	else
 	{
 		s = binary_search(name,
 						  file->string_base,
 						  &file->symbol_base[file->dsymtab->iextdefsym],
 						  file->dsymtab->nextdefsym);
 	}
-	else
-	{
-		/* XXX */
-		return LOADER_EXEC_UNSUPPORTED;
-	}
 	
 	if (!s) {
 		/* Didn't find the symbol */
@@ -591,57 +853,54 @@ loader_return_t mach_file_code_data_range(mach_loader_context_t* file, uint32_t*
 		return LOADER_BADFILETYPE;
 	}
 	
-	mach_header_t* head = fhead(file);
-	struct load_command* lcp = (struct load_command*)(head+1);
+	mach_lc_index_t* index = mach_file_index(file);
 	uint32_t last_vmaddr = 0;
-	uint32_t seg_index = 0;
-	uint32_t seg_accounted = 0;
 	uint32_t code_start = 0;
 	uint32_t vmsize = 0;
 	
-	for_each_lc(lcp, head)
+	if (!index) {
+		return LOADER_MALFORMED;
+	}
+	
+	for (uint32_t seg_index = 0; seg_index < index->nsegments; seg_index++)
 	{
-		if (lcp->cmd == LC_SEGMENT)
-		{
-			struct segment_command* cmd = (struct segment_command*)lcp;
-			
-			if (cmd->vmaddr != last_vmaddr) {
-				return LOADER_EXEC_NONCONTIGIOUS;
-			}
+		struct segment_command* cmd = index->segments[seg_index];
+		
+		if (cmd->vmaddr != last_vmaddr) {
+			return LOADER_EXEC_NONCONTIGIOUS;
+		}
+		
+		if (seg_index == 1) {
+			/* should be __TEXT */
 			
-			if (seg_index == 1) {
-				/* should be __TEXT */
+			if (strcmp(cmd->segname, SEG_TEXT) == 0) {
+				/* Figure out where the actual __TEXT starts */
+				struct section* sect;
 				
-				if (strcmp(cmd->segname, SEG_TEXT) == 0) {
-					/* Figure out where the actual __TEXT starts */
-					struct section* sect = _sect_by_ordinal(file, cmd, 1);
-					if (!sect) {
-						return LOADER_MALFORMED;
-					}
-					
-					code_start = sect->addr;
-					vmsize += cmd->vmsize - (sect->addr - cmd->vmaddr);
-					seg_accounted++;
-				}
-				else {
-					return LOADER_EXEC_UNEXPECTED_SEG;
+				if (!cmd->nsects) {
+					return LOADER_MALFORMED;
 				}
-			}
-			else if (seg_index == 2) {
-				/* should be __DATA */
 				
-				if (strcmp(cmd->segname, SEG_DATA) == 0) {
-					vmsize += cmd->vmsize;
-					seg_accounted++;
-				}
-				else {
-					return LOADER_EXEC_UNEXPECTED_SEG;
-				}
+				sect = _sect_by_ordinal(file, cmd, 1);
+				code_start = sect->addr;
+				vmsize += cmd->vmsize - (sect->addr - cmd->vmaddr);
 			}
+			else {
+				return LOADER_EXEC_UNEXPECTED_SEG;
+			}
+		}
+		else if (seg_index == 2) {
+			/* should be __DATA */
 			
-			last_vmaddr = cmd->vmaddr + cmd->vmsize;
-			seg_index++;
+			if (strcmp(cmd->segname, SEG_DATA) == 0) {
+				vmsize += cmd->vmsize;
+			}
+			else {
+				return LOADER_EXEC_UNEXPECTED_SEG;
+			}
 		}
+		
+		last_vmaddr = cmd->vmaddr + cmd->vmsize;
 	}
 	
 	*start = code_start;
@@ -650,14 +909,148 @@ loader_return_t mach_file_code_data_range(mach_loader_context_t* file, uint32_t*
 	return LOADER_SUCCESS;
 }
 
+/* Indexes of live contexts, and the last one looked up */
+static mach_lc_index_t* gIndexes = NULL;
+static mach_lc_index_t* gLastIndex = NULL;
+
+/*
+ * mach_file_index
+ *
+ * The load command index mach_file_init built for 'file', NULL if
+ * it wasn't made by mach_file_init or has been destroyed.
+ */
+mach_lc_index_t* mach_file_index(mach_loader_context_t* file)
+{
+	mach_lc_index_t* index;
+	
+	if (gLastIndex && gLastIndex->owner == file)
+		return gLastIndex;
+	
+	for (index = gIndexes; index; index = index->next) {
+		if (index->owner == file) {
+			gLastIndex = index;
+			return index;
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * _index_attach
+ *
+ * Makes 'index' the one for 'file', dropping any a context at the
+ * same address was never destroyed with.
+ */
+static void _index_attach(mach_loader_context_t* file, mach_lc_index_t* index)
+{
+	mach_file_destroy(file);
+	
+	index->owner = file;
+	index->next = gIndexes;
+	gIndexes = index;
+	gLastIndex = index;
+}
+
+/*
+ * _index_load_commands
+ *
+ * Walks the load commands once, checking each one fits in
+ * 'sizeofcmds' and is big enough for what it claims to be,
+ * and files away the ones the loader cares about.
+ */
+static loader_return_t
+_index_load_commands(mach_loader_context_t* file, mach_lc_index_t* index)
+{
+	mach_header_t* head = fhead(file);
+	uint8_t* lcp = (uint8_t*)(head+1);
+	uint32_t left = head->sizeofcmds;
+	
+	for (uint32_t i = 0; i < head->ncmds; i++)
+	{
+		struct load_command* lc = (struct load_command*)lcp;
+		
+		if (left < sizeof(struct load_command) ||
+			lc->cmdsize < sizeof(struct load_command) ||
+			lc->cmdsize > left ||
+			(lc->cmdsize & 3))
+		{
+			return LOADER_MALFORMED;
+		}
+		
+		if (lc->cmd == LC_SEGMENT)
+		{
+			struct segment_command* cmd = (struct segment_command*)lc;
+			
+			if (lc->cmdsize < sizeof(struct segment_command) ||
+				cmd->nsects > (lc->cmdsize - sizeof(struct segment_command)) / sizeof(struct section))
+			{
+				return LOADER_MALFORMED;
+			}
+			
+			if (file->filetype == MH_OBJECT && index->nsegments) {
+				/* Object files can only have one segment */
+				return LOADER_OBJECT_BADSEGMENT;
+			}
+			
+			if (index->nsegments == MACH_MAX_SEGMENTS) {
+				return LOADER_MALFORMED;
+			}
+			
+			index->segments[index->nsegments++] = cmd;
+			index->nsections += cmd->nsects;
+		}
+		else if (lc->cmd == LC_SYMTAB)
+		{
+			if (lc->cmdsize < sizeof(struct symtab_command)) {
+				return LOADER_MALFORMED;
+			}
+			
+			index->symtab = (struct symtab_command*)lc;
+		}
+		else if (lc->cmd == LC_DYSYMTAB)
+		{
+			if (lc->cmdsize < sizeof(struct dysymtab_command)) {
+				return LOADER_MALFORMED;
+			}
+			
+			index->dsymtab = (struct dysymtab_command*)lc;
+		}
+		else if (lc->cmd == LC_DYLD_INFO || lc->cmd == LC_DYLD_INFO_ONLY)
+		{
+			if (lc->cmdsize < sizeof(struct dyld_info_command)) {
+				return LOADER_MALFORMED;
+			}
+			
+			index->dyld_info = (struct dyld_info_command*)lc;
+		}
+		else if (lc->cmd == LC_UNIXTHREAD)
+		{
+			if (lc->cmdsize < sizeof(thread_command_t)) {
+				return LOADER_MALFORMED;
+			}
+			
+			index->thread = (thread_command_t*)lc;
+		}
+		
+		left -= lc->cmdsize;
+		lcp += lc->cmdsize;
+	}
+	
+	return LOADER_SUCCESS;
+}
+
 /*
  * mach_file_init
  *
- * Creates a new mach-o context.
+ * Creates a new mach-o context. Has to be paired with
+ * mach_file_destroy once it succeeds.
  */
 loader_return_t mach_file_init(mach_loader_context_t* file, uint8_t* fbase)
 {
 	mach_header_t* head = (mach_header_t*)fbase;
+	mach_lc_index_t* index;
+	loader_return_t ret;
 	
 	/* Check file sanity */
 	if (head->magic != MH_MAGIC) {
@@ -670,14 +1063,149 @@ loader_return_t mach_file_init(mach_loader_context_t* file, uint8_t* fbase)
 		return LOADER_BADFILETYPE;
 	}
 	
+	bzero((void*)file, sizeof(mach_loader_context_t));
+	
 	file->filetype = head->filetype;
 	file->file = fbase;
 	file->vm_bias = 0;
 	file->is_prelinked = false;
 	
+	index = (mach_lc_index_t*)malloc(sizeof(mach_lc_index_t));
+	if (!index) {
+		return LOADER_OUTOFBOUNDS;
+	}
+	
+	bzero((void*)index, sizeof(mach_lc_index_t));
+	
+	ret = _index_load_commands(file, index);
+	if (ret != LOADER_SUCCESS) {
+		free((void*)index);
+		return ret;
+	}
+	
+	_index_attach(file, index);
+	
+	/* Everything below used to be found while mapping */
+	file->symtab = index->symtab;
+	file->dsymtab = index->dsymtab;
+	file->dyld_info = index->dyld_info;
+	file->compressed = (index->dyld_info != NULL);
+	
+	if (index->symtab) {
+		file->string_base = (char*)add_ptr2(file->file, index->symtab->stroff);
+		file->symbol_base = (struct nlist *)add_ptr2(file->file, index->symtab->symoff);
+	}
+	
+	if (index->thread) {
+		file->entry_point = index->thread->state.pc;
+	}
+	
+	if (file->filetype == MH_OBJECT && index->nsegments) {
+		/* Save the first segment for convinience */
+		file->first_segment = index->segments[0];
+	}
+	
+	for (uint32_t i = 0; i < index->nsegments; i++)
+	{
+		struct segment_command* cmd = index->segments[i];
+		
+		if (strncmp(cmd->segname, kPrelinkInfoSegment, 15) == 0) {
+			/* If the prelink segment has stuff in it, then this
+			 * is a prelinked kernel image */
+			
+			if (cmd->vmsize != 0) {
+				file->is_prelinked = true;
+			}
+		}
+	}
+	
 	return LOADER_SUCCESS;
 }
 
+/*
+ * mach_file_init_mapped
+ *
+ * Creates a context for an executable that mach_file_map already
+ * mapped to 'load_addr' with 'vm_bias', for symbol lookups once the
+ * original file is gone. The first segment has to start with the
+ * header and be mapped at 'vm_bias', as a kernel's __TEXT is.
+ */
+loader_return_t mach_file_init_mapped(mach_loader_context_t* file, uint8_t* load_addr, uint32_t vm_bias)
+{
+	mach_lc_index_t* index;
+	struct symtab_command* symtab;
+	loader_return_t ret;
+	
+	ret = mach_file_init(file, load_addr);
+	if (ret != LOADER_SUCCESS) {
+		return ret;
+	}
+	
+	index = mach_file_index(file);
+	symtab = index->symtab;
+	
+	file->base = load_addr;
+	file->vm_bias = vm_bias;
+	index->mapped = true;
+	file->string_base = NULL;
+	file->symbol_base = NULL;
+	
+	if (file->filetype != MH_EXECUTE ||
+		!index->nsegments ||
+		index->segments[0]->fileoff != 0 ||
+		index->segments[0]->vmaddr != vm_bias)
+	{
+		mach_file_destroy(file);
+		return LOADER_EXEC_UNSUPPORTED;
+	}
+	
+	if (symtab) {
+		file->symbol_base = (struct nlist*)_mapped_file_ptr(file,
+			symtab->symoff,
+			symtab->nsyms * sizeof(struct nlist));
+		file->string_base = (char*)_mapped_file_ptr(file,
+			symtab->stroff,
+			symtab->strsize);
+	}
+	
+	if (!file->symbol_base || !file->string_base) {
+		mach_file_destroy(file);
+		return LOADER_NOSYMTAB;
+	}
+	
+	return LOADER_SUCCESS;
+}
+
+/*
+ * mach_file_destroy
+ *
+ * Frees what mach_file_init and the lookups allocated for the
+ * context.
+ */
+void mach_file_destroy(mach_loader_context_t* file)
+{
+	mach_lc_index_t** link;
+	
+	for (link = &gIndexes; *link; link = &(*link)->next) {
+		mach_lc_index_t* index = *link;
+		
+		if (index->owner == file) {
+			*link = index->next;
+			
+			if (gLastIndex == index)
+				gLastIndex = NULL;
+			
+			if (index->syms)
+				free((void*)index->syms);
+			if (index->names)
+				free((void*)index->names);
+			
+			free((void*)index);
+			return;
+		}
+	}
+}
+
 void mach_file_set_vm_bias(mach_loader_context_t* file, uint32_t loader_bias)
 {
 	file->vm_bias = loader_bias;
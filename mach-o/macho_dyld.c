@@ -0,0 +1,211 @@
+/*
+ * macho_dyld.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Rebasing of images that carry compressed dyld info (LC_DYLD_INFO)
+ * instead of classic relocations. The rebase info is a stream of
+ * opcodes that move a cursor through the segments and slide the
+ * pointer under it. Runs of rebases that the opcodes give a count
+ * for are bounds checked once, then done in a plain loop.
+ *
+ * Binds aren't done. The kernel imports nothing and kexts are linked
+ * by the kernel itself, so nothing the loader maps has any.
+ */
+
+#include <bootkit/runtime.h>
+#include <bootkit/mach-o/macho_loader.h>
+#include <bootkit/mach-o/macho.h>
+
+#include "macho_index.h"
+
+typedef struct {
+	const uint8_t* p;
+	const uint8_t* end;
+	boolean_t bad;
+} opcode_stream_t;
+
+static uint32_t read_uleb(opcode_stream_t* s)
+{
+	uint32_t value = 0;
+	uint32_t shift = 0;
+	uint8_t byte;
+
+	do {
+		if (s->p >= s->end || shift > 28) {
+			s->bad = true;
+			return 0;
+		}
+
+		byte = *s->p++;
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return value;
+}
+
+static boolean_t open_stream(mach_loader_context_t* file, uint32_t off, uint32_t size, opcode_stream_t* s)
+{
+	s->p = (const uint8_t*)mach_file_data(file, off, size);
+	s->end = s->p + size;
+	s->bad = false;
+
+	return (s->p != NULL);
+}
+
+/*
+ * segment_run
+ *
+ * Where a run of 'count' pointers, 'stride' bytes apart, starting
+ * 'offset' bytes into segment 'seg' is mapped. NULL if any of them
+ * falls outside the segment.
+ */
+static uint32_t* segment_run(mach_loader_context_t* file,
+	uint32_t seg,
+	uint32_t offset,
+	uint32_t count,
+	uint32_t stride)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	struct segment_command* cmd;
+	uint64_t last;
+
+	if (seg >= index->nsegments || !count)
+		return NULL;
+
+	cmd = index->segments[seg];
+	last = (uint64_t)offset + (uint64_t)(count - 1) * stride + sizeof(uint32_t);
+
+	if (last > cmd->vmsize)
+		return NULL;
+
+	return (uint32_t*)add_ptr3(file->base, cmd->vmaddr - file->vm_bias, offset);
+}
+
+/*---------------------------------------------------------------*/
+/* rebase */
+
+/*
+ * rebase_run
+ *
+ * Slides 'count' pointers 'stride' bytes apart by 'delta'.
+ */
+static void rebase_run(uint32_t* p, uint32_t count, uint32_t stride, uint32_t delta)
+{
+	if (stride == sizeof(uint32_t)) {
+		/* By far the most common, a table of pointers */
+		for (uint32_t i = 0; i < count; i++)
+			p[i] += delta;
+	}
+	else {
+		for (uint32_t i = 0; i < count; i++) {
+			*p += delta;
+			p = (uint32_t*)add_ptr2(p, stride);
+		}
+	}
+}
+
+/*
+ * mach_file_rebase
+ *
+ * Slides a mapped image by its loader bias, by running its rebase
+ * opcodes.
+ */
+loader_return_t mach_file_rebase(mach_loader_context_t* file)
+{
+	mach_lc_index_t* index = mach_file_index(file);
+	struct dyld_info_command* dyld_info;
+	uint32_t slide = (uint32_t)file->loader_bias;
+	opcode_stream_t s;
+	uint32_t type = REBASE_TYPE_POINTER;
+	uint32_t seg = ~0;
+	uint32_t offset = 0;
+
+	if (!index)
+		return LOADER_MALFORMED;
+
+	dyld_info = index->dyld_info;
+
+	if (!dyld_info || !dyld_info->rebase_size || !slide) {
+		/* Nothing to slide */
+		return LOADER_SUCCESS;
+	}
+
+	if (!open_stream(file, dyld_info->rebase_off, dyld_info->rebase_size, &s))
+		return LOADER_MALFORMED;
+
+	while (s.p < s.end)
+	{
+		uint8_t opcode = *s.p & REBASE_OPCODE_MASK;
+		uint8_t imm = *s.p & REBASE_IMMEDIATE_MASK;
+		uint32_t count = 0;
+		uint32_t skip = 0;
+		uint32_t delta;
+		uint32_t* p;
+
+		s.p++;
+
+		switch (opcode)
+		{
+			case REBASE_OPCODE_DONE:
+				return LOADER_SUCCESS;
+			case REBASE_OPCODE_SET_TYPE_IMM:
+				type = imm;
+				break;
+			case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+				seg = imm;
+				offset = read_uleb(&s);
+				break;
+			case REBASE_OPCODE_ADD_ADDR_ULEB:
+				offset += read_uleb(&s);
+				break;
+			case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+				offset += imm * sizeof(uint32_t);
+				break;
+			case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+				count = imm;
+				break;
+			case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+				count = read_uleb(&s);
+				break;
+			case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+				count = 1;
+				skip = read_uleb(&s);
+				break;
+			case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB:
+				count = read_uleb(&s);
+				skip = read_uleb(&s);
+				break;
+			default:
+				return LOADER_MALFORMED;
+		}
+
+		if (s.bad)
+			return LOADER_MALFORMED;
+
+		if (!count)
+			continue;
+
+		if (type == REBASE_TYPE_POINTER || type == REBASE_TYPE_TEXT_ABSOLUTE32)
+			delta = slide;
+		else if (type == REBASE_TYPE_TEXT_PCREL32)
+			delta = -slide;
+		else
+			return LOADER_BADRELOC;
+
+		p = segment_run(file, seg, offset, count, sizeof(uint32_t) + skip);
+		if (!p)
+			return LOADER_OUTOFBOUNDS;
+
+		if (((uintptr_t)p | skip) & 3) {
+			/* Unaligned pointers would fault */
+			return LOADER_BADRELOC;
+		}
+
+		rebase_run(p, count, sizeof(uint32_t) + skip, delta);
+
+		offset += count * (sizeof(uint32_t) + skip);
+	}
+
+	return LOADER_SUCCESS;
+}
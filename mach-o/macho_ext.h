@@ -0,0 +1,24 @@
+/*
+ * macho_ext.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Mach-O loader calls that aren't in bootkit/mach-o/macho.h. Include
+ * after it.
+ */
+
+#ifndef _MACHO_EXT_H
+#define _MACHO_EXT_H
+
+/* Context life cycle, see macho.c */
+extern loader_return_t mach_file_init_mapped(mach_loader_context_t* file, uint8_t* load_addr, uint32_t vm_bias);
+extern void mach_file_destroy(mach_loader_context_t* file);
+
+extern loader_return_t mach_file_symbol_for_address(mach_loader_context_t* file,
+	uint32_t addr,
+	const char** name,
+	uint32_t* offset);
+
+/* Compressed dyld info, see macho_dyld.c */
+extern loader_return_t mach_file_rebase(mach_loader_context_t* file);
+
+#endif
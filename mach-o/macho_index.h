@@ -0,0 +1,70 @@
+/*
+ * macho_index.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Load command index shared by the mach-o loader sources.
+ */
+
+#ifndef _MACHO_INDEX_H
+#define _MACHO_INDEX_H
+
+#include "macho_ext.h"
+#include "../main/scratch.h"
+
+#define MACH_MAX_SEGMENTS 16
+
+/*
+ * Load command index
+ *
+ * Built by mach_file_init in one pass over the load commands, which
+ * is the only place they get bounds checked. Everything after that
+ * reads the index instead of walking the commands again. Indexes are
+ * kept on a list by the context they belong to, which the public
+ * context structure has no room for.
+ */
+typedef struct _mach_lc_index {
+	mach_loader_context_t* owner;
+	struct _mach_lc_index* next;
+
+	struct segment_command* segments[MACH_MAX_SEGMENTS];
+	uint32_t nsegments;
+	uint32_t nsections;
+
+	struct symtab_command* symtab;
+	struct dysymtab_command* dsymtab;
+	struct dyld_info_command* dyld_info;
+	thread_command_t* thread;
+	
+	/* Address to symbol index, sorted by address (built on demand, malloc'd) */
+	struct _mach_sym_entry* syms;
+	uint32_t nsyms;
+	
+	/* Exported name hash table, power of two sized (built on demand, malloc'd) */
+	struct _mach_name_entry* names;
+	uint32_t names_mask;
+	
+	/* Mapped by mach_file_map rather than laid out as in the file */
+	boolean_t mapped;
+} mach_lc_index_t;
+
+extern mach_lc_index_t* mach_file_index(mach_loader_context_t* file);
+extern void* mach_file_data(mach_loader_context_t* file, uint32_t off, uint32_t size);
+
+/* Relocation plans, see macho_reloc.c */
+typedef struct _mach_reloc_op mach_reloc_op_t;
+
+typedef struct {
+	mach_reloc_op_t* ops;
+	uint32_t count;
+	uint32_t room;
+} mach_reloc_plan_t;
+
+extern loader_return_t mach_reloc_plan_init(mach_reloc_plan_t* plan, uint32_t room);
+extern loader_return_t mach_reloc_plan_add(mach_loader_context_t* file,
+	mach_reloc_plan_t* plan,
+	struct relocation_info* rel,
+	uint32_t nrel,
+	uint8_t* site_base);
+extern void mach_reloc_plan_apply(mach_loader_context_t* file, mach_reloc_plan_t* plan);
+
+#endif
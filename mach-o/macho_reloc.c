@@ -0,0 +1,454 @@
+/*
+ * macho_reloc.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * ARM relocation engine for the classic (non dyld info) relocations
+ * of objects and executables.
+ *
+ * Relocating is done in two passes over a plan. Adding relocations
+ * to the plan checks every one of them (type, length, pairing and
+ * that the patch point is in the image) and records only the ones
+ * that change anything, so an image with a single bad relocation
+ * is left untouched. Applying the plan then sorts what was recorded
+ * by address and patches it in that order with no checks at all.
+ *
+ * Every section moves by the same loader bias, so PC relative
+ * branches (ARM_RELOC_BR24, ARM_THUMB_RELOC_BR22 and such) and
+ * differences between two addresses in the image (the sectdiffs)
+ * stay as they are, once checked. Absolute pointers and movw/movt
+ * pairs (ARM_RELOC_HALF) get the bias added.
+ */
+
+#include <bootkit/runtime.h>
+#include <bootkit/mach-o/macho_loader.h>
+#include <bootkit/mach-o/macho.h>
+
+#include "macho_index.h"
+
+enum {
+	kRelocOpAdd = 0,  /* 32 bit pointer */
+	kRelocOpHalf = 1  /* movw or movt immediate */
+};
+
+#define RELOC_OP_KIND(info) ((info) & 0xff)
+#define RELOC_OP_UPPER 0x100  /* movt, this is the upper half */
+#define RELOC_OP_THUMB 0x200
+#define RELOC_OP_OTHER_HALF(info) ((info) >> 16)
+
+/* r_length of ARM_RELOC_HALF */
+#define HALF_LENGTH_UPPER 1
+#define HALF_LENGTH_THUMB 2
+
+struct _mach_reloc_op {
+	uintptr_t site;
+	uint32_t info; /* kind, flags and for halves the other half */
+};
+
+/*---------------------------------------------------------------*/
+/* movw/movt immediates */
+
+static uint32_t arm_get_imm16(uint32_t insn)
+{
+	return ((insn >> 4) & 0xf000) | (insn & 0xfff);
+}
+
+static uint32_t arm_set_imm16(uint32_t insn, uint32_t imm)
+{
+	return (insn & ~0xf0fff) | ((imm & 0xf000) << 4) | (imm & 0xfff);
+}
+
+/* Thumb-2 takes it as imm4:i:imm3:imm8 over two halfwords */
+static uint32_t thumb_get_imm16(uint16_t hw1, uint16_t hw2)
+{
+	return ((hw1 & 0xf) << 12) |
+		(((hw1 >> 10) & 1) << 11) |
+		(((hw2 >> 12) & 7) << 8) |
+		(hw2 & 0xff);
+}
+
+static void thumb_set_imm16(uint16_t* hw, uint32_t imm)
+{
+	hw[0] = (hw[0] & ~0x040f) | ((imm >> 12) & 0xf) | (((imm >> 11) & 1) << 10);
+	hw[1] = (hw[1] & ~0x70ff) | (((imm >> 8) & 7) << 12) | (imm & 0xff);
+}
+
+/*---------------------------------------------------------------*/
+/* validation */
+
+/*
+ * reloc_site
+ *
+ * Where a relocation patches, if all 'size' bytes of it are in the
+ * mapped image and it's aligned to 'align'. Zero if not.
+ */
+static uintptr_t reloc_site(mach_loader_context_t* file,
+	uint8_t* site_base,
+	uint32_t address,
+	uint32_t size,
+	uint32_t align)
+{
+	uintptr_t site = add_ptr2(site_base, address);
+	uintptr_t start = (uintptr_t)file->base;
+
+	if (site < start || site - start > file->vmsize || file->vmsize - (site - start) < size)
+		return 0;
+
+	if (site & (align - 1))
+		return 0;
+
+	return site;
+}
+
+static void plan_op(mach_reloc_plan_t* plan, uintptr_t site, uint32_t info)
+{
+	plan->ops[plan->count].site = site;
+	plan->ops[plan->count].info = info;
+	plan->count++;
+}
+
+/*
+ * plan_half
+ *
+ * Records a movw/movt, 'other' being the other half of the address
+ * (carried by its pair).
+ */
+static void plan_half(mach_reloc_plan_t* plan, uintptr_t site, uint32_t length, uint32_t other)
+{
+	uint32_t info = kRelocOpHalf;
+
+	if (length & HALF_LENGTH_UPPER)
+		info |= RELOC_OP_UPPER;
+	if (length & HALF_LENGTH_THUMB)
+		info |= RELOC_OP_THUMB;
+
+	plan_op(plan, site, info | ((other & 0xffff) << 16));
+}
+
+static boolean_t is_pair(struct relocation_info* pair, struct relocation_info* end)
+{
+	return (pair < end &&
+		!(pair->r_address & R_SCATTERED) &&
+		pair->r_type == ARM_RELOC_PAIR);
+}
+
+static boolean_t is_scattered_pair(struct relocation_info* pair, struct relocation_info* end)
+{
+	struct scattered_relocation_info* spair = (struct scattered_relocation_info*)pair;
+
+	return (pair < end &&
+		(pair->r_address & R_SCATTERED) &&
+		spair->r_type == ARM_RELOC_PAIR);
+}
+
+static loader_return_t add_scattered(mach_loader_context_t* file,
+	mach_reloc_plan_t* plan,
+	uint8_t* site_base,
+	struct relocation_info** cursor,
+	struct relocation_info* end)
+{
+	struct scattered_relocation_info* srel = (struct scattered_relocation_info*)*cursor;
+	struct relocation_info* pair = *cursor + 1;
+	uintptr_t site;
+
+	switch (srel->r_type)
+	{
+		case ARM_RELOC_VANILLA:
+		case ARM_RELOC_PB_LA_PTR:
+			if (srel->r_length != 2)
+				return LOADER_BADRELOC;
+
+			site = reloc_site(file, site_base, srel->r_address, 4, 4);
+			if (!site)
+				return LOADER_OUTOFBOUNDS;
+
+			if (!srel->r_pcrel)
+				plan_op(plan, site, kRelocOpAdd);
+			break;
+		case ARM_RELOC_SECTDIFF:
+		case ARM_RELOC_LOCAL_SECTDIFF:
+			/* A difference within the image, which doesn't move */
+			if (srel->r_length != 2 || !is_scattered_pair(pair, end))
+				return LOADER_BADRELOC;
+
+			if (!reloc_site(file, site_base, srel->r_address, 4, 1))
+				return LOADER_OUTOFBOUNDS;
+
+			*cursor = pair;
+			break;
+		case ARM_RELOC_HALF_SECTDIFF:
+			/* Same, split over a movw/movt */
+			if (!is_scattered_pair(pair, end))
+				return LOADER_BADRELOC;
+
+			if (!reloc_site(file, site_base, srel->r_address, 4, 2))
+				return LOADER_OUTOFBOUNDS;
+
+			*cursor = pair;
+			break;
+		case ARM_RELOC_HALF:
+			if (!is_scattered_pair(pair, end))
+				return LOADER_BADRELOC;
+
+			site = reloc_site(file, site_base, srel->r_address, 4,
+				(srel->r_length & HALF_LENGTH_THUMB) ? 2 : 4);
+			if (!site)
+				return LOADER_OUTOFBOUNDS;
+
+			plan_half(plan, site, srel->r_length,
+				((struct scattered_relocation_info*)pair)->r_address);
+
+			*cursor = pair;
+			break;
+		default:
+			return LOADER_BADRELOC;
+	}
+
+	return LOADER_SUCCESS;
+}
+
+static loader_return_t add_regular(mach_loader_context_t* file,
+	mach_reloc_plan_t* plan,
+	uint8_t* site_base,
+	struct relocation_info** cursor,
+	struct relocation_info* end)
+{
+	struct relocation_info* rel = *cursor;
+	uintptr_t site;
+
+	if (rel->r_extern) {
+		/* External (unresolved) symbol entry */
+		return LOADER_BADRELOC;
+	}
+
+	switch (rel->r_type)
+	{
+		case ARM_RELOC_VANILLA:
+			if (rel->r_length != 2)
+				return LOADER_BADRELOC;
+
+			if (rel->r_pcrel) {
+				/* Moves with what it points at */
+				break;
+			}
+
+			if (rel->r_symbolnum == R_ABS) {
+				/* Absolute relocs not supported */
+				return LOADER_BADRELOC;
+			}
+
+			site = reloc_site(file, site_base, rel->r_address, 4, 4);
+			if (!site)
+				return LOADER_OUTOFBOUNDS;
+
+			plan_op(plan, site, kRelocOpAdd);
+			break;
+		case ARM_RELOC_BR24:
+			if (rel->r_length != 2 || !rel->r_pcrel)
+				return LOADER_BADRELOC;
+
+			if (!reloc_site(file, site_base, rel->r_address, 4, 4))
+				return LOADER_OUTOFBOUNDS;
+			break;
+		case ARM_THUMB_RELOC_BR22:
+		case ARM_THUMB_32BIT_BRANCH:
+			if (rel->r_length != 2 || !rel->r_pcrel)
+				return LOADER_BADRELOC;
+
+			if (!reloc_site(file, site_base, rel->r_address, 4, 2))
+				return LOADER_OUTOFBOUNDS;
+			break;
+		case ARM_RELOC_HALF:
+			if (!is_pair(rel + 1, end))
+				return LOADER_BADRELOC;
+
+			if (rel->r_symbolnum == R_ABS) {
+				/* Absolute relocs not supported */
+				return LOADER_BADRELOC;
+			}
+
+			site = reloc_site(file, site_base, rel->r_address, 4,
+				(rel->r_length & HALF_LENGTH_THUMB) ? 2 : 4);
+			if (!site)
+				return LOADER_OUTOFBOUNDS;
+
+			plan_half(plan, site, rel->r_length, rel[1].r_address);
+
+			*cursor = rel + 1;
+			break;
+		default:
+			/* Includes a PAIR without anything before it */
+			return LOADER_BADRELOC;
+	}
+
+	return LOADER_SUCCESS;
+}
+
+/*
+ * mach_reloc_plan_init
+ *
+ * Makes room, in scratch, for a plan of up to 'room' relocations.
+ */
+loader_return_t mach_reloc_plan_init(mach_reloc_plan_t* plan, uint32_t room)
+{
+	plan->count = 0;
+	plan->room = room;
+	plan->ops = NULL;
+
+	if (!room)
+		return LOADER_SUCCESS;
+
+	plan->ops = (mach_reloc_op_t*)scratch_alloc(sizeof(mach_reloc_op_t) * room, 0);
+	if (!plan->ops)
+		return LOADER_OUTOFBOUNDS;
+
+	return LOADER_SUCCESS;
+}
+
+/*
+ * mach_reloc_plan_add
+ *
+ * Checks 'nrel' relocations whose addresses are relative to
+ * 'site_base' and adds the ones that patch anything to the plan.
+ */
+loader_return_t mach_reloc_plan_add(mach_loader_context_t* file,
+	mach_reloc_plan_t* plan,
+	struct relocation_info* rel,
+	uint32_t nrel,
+	uint8_t* site_base)
+{
+	struct relocation_info* end = rel + nrel;
+	loader_return_t ret;
+
+	if (plan->room - plan->count < nrel)
+		return LOADER_OUTOFBOUNDS;
+
+	for (; rel < end; rel++)
+	{
+		if (rel->r_address & R_SCATTERED)
+			ret = add_scattered(file, plan, site_base, &rel, end);
+		else
+			ret = add_regular(file, plan, site_base, &rel, end);
+
+		if (ret != LOADER_SUCCESS)
+			return ret;
+	}
+
+	return LOADER_SUCCESS;
+}
+
+/*---------------------------------------------------------------*/
+/* apply */
+
+static void op_sift_down(mach_reloc_op_t* ops, uint32_t root, uint32_t count)
+{
+	for (;;)
+	{
+		uint32_t child = root * 2 + 1;
+		mach_reloc_op_t tmp;
+
+		if (child >= count)
+			return;
+
+		if (child + 1 < count && ops[child + 1].site > ops[child].site)
+			child++;
+
+		if (ops[child].site <= ops[root].site)
+			return;
+
+		tmp = ops[root];
+		ops[root] = ops[child];
+		ops[child] = tmp;
+
+		root = child;
+	}
+}
+
+/*
+ * sort_ops
+ *
+ * Puts the ops in address order. Linkers emit relocations in
+ * descending address order, so that case is just turned around.
+ */
+static void sort_ops(mach_reloc_op_t* ops, uint32_t count)
+{
+	boolean_t descending = true;
+	uint32_t i;
+
+	for (i = 1; i < count && descending; i++)
+		descending = (ops[i].site < ops[i - 1].site);
+
+	if (descending) {
+		for (i = 0; i < count / 2; i++) {
+			mach_reloc_op_t tmp = ops[i];
+
+			ops[i] = ops[count - 1 - i];
+			ops[count - 1 - i] = tmp;
+		}
+
+		return;
+	}
+
+	for (i = count / 2; i > 0; i--)
+		op_sift_down(ops, i - 1, count);
+
+	for (i = count; i > 1; i--) {
+		mach_reloc_op_t tmp = ops[0];
+
+		ops[0] = ops[i - 1];
+		ops[i - 1] = tmp;
+
+		op_sift_down(ops, 0, i - 1);
+	}
+}
+
+static void apply_half(uintptr_t site, uint32_t info, uint32_t bias)
+{
+	uint32_t other = RELOC_OP_OTHER_HALF(info);
+	uint32_t half;
+	uint32_t value;
+
+	if (info & RELOC_OP_THUMB) {
+		uint16_t* hw = (uint16_t*)site;
+		half = thumb_get_imm16(hw[0], hw[1]);
+	}
+	else {
+		half = arm_get_imm16(*(uint32_t*)site);
+	}
+
+	if (info & RELOC_OP_UPPER)
+		value = ((half << 16) | other) + bias;
+	else
+		value = ((other << 16) | half) + bias;
+
+	half = (info & RELOC_OP_UPPER) ? (value >> 16) : (value & 0xffff);
+
+	if (info & RELOC_OP_THUMB)
+		thumb_set_imm16((uint16_t*)site, half);
+	else
+		*(uint32_t*)site = arm_set_imm16(*(uint32_t*)site, half);
+}
+
+/*
+ * mach_reloc_plan_apply
+ *
+ * Slides everything in the plan by the loader bias, in address
+ * order. Everything was checked when it was added.
+ */
+void mach_reloc_plan_apply(mach_loader_context_t* file, mach_reloc_plan_t* plan)
+{
+	mach_reloc_op_t* ops = plan->ops;
+	uint32_t bias = (uint32_t)file->loader_bias;
+
+	if (!bias || !plan->count)
+		return;
+
+	sort_ops(ops, plan->count);
+
+	for (uint32_t i = 0; i < plan->count; i++)
+	{
+		if (RELOC_OP_KIND(ops[i].info) == kRelocOpAdd)
+			*(uint32_t*)ops[i].site += bias;
+		else
+			apply_half(ops[i].site, ops[i].info, bias);
+	}
+}
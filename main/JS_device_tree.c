@@ -42,6 +42,8 @@ JSDT Device Tree format support based on JSMN parser.
 
 #include "../serialize/jsmn.h"
 
+#include "loader.h"
+
 #define PAD(x)
 #define BASE_PTR uint32_t
 #endif
@@ -334,23 +336,46 @@ int parse_jsdt_device_tree(BASE_PTR raw) {
 	int ret;
 	
 #if !HOST_CODE
+	memory_region_t mark;
+	
 	printf(KPROC(DTRE) "parsing JSDT device tree at 0x%08x ...\n", raw);
-#endif
 	
+	/* Tokens only live as long as the parse, keep them in scratch */
+	scratch_mark(&mark);
+	
+	token_cnt = 256;
+	tokens = scratch_alloc(sizeof(jsmntok_t) * token_cnt, 0);
+	
+	if (!tokens) {
+		return 0;
+	}
+#else
 	token_cnt = 40;
 	tokens = malloc(sizeof(jsmntok_t) * token_cnt);
 	
 	assert(tokens);
+#endif
 	
 parse_again:
 	jsmn_init(&parser);
 	err = jsmn_parse(&parser, (const char*)raw, tokens, token_cnt);
 	
 	if (err == JSMN_ERROR_NOMEM) {
+#if !HOST_CODE
+		/* Nothing else is in scratch, so the old tokens can just go */
+		token_cnt *= 2;
+		scratch_release(&mark);
+		tokens = scratch_alloc(sizeof(jsmntok_t) * token_cnt, 0);
+		
+		if (!tokens) {
+			return 0;
+		}
+#else
 		token_cnt += 100;
 		tokens = realloc(tokens, sizeof(jsmntok_t) * token_cnt);
 		
 		assert(tokens);
+#endif
 		
 		goto parse_again;
 	}
@@ -380,7 +405,11 @@ parse_again:
 		ret = 0;
 	}
 	
+#if !HOST_CODE
+	scratch_release(&mark);
+#else
 	free(tokens);
+#endif
 	
 	return ret;
 }
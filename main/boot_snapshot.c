@@ -0,0 +1,433 @@
+/*
+ * boot_snapshot.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * After imgx, kernel memory from the physical base to the kernel
+ * memory top holds the kernel mapped, zero filled and relocated,
+ * with the drivers and ramdisk behind it. 'snapshot save' writes all
+ * of it to a raw partition together with a boot state descriptor
+ * (see warm_boot.c), and 'snapshot load' reads it back into place
+ * with a few large sequential reads on later cold boots, without
+ * parsing or decompressing anything.
+ *
+ * On storage the snapshot is, each part starting on a block:
+ *
+ *   snapshot_header_t
+ *   boot state descriptor
+ *   kernel memory, physical base to kernel memory top
+ *
+ * The header lists the images the snapshot was made from (see
+ * image_sources) with two stamps of each, and 'snapshot load'
+ * refuses a snapshot whose images were rebuilt since. By default it
+ * only compares the quick stamps, which read the TOC and command
+ * headers of each image. 'snapshot load ... full' compares the full
+ * ones instead, reading every image back whole.
+ */
+
+#include <bootkit/runtime.h>
+
+#include <command.h>
+#include <part.h>
+
+#include "loader.h"
+#include "image_cache.h"
+#include "warm_boot.h"
+
+#define kSnapshotMagic ((uint32_t)'PANS')
+#define SNAPSHOT_VERSION 3
+
+/* Most blocks one transfer asks the device for */
+#define SNAPSHOT_MAX_BLOCKS 0x8000
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sum[2];   /* of the header, with this zeroed */
+
+	uint32_t desc_size;
+	uint32_t image_base;
+	uint32_t image_size;
+
+	/* Images on storage it was made from, see image_sources */
+	uint32_t nsources;
+	image_source_t sources[IMAGE_SOURCES_MAX];
+	uint32_t stamps[IMAGE_SOURCES_MAX][2];      /* quick */
+	uint32_t full_stamps[IMAGE_SOURCES_MAX][2]; /* whole images */
+} snapshot_header_t;
+
+typedef struct {
+	block_dev_desc_t* dev;
+	disk_partition_t part;
+} snapshot_dev_t;
+
+static int snapshot_open(const char* ifname, const char* dev_part, snapshot_dev_t* sd)
+{
+	if (get_device_and_partition(ifname, dev_part, &sd->dev, &sd->part, 1) < 0) {
+		printf(KERR "unable to open %s %s\n", ifname, dev_part);
+		return 1;
+	}
+
+	if (!sd->part.blksz || (sd->part.blksz & (sd->part.blksz - 1))) {
+		printf(KERR "%s %s has a bad block size (%lu)\n", ifname, dev_part, sd->part.blksz);
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t snapshot_blocks(snapshot_dev_t* sd, uint32_t size)
+{
+	return (size + sd->part.blksz - 1) / sd->part.blksz;
+}
+
+/*
+ * snapshot_io
+ *
+ * Reads or writes 'count' blocks from block 'blk' of the partition,
+ * in transfers as large as the device takes.
+ */
+static int snapshot_io(snapshot_dev_t* sd, uint32_t blk, uint32_t count, uint8_t* buf, boolean_t write)
+{
+	while (count) {
+		uint32_t n = (count > SNAPSHOT_MAX_BLOCKS) ? SNAPSHOT_MAX_BLOCKS : count;
+		unsigned long done;
+
+		if (write)
+			done = sd->dev->block_write(sd->dev->dev, sd->part.start + blk, n, buf);
+		else
+			done = sd->dev->block_read(sd->dev->dev, sd->part.start + blk, n, buf);
+
+		if (done != n) {
+			printf(KERR "%s of 0x%x blocks at block 0x%x failed\n",
+				write ? "write" : "read",
+				n,
+				blk);
+			return 1;
+		}
+
+		blk += n;
+		count -= n;
+		buf += n * sd->part.blksz;
+	}
+
+	return 0;
+}
+
+/*
+ * snapshot_io_bytes
+ *
+ * Same, for 'size' bytes that don't have to be a whole number of
+ * blocks. The partial last block goes through 'bounce'.
+ */
+static int snapshot_io_bytes(snapshot_dev_t* sd,
+	uint32_t blk,
+	uint32_t size,
+	uint8_t* buf,
+	uint8_t* bounce,
+	boolean_t write)
+{
+	uint32_t whole = size / sd->part.blksz;
+	uint32_t tail = size - whole * sd->part.blksz;
+
+	if (snapshot_io(sd, blk, whole, buf, write))
+		return 1;
+
+	if (!tail)
+		return 0;
+
+	buf += whole * sd->part.blksz;
+
+	if (write) {
+		memset(bounce, 0, sd->part.blksz);
+		bcopy((void*)buf, (void*)bounce, tail);
+		return snapshot_io(sd, blk + whole, 1, bounce, TRUE);
+	}
+
+	if (snapshot_io(sd, blk + whole, 1, bounce, FALSE))
+		return 1;
+
+	bcopy((void*)bounce, (void*)buf, tail);
+
+	return 0;
+}
+
+static void header_sum(snapshot_header_t* hdr, uint32_t sum[2])
+{
+	snapshot_header_t copy = *hdr;
+
+	copy.sum[0] = 0;
+	copy.sum[1] = 0;
+
+	image_hash((const uint8_t*)&copy, sizeof(copy), sum);
+}
+
+/*---------------------------------------------------------------*/
+
+/*
+ * stamp_sources
+ *
+ * Lists the images the loaded boot was made from in 'hdr', with
+ * both their stamps. Images out of the ramdisk aren't stamped.
+ */
+static int stamp_sources(snapshot_header_t* hdr)
+{
+	const image_source_t* sources;
+	uint32_t count = image_sources(&sources);
+	uint32_t i;
+
+	if (count > IMAGE_SOURCES_MAX) {
+		printf(KERR "too many images to keep track of (%u, at most %u)\n",
+			count,
+			IMAGE_SOURCES_MAX);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (sources[i].kind == kImageSourceMemory) {
+			printf(KERR "image at %s was loaded from memory and can't be checked later, load it with 'imgx <interface> <dev[:part]> <path>'\n",
+				sources[i].path);
+			return 1;
+		}
+
+		hdr->sources[i] = sources[i];
+
+		if (sources[i].kind == kImageSourceFile &&
+			(stamp_image_source(&sources[i], FALSE, hdr->stamps[i]) ||
+			stamp_image_source(&sources[i], TRUE, hdr->full_stamps[i])))
+		{
+			return 1;
+		}
+	}
+
+	hdr->nsources = count;
+
+	return 0;
+}
+
+/*
+ * check_sources
+ *
+ * Compares the stamps a snapshot was made with against the images
+ * it was made from, as they are now. Only the quick stamps unless
+ * 'full' is set.
+ */
+static int check_sources(snapshot_header_t* hdr, boolean_t full)
+{
+	uint32_t stamp[2];
+	uint32_t* saved;
+	uint32_t i;
+
+	for (i = 0; i < hdr->nsources; i++) {
+		image_source_t* src = &hdr->sources[i];
+
+		if (src->kind != kImageSourceFile)
+			continue;
+
+		/* Came off storage, don't trust the strings to be terminated */
+		src->ifname[sizeof(src->ifname) - 1] = '\0';
+		src->dev_part[sizeof(src->dev_part) - 1] = '\0';
+		src->path[sizeof(src->path) - 1] = '\0';
+
+		printf(KPROC(BOOT) "checking '%s' on %s %s ...\n", src->path, src->ifname, src->dev_part);
+
+		if (stamp_image_source(src, full, stamp))
+			return 1;
+
+		saved = full ? hdr->full_stamps[i] : hdr->stamps[i];
+
+		if (stamp[0] != saved[0] || stamp[1] != saved[1]) {
+			printf(KERR "'%s' changed since the snapshot was saved\n", src->path);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int snapshot_save(const char* ifname, const char* dev_part)
+{
+	snapshot_dev_t sd;
+	snapshot_header_t* hdr;
+	uint8_t* desc;
+	uint8_t* bounce;
+	uint32_t desc_blk, image_blk, end_blk;
+
+	if (RANGE_IS_NULL(gKernelMemoryRange) || !gHasDeviceTree) {
+		printf(KERR "load a kernel and a device tree before saving a snapshot\n");
+		return 1;
+	}
+
+	if (snapshot_open(ifname, dev_part, &sd))
+		return 1;
+
+	hdr = (snapshot_header_t*)scratch_alloc(align_up(sizeof(snapshot_header_t), sd.part.blksz), 64);
+	desc = (uint8_t*)scratch_alloc(WARM_BOOT_AREA_SIZE, 64);
+	bounce = (uint8_t*)scratch_alloc(sd.part.blksz, 64);
+
+	if (!hdr || !desc || !bounce)
+		return 1;
+
+	memset((void*)hdr, 0, align_up(sizeof(snapshot_header_t), sd.part.blksz));
+
+	hdr->desc_size = boot_state_save(desc, WARM_BOOT_AREA_SIZE);
+	if (!hdr->desc_size)
+		return 1;
+
+	hdr->magic = kSnapshotMagic;
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->image_base = gKernelPhysicalBase;
+	hdr->image_size = gKernelMemoryTop - gKernelPhysicalBase;
+
+	if (stamp_sources(hdr))
+		return 1;
+
+	header_sum(hdr, hdr->sum);
+
+	desc_blk = snapshot_blocks(&sd, sizeof(snapshot_header_t));
+	image_blk = desc_blk + snapshot_blocks(&sd, hdr->desc_size);
+	end_blk = image_blk + snapshot_blocks(&sd, hdr->image_size);
+
+	if (end_blk > sd.part.size) {
+		printf(KERR "snapshot doesn't fit on %s %s (0x%x blocks, have 0x%lx)\n",
+			ifname,
+			dev_part,
+			end_blk,
+			sd.part.size);
+		return 1;
+	}
+
+	printf(KPROC(BOOT) "saving snapshot of 0x%08x-0x%08x to %s %s ...\n",
+		hdr->image_base,
+		hdr->image_base + hdr->image_size,
+		ifname,
+		dev_part);
+
+	/* Header last, a snapshot cut short is never taken for a good one */
+	hdr->magic = 0;
+	if (snapshot_io(&sd, 0, desc_blk, (uint8_t*)hdr, TRUE))
+		return 1;
+
+	if (snapshot_io_bytes(&sd, desc_blk, hdr->desc_size, desc, bounce, TRUE) ||
+		snapshot_io_bytes(&sd, image_blk, hdr->image_size, (uint8_t*)hdr->image_base, bounce, TRUE))
+	{
+		return 1;
+	}
+
+	hdr->magic = kSnapshotMagic;
+	if (snapshot_io(&sd, 0, desc_blk, (uint8_t*)hdr, TRUE))
+		return 1;
+
+	printf(KDONE "saved snapshot (0x%x blocks)\n", end_blk);
+
+	return 0;
+}
+
+static int snapshot_load(const char* ifname, const char* dev_part, boolean_t full)
+{
+	snapshot_dev_t sd;
+	snapshot_header_t* hdr;
+	memory_range_t span;
+	uint8_t* desc;
+	uint8_t* bounce;
+	uint32_t desc_blk, image_blk;
+	uint32_t sum[2];
+
+	if (snapshot_open(ifname, dev_part, &sd))
+		return 1;
+
+	desc_blk = snapshot_blocks(&sd, sizeof(snapshot_header_t));
+
+	hdr = (snapshot_header_t*)scratch_alloc(desc_blk * sd.part.blksz, 64);
+	bounce = (uint8_t*)scratch_alloc(sd.part.blksz, 64);
+
+	if (!hdr || !bounce || snapshot_io(&sd, 0, desc_blk, (uint8_t*)hdr, FALSE))
+		return 1;
+
+	header_sum(hdr, sum);
+
+	if (hdr->magic != kSnapshotMagic ||
+		hdr->version != SNAPSHOT_VERSION ||
+		sum[0] != hdr->sum[0] || sum[1] != hdr->sum[1] ||
+		hdr->desc_size > WARM_BOOT_AREA_SIZE ||
+		hdr->nsources > IMAGE_SOURCES_MAX)
+	{
+		printf(KERR "no snapshot on %s %s\n", ifname, dev_part);
+		return 1;
+	}
+
+	if (check_sources(hdr, full))
+		return 1;
+
+	desc = (uint8_t*)scratch_alloc(hdr->desc_size, 64);
+	if (!desc || snapshot_io_bytes(&sd, desc_blk, hdr->desc_size, desc, bounce, FALSE))
+		return 1;
+
+	/* Everything in scratch is allocated, so the floor is final */
+	if (boot_state_check(desc, hdr->desc_size, &span))
+		return 1;
+
+	if (span.base != hdr->image_base || span.size != hdr->image_size) {
+		printf(KERR "snapshot header doesn't match its boot state\n");
+		return 1;
+	}
+
+	image_blk = desc_blk + snapshot_blocks(&sd, hdr->desc_size);
+
+	/* Whatever is loaded now is about to be overwritten */
+	adopt_kernel_memory(0);
+
+	printf(KPROC(BOOT) "loading snapshot to 0x%08x-0x%08x ...\n",
+		span.base,
+		span.base + span.size);
+
+	if (snapshot_io_bytes(&sd, image_blk, span.size, (uint8_t*)span.base, bounce, FALSE))
+		return 1;
+
+	/* Also checks what was read against the sums in the descriptor */
+	return boot_state_restore(desc, hdr->desc_size);
+}
+
+static int do_snapshot(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
+{
+	memory_region_t mark;
+	int ret;
+
+	if (argc < 4) {
+		printf(KERR "wrong number of arguments (got %d)\n", argc);
+		return 1;
+	}
+
+	image_cache_prepare();
+	scratch_mark(&mark);
+
+	if (strcmp(argv[1], "save") == 0 && argc == 4) {
+		ret = snapshot_save(argv[2], argv[3]);
+	}
+	else if (strcmp(argv[1], "load") == 0 && argc == 4) {
+		ret = snapshot_load(argv[2], argv[3], FALSE);
+	}
+	else if (strcmp(argv[1], "load") == 0 && argc == 5 && strcmp(argv[4], "full") == 0) {
+		ret = snapshot_load(argv[2], argv[3], TRUE);
+	}
+	else {
+		printf(KERR "unknown snapshot command '%s' or wrong number of arguments\n", argv[1]);
+		ret = 1;
+	}
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+static char snapshot_help_text[] =
+	"\t  snapshot save <interface> <dev[:part]> - write the loaded kernel memory,\n"
+	"\t      drivers, ramdisk and device tree to a raw partition. The images have\n"
+	"\t      to have been loaded from storage with 'imgx <interface> <dev> <path>'\n"
+	"\t  snapshot load <interface> <dev[:part]> [full] - read them back, ready for\n"
+	"\t      mach_boot. Fails if any of the images changed since the save, as told\n"
+	"\t      by their TOC and command headers, or with 'full' by reading them whole\n";
+
+U_BOOT_CMD(
+	snapshot,	CONFIG_SYS_MAXARGS,	1,	do_snapshot,
+	"save or load a loaded boot on storage", snapshot_help_text
+);
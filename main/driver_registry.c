@@ -0,0 +1,183 @@
+/*
+ * driver_registry.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Keeps track of loaded driver images. Entries live in one array in
+ * load order, with an open addressed hash table on the bundle name
+ * next to it so duplicates are caught without walking every entry.
+ * The arena is allocated once and dropping every driver is just a
+ * reset.
+ */
+
+#include <bootkit/runtime.h>
+
+#include "loader.h"
+
+#define DRIVER_HASH_SIZE (DRIVER_REGISTRY_MAX * 2)
+
+static loaded_driver_image_t* gDriverArena = NULL;
+static uint16_t* gDriverHash = NULL; /* index + 1, zero is empty */
+
+uint32_t gLoadedDriverCount = 0;
+
+static uint32_t name_hash(const char* name)
+{
+	uint32_t h = 0x811C9DC5;
+	uint32_t i;
+
+	for (i = 0; i < NAME_LEN && name[i]; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 0x01000193;
+	}
+
+	return h;
+}
+
+static boolean_t driver_registry_init(void)
+{
+	if (gDriverArena)
+		return TRUE;
+
+	gDriverArena = (loaded_driver_image_t*)
+	malloc(sizeof(loaded_driver_image_t) * DRIVER_REGISTRY_MAX);
+
+	gDriverHash = (uint16_t*)malloc(sizeof(uint16_t) * DRIVER_HASH_SIZE);
+
+	if (!gDriverArena || !gDriverHash) {
+		printf(KERR "unable to allocate the driver registry\n");
+
+		if (gDriverArena)
+			free((void*)gDriverArena);
+		if (gDriverHash)
+			free((void*)gDriverHash);
+
+		gDriverArena = NULL;
+		gDriverHash = NULL;
+
+		return FALSE;
+	}
+
+	bzero((void*)gDriverHash, sizeof(uint16_t) * DRIVER_HASH_SIZE);
+	gLoadedDriverCount = 0;
+
+	return TRUE;
+}
+
+/*
+ * driver_slot
+ *
+ * Hash slot holding 'name', or the empty slot where it would go.
+ */
+static uint16_t* driver_slot(const char* name)
+{
+	uint32_t i = name_hash(name) & (DRIVER_HASH_SIZE - 1);
+
+	while (gDriverHash[i]) {
+		loaded_driver_image_t* image = &gDriverArena[gDriverHash[i] - 1];
+
+		if (strncmp(image->name, name, NAME_LEN) == 0)
+			break;
+
+		i = (i + 1) & (DRIVER_HASH_SIZE - 1);
+	}
+
+	return &gDriverHash[i];
+}
+
+/*
+ * driver_registry_find
+ *
+ * Looks up a loaded driver by bundle name.
+ */
+loaded_driver_image_t* driver_registry_find(const char* name)
+{
+	uint16_t* slot;
+
+	if (!gDriverArena)
+		return NULL;
+
+	slot = driver_slot(name);
+
+	return (*slot) ? &gDriverArena[*slot - 1] : NULL;
+}
+
+/*
+ * driver_registry_add
+ *
+ * Appends a zeroed entry named 'name'. Fails if a driver with that
+ * name is already loaded or the registry is full.
+ */
+loaded_driver_image_t* driver_registry_add(const char* name)
+{
+	loaded_driver_image_t* image;
+	uint16_t* slot;
+
+	if (!driver_registry_init())
+		return NULL;
+
+	slot = driver_slot(name);
+
+	if (*slot) {
+		printf(KERR "driver '%s' is already loaded\n", name);
+		return NULL;
+	}
+
+	if (gLoadedDriverCount == DRIVER_REGISTRY_MAX) {
+		printf(KERR "too many drivers (%u max)\n", DRIVER_REGISTRY_MAX);
+		return NULL;
+	}
+
+	image = &gDriverArena[gLoadedDriverCount];
+	bzero((void*)image, sizeof(loaded_driver_image_t));
+	bcopy((void*)name, (void*)image->name, NAME_LEN);
+	image->name[NAME_LEN-1] = '\0';
+
+	*slot = (uint16_t)(++gLoadedDriverCount);
+
+	return image;
+}
+
+/*
+ * loaded_driver_image
+ *
+ * The 'index'th loaded driver, in load order.
+ */
+loaded_driver_image_t* loaded_driver_image(uint32_t index)
+{
+	return &gDriverArena[index];
+}
+
+/*
+ * driver_registry_truncate
+ *
+ * Forgets every driver loaded after the first 'count'. The hash is
+ * rebuilt from what's left, which is fine for something that only
+ * happens when a load fails.
+ */
+void driver_registry_truncate(uint32_t count)
+{
+	uint32_t i;
+
+	if (!gDriverArena || count >= gLoadedDriverCount)
+		return;
+
+	bzero((void*)gDriverHash, sizeof(uint16_t) * DRIVER_HASH_SIZE);
+	gLoadedDriverCount = count;
+
+	for (i = 0; i < count; i++)
+		*driver_slot(gDriverArena[i].name) = (uint16_t)(i + 1);
+}
+
+/*
+ * teardown_loaded_driver_images
+ *
+ * Forgets all loaded drivers. The arena is kept for the next load.
+ */
+void teardown_loaded_driver_images(void)
+{
+	if (!gDriverArena)
+		return;
+
+	bzero((void*)gDriverHash, sizeof(uint16_t) * DRIVER_HASH_SIZE);
+	gLoadedDriverCount = 0;
+}
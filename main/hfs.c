@@ -0,0 +1,667 @@
+/*
+ * hfs.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Read-only HFS+ reader for volumes that are already in memory, such
+ * as the ramdisk, so files can be used where they are instead of
+ * being read from storage again.
+ *
+ * Paths are resolved one component at a time by searching the catalog
+ * B-tree from its root, and files are mapped through their fork
+ * extents, looking further ones up in the extents overflow B-tree.
+ *
+ * Case-insensitive volumes order names with Apple's Unicode case
+ * folding. Only ASCII is folded here, which covers every name a boot
+ * needs. Hard links, symlinks and compressed files aren't followed.
+ *
+ * Scratch is used for node bounce buffers, so a volume stays usable
+ * until the caller releases its scratch mark.
+ */
+
+#include <bootkit/runtime.h>
+
+#include "loader.h"
+#include "hfs.h"
+
+#define hfs16(x) OSSwapInt16(x)
+#define hfs32(x) OSSwapInt32(x)
+#define hfs64(x) OSSwapInt64(x)
+
+/* Deeper than any tree that fits in 32 bits of nodes */
+#define BTREE_MAX_DEPTH 16
+
+/*---------------------------------------------------------------*/
+/* forks */
+
+/*
+ * fork_map
+ *
+ * Finds where byte 'offset' of a fork is in the volume. '*contig'
+ * gets how many bytes follow it in the same extent. Extents past the
+ * ones in the fork are looked up in the extents overflow tree, unless
+ * this is the extents tree's own fork.
+ */
+static const uint8_t* fork_map(hfs_volume_t* vol,
+	struct HFSPlusForkData* fork,
+	uint32_t file_id,
+	uint32_t offset,
+	uint32_t* contig);
+
+static int extent_key_compare(const uint8_t* rec, const void* search);
+static const uint8_t* btree_search(hfs_btree_t* tree,
+	const void* key,
+	int (*compare)(const uint8_t* rec, const void* key),
+	boolean_t exact,
+	uint32_t* len);
+
+static const uint8_t* extents_map(hfs_volume_t* vol,
+	struct HFSPlusExtentDescriptor* extents,
+	uint32_t first_block,
+	uint32_t block,
+	uint32_t rem,
+	uint32_t* contig)
+{
+	uint32_t i;
+
+	for (i = 0; i < kHFSPlusExtentDensity; i++) {
+		uint32_t count = hfs32(extents[i].blockCount);
+		uint32_t start = hfs32(extents[i].startBlock);
+		uint32_t vol_offset;
+
+		if (!count)
+			break;
+
+		if (block < first_block + count) {
+			uint32_t vol_block = start + (block - first_block);
+
+			if (((uint64_t)start + count) * vol->block_size > vol->size) {
+				printf(KERR "HFS+ extent 0x%x+0x%x is outside the volume\n", start, count);
+				return NULL;
+			}
+
+			vol_offset = vol_block * vol->block_size + rem;
+			*contig = (start + count - vol_block) * vol->block_size - rem;
+
+			return vol->base + vol_offset;
+		}
+
+		first_block += count;
+	}
+
+	return NULL;
+}
+
+static const uint8_t* fork_map(hfs_volume_t* vol,
+	struct HFSPlusForkData* fork,
+	uint32_t file_id,
+	uint32_t offset,
+	uint32_t* contig)
+{
+	struct HFSPlusExtentKey key;
+	const uint8_t* rec;
+	const uint8_t* p;
+	uint32_t block = offset / vol->block_size;
+	uint32_t rem = offset % vol->block_size;
+	uint32_t len;
+
+	p = extents_map(vol, fork->extents, 0, block, rem, contig);
+	if (p || file_id == kHFSExtentsFileID)
+		return p;
+
+	key.keyLength = 0;
+	key.forkType = 0;
+	key.pad = 0;
+	key.fileID = file_id;
+	key.startBlock = block;
+
+	rec = btree_search(&vol->extents, &key, extent_key_compare, FALSE, &len);
+
+	if (rec) {
+		const struct HFSPlusExtentKey* found = (const struct HFSPlusExtentKey*)rec;
+
+		if (hfs32(found->fileID) == file_id && found->forkType == 0 && len >=
+			sizeof(struct HFSPlusExtentKey) + sizeof(struct HFSPlusExtentDescriptor) * kHFSPlusExtentDensity)
+		{
+			p = extents_map(vol,
+				(struct HFSPlusExtentDescriptor*)(rec + sizeof(struct HFSPlusExtentKey)),
+				hfs32(found->startBlock),
+				block,
+				rem,
+				contig);
+		}
+	}
+
+	if (!p)
+		printf(KERR "HFS+ file 0x%x has no extent for block 0x%x\n", file_id, block);
+
+	return p;
+}
+
+/*---------------------------------------------------------------*/
+/* B-trees */
+
+static const uint8_t* btree_node(hfs_btree_t* tree, uint32_t node)
+{
+	uint32_t offset = node * tree->node_size;
+	uint32_t contig;
+	uint32_t done;
+	const uint8_t* p;
+
+	if (offset / tree->node_size != node || (uint64_t)offset + tree->node_size > hfs64(tree->fork.logicalSize)) {
+		printf(KERR "HFS+ B-tree node %u is out of range\n", node);
+		return NULL;
+	}
+
+	p = fork_map(tree->vol, &tree->fork, tree->file_id, offset, &contig);
+	if (!p)
+		return NULL;
+
+	if (contig >= tree->node_size)
+		return p;
+
+	/* Straddles two extents, stitch it together */
+	for (done = 0; done < tree->node_size; ) {
+		uint32_t n = (contig > tree->node_size - done) ? tree->node_size - done : contig;
+
+		bcopy((void*)p, (void*)(tree->bounce + done), n);
+		done += n;
+
+		if (done < tree->node_size) {
+			p = fork_map(tree->vol, &tree->fork, tree->file_id, offset + done, &contig);
+			if (!p)
+				return NULL;
+		}
+	}
+
+	return tree->bounce;
+}
+
+/*
+ * btree_record
+ *
+ * Record 'index' of a node, NULL if its offset is bad. '*len' gets
+ * how far it is from the next record.
+ */
+static const uint8_t* btree_record(hfs_btree_t* tree, const uint8_t* node, uint32_t index, uint32_t* len)
+{
+	const struct BTNodeDescriptor* desc = (const struct BTNodeDescriptor*)node;
+	uint32_t nrecs = hfs16(desc->numRecords);
+	const uint16_t* offsets = (const uint16_t*)(node + tree->node_size);
+	uint32_t start = hfs16(offsets[-(int)index - 1]);
+	uint32_t end = hfs16(offsets[-(int)index - 2]);
+	uint32_t table = tree->node_size - 2 * (nrecs + 1);
+
+	if (start < sizeof(struct BTNodeDescriptor) || end > table || start > end) {
+		printf(KERR "HFS+ B-tree record %u has a bad offset\n", index);
+		return NULL;
+	}
+
+	*len = end - start;
+
+	return node + start;
+}
+
+/* Bytes of key at the front of a record, length field included */
+static uint32_t btree_key_size(hfs_btree_t* tree, const uint8_t* rec, boolean_t leaf)
+{
+	if (leaf || (tree->attributes & kBTVariableIndexKeysMask))
+		return hfs16(*(const uint16_t*)rec) + sizeof(uint16_t);
+
+	return tree->max_key_length + sizeof(uint16_t);
+}
+
+/*
+ * btree_search
+ *
+ * Searches a B-tree from its root for 'key'. Returns the leaf record
+ * with that key, or with 'exact' false the last record with a key not
+ * greater than it. NULL if there is none.
+ */
+static const uint8_t* btree_search(hfs_btree_t* tree,
+	const void* key,
+	int (*compare)(const uint8_t* rec, const void* key),
+	boolean_t exact,
+	uint32_t* len)
+{
+	uint32_t node_num = tree->root;
+	uint32_t level;
+
+	if (!tree->root)
+		return NULL;
+
+	for (level = 0; level < BTREE_MAX_DEPTH; level++) {
+		const uint8_t* node = btree_node(tree, node_num);
+		const struct BTNodeDescriptor* desc;
+		const uint8_t* rec;
+		uint32_t nrecs;
+		int lo, hi, found;
+		int cmp = 1;
+
+		if (!node)
+			return NULL;
+
+		desc = (const struct BTNodeDescriptor*)node;
+		nrecs = hfs16(desc->numRecords);
+
+		if (desc->kind != kBTLeafNode && desc->kind != kBTIndexNode) {
+			printf(KERR "HFS+ B-tree node %u isn't an index or leaf node\n", node_num);
+			return NULL;
+		}
+
+		if (2 * (nrecs + 1) + sizeof(struct BTNodeDescriptor) > tree->node_size) {
+			printf(KERR "HFS+ B-tree node %u has too many records\n", node_num);
+			return NULL;
+		}
+
+		/* Last record with a key <= the search key */
+		lo = 0;
+		hi = (int)nrecs - 1;
+		found = -1;
+
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			int c;
+
+			rec = btree_record(tree, node, mid, len);
+			if (!rec)
+				return NULL;
+
+			c = compare(rec, key);
+
+			if (c <= 0) {
+				found = mid;
+				cmp = c;
+				lo = mid + 1;
+			}
+			else {
+				hi = mid - 1;
+			}
+		}
+
+		if (found < 0)
+			return NULL;
+
+		rec = btree_record(tree, node, found, len);
+
+		if (desc->kind == kBTLeafNode) {
+			if (exact && cmp != 0)
+				return NULL;
+
+			return rec;
+		}
+
+		/* Index record, the child follows the key */
+		{
+			uint32_t key_size = btree_key_size(tree, rec, FALSE);
+			uint32_t child;
+
+			if (key_size + sizeof(uint32_t) > *len) {
+				printf(KERR "HFS+ B-tree index record is truncated\n");
+				return NULL;
+			}
+
+			bcopy((void*)(rec + key_size), (void*)&child, sizeof(child));
+			node_num = hfs32(child);
+		}
+	}
+
+	printf(KERR "HFS+ B-tree is too deep\n");
+
+	return NULL;
+}
+
+static int btree_open(hfs_volume_t* vol, hfs_btree_t* tree, struct HFSPlusForkData* fork, uint32_t file_id)
+{
+	const struct BTHeaderRec* hdr;
+	const uint8_t* node;
+	uint32_t contig;
+
+	tree->vol = vol;
+	tree->fork = *fork;
+	tree->file_id = file_id;
+
+	/* The header node is first, its size is in it */
+	node = fork_map(vol, fork, file_id, 0, &contig);
+	if (!node || contig < sizeof(struct BTNodeDescriptor) + sizeof(struct BTHeaderRec))
+		return 1;
+
+	hdr = (const struct BTHeaderRec*)(node + sizeof(struct BTNodeDescriptor));
+
+	tree->node_size = hfs16(hdr->nodeSize);
+	tree->max_key_length = hfs16(hdr->maxKeyLength);
+	tree->root = hfs32(hdr->rootNode);
+	tree->depth = hfs16(hdr->treeDepth);
+	tree->attributes = hfs32(hdr->attributes);
+
+	if (tree->node_size < 512 || (tree->node_size & (tree->node_size - 1))) {
+		printf(KERR "HFS+ B-tree 0x%x has a bad node size (0x%x)\n", file_id, tree->node_size);
+		return 1;
+	}
+
+	if (!(tree->attributes & kBTBigKeysMask)) {
+		printf(KERR "HFS+ B-tree 0x%x doesn't have 16 bit key lengths\n", file_id);
+		return 1;
+	}
+
+	tree->bounce = (uint8_t*)scratch_alloc(tree->node_size, 0);
+	if (!tree->bounce)
+		return 1;
+
+	if (file_id == kHFSCatalogFileID)
+		vol->case_sensitive = (hdr->keyCompareType == kHFSBinaryCompare);
+
+	return 0;
+}
+
+/*---------------------------------------------------------------*/
+/* keys */
+
+static int extent_key_compare(const uint8_t* rec, const void* search)
+{
+	const struct HFSPlusExtentKey* a = (const struct HFSPlusExtentKey*)rec;
+	const struct HFSPlusExtentKey* b = (const struct HFSPlusExtentKey*)search;
+	uint32_t a_id = hfs32(a->fileID);
+	uint32_t a_start = hfs32(a->startBlock);
+
+	if (a_id != b->fileID)
+		return (a_id < b->fileID) ? -1 : 1;
+
+	if (a->forkType != b->forkType)
+		return (a->forkType < b->forkType) ? -1 : 1;
+
+	if (a_start != b->startBlock)
+		return (a_start < b->startBlock) ? -1 : 1;
+
+	return 0;
+}
+
+/* Catalog search key, in host order */
+typedef struct {
+	hfs_volume_t* vol;
+	uint32_t parent_id;
+	uint16_t length;
+	uint16_t name[255];
+} catalog_search_t;
+
+static uint16_t fold_char(uint16_t c)
+{
+	/* Apple's table sorts NUL last, the private data folder relies on it */
+	if (c == 0)
+		return 0xFFFF;
+
+	if (c >= 'A' && c <= 'Z')
+		return c + ('a' - 'A');
+
+	return c;
+}
+
+static int catalog_key_compare(const uint8_t* rec, const void* search)
+{
+	const struct HFSPlusCatalogKey* a = (const struct HFSPlusCatalogKey*)rec;
+	const catalog_search_t* b = (const catalog_search_t*)search;
+	uint32_t a_parent = hfs32(a->parentID);
+	uint32_t a_len = hfs16(a->nodeName.length);
+	uint32_t i;
+
+	if (a_parent != b->parent_id)
+		return (a_parent < b->parent_id) ? -1 : 1;
+
+	/* Index keys can be cut short, never compare past the key */
+	if (a_len > 255 || (hfs16(a->keyLength) < 6 + 2 * a_len))
+		a_len = (hfs16(a->keyLength) >= 6) ? (hfs16(a->keyLength) - 6) / 2 : 0;
+
+	for (i = 0; i < a_len && i < b->length; i++) {
+		uint16_t ca = hfs16(a->nodeName.unicode[i]);
+		uint16_t cb = b->name[i];
+
+		if (!b->vol->case_sensitive) {
+			ca = fold_char(ca);
+			cb = fold_char(cb);
+		}
+
+		if (ca != cb)
+			return (ca < cb) ? -1 : 1;
+	}
+
+	if (a_len != b->length)
+		return (a_len < b->length) ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * catalog_name
+ *
+ * Converts one UTF-8 path component to the UTF-16 the catalog uses.
+ * Names are stored decomposed, which ASCII names already are.
+ */
+static int catalog_name(catalog_search_t* key, const char* name, uint32_t len)
+{
+	uint32_t i = 0;
+
+	key->length = 0;
+
+	while (i < len) {
+		uint8_t c = (uint8_t)name[i];
+		uint16_t u;
+
+		if (c < 0x80) {
+			u = c;
+			i += 1;
+		}
+		else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+			u = ((c & 0x1F) << 6) | (name[i + 1] & 0x3F);
+			i += 2;
+		}
+		else if ((c & 0xF0) == 0xE0 && i + 2 < len) {
+			u = ((c & 0x0F) << 12) | ((name[i + 1] & 0x3F) << 6) | (name[i + 2] & 0x3F);
+			i += 3;
+		}
+		else {
+			printf(KERR "unsupported character in HFS+ path\n");
+			return 1;
+		}
+
+		/* ':' in a catalog name is '/' in a path, and the other way around */
+		if (u == ':')
+			u = '/';
+
+		if (key->length == 255) {
+			printf(KERR "HFS+ path component is too long\n");
+			return 1;
+		}
+
+		key->name[key->length++] = u;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------*/
+
+int hfs_open(hfs_volume_t* vol, const void* base, uint32_t size)
+{
+	const struct HFSPlusVolumeHeader* hdr;
+	uint16_t sig;
+
+	bzero((void*)vol, sizeof(*vol));
+
+	if (size < 1024 + sizeof(struct HFSPlusVolumeHeader)) {
+		printf(KERR "HFS+ volume too small (0x%x bytes)\n", size);
+		return 1;
+	}
+
+	hdr = (const struct HFSPlusVolumeHeader*)((const uint8_t*)base + 1024);
+	sig = hfs16(hdr->signature);
+
+	if (sig != kHFSPlusSigWord && sig != kHFSXSigWord) {
+		printf(KERR "not an HFS+ volume (signature 0x%04x)\n", sig);
+		return 1;
+	}
+
+	vol->base = (const uint8_t*)base;
+	vol->size = size;
+	vol->block_size = hfs32(hdr->blockSize);
+
+	if (vol->block_size < 512 || (vol->block_size & (vol->block_size - 1))) {
+		printf(KERR "HFS+ volume has a bad block size (0x%x)\n", vol->block_size);
+		return 1;
+	}
+
+	/* The extents tree goes first, the catalog may need it */
+	if (btree_open(vol, &vol->extents, (struct HFSPlusForkData*)&hdr->extentsFile, kHFSExtentsFileID) ||
+		btree_open(vol, &vol->catalog, (struct HFSPlusForkData*)&hdr->catalogFile, kHFSCatalogFileID))
+	{
+		printf(KERR "unable to open the HFS+ B-trees\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * hfs_lookup
+ *
+ * Finds the file at 'path', which is relative to the root folder.
+ */
+int hfs_lookup(hfs_volume_t* vol, const char* path, hfs_file_t* file)
+{
+	catalog_search_t key;
+	uint32_t parent = kHFSRootFolderID;
+
+	key.vol = vol;
+
+	for (;;) {
+		const char* end;
+		const uint8_t* rec;
+		const uint8_t* data;
+		uint32_t len;
+		uint32_t key_size;
+		int16_t type;
+
+		while (*path == '/')
+			path++;
+
+		if (!*path) {
+			printf(KERR "HFS+ path names a folder\n");
+			return 1;
+		}
+
+		for (end = path; *end && *end != '/'; end++)
+			;
+
+		key.parent_id = parent;
+		if (catalog_name(&key, path, end - path))
+			return 1;
+
+		rec = btree_search(&vol->catalog, &key, catalog_key_compare, TRUE, &len);
+		if (!rec) {
+			printf(KERR "'%.*s' not found in the ramdisk\n", (int)(end - path), path);
+			return 1;
+		}
+
+		key_size = btree_key_size(&vol->catalog, rec, TRUE);
+		if (key_size + sizeof(int16_t) > len) {
+			printf(KERR "HFS+ catalog record is truncated\n");
+			return 1;
+		}
+
+		data = rec + key_size;
+		len -= key_size;
+		type = (int16_t)hfs16(*(const uint16_t*)data);
+
+		if (type == kHFSPlusFolderRecord && len >= sizeof(struct HFSPlusCatalogFolder)) {
+			parent = hfs32(((const struct HFSPlusCatalogFolder*)data)->folderID);
+			path = end;
+			continue;
+		}
+
+		if (type == kHFSPlusFileRecord && len >= sizeof(struct HFSPlusCatalogFile)) {
+			const struct HFSPlusCatalogFile* rec_file = (const struct HFSPlusCatalogFile*)data;
+			const char* rest = end;
+
+			while (*rest == '/')
+				rest++;
+
+			if (*rest) {
+				printf(KERR "'%.*s' is not a folder\n", (int)(end - path), path);
+				return 1;
+			}
+
+			if (hfs32(rec_file->fileType) == kHardLinkFileType &&
+				hfs32(rec_file->fileCreator) == kHFSPlusCreator)
+			{
+				printf(KERR "HFS+ hard links aren't supported\n");
+				return 1;
+			}
+
+			if (hfs32(rec_file->fileType) == kSymLinkFileType) {
+				printf(KERR "HFS+ symbolic links aren't supported\n");
+				return 1;
+			}
+
+			if (rec_file->bsdInfo.ownerFlags & UF_COMPRESSED) {
+				printf(KERR "HFS+ compressed files aren't supported\n");
+				return 1;
+			}
+
+			if (hfs64(rec_file->dataFork.logicalSize) > 0xFFFFFFFFULL) {
+				printf(KERR "HFS+ file is too large\n");
+				return 1;
+			}
+
+			file->file_id = hfs32(rec_file->fileID);
+			file->fork = rec_file->dataFork;
+			file->size = (uint32_t)hfs64(rec_file->dataFork.logicalSize);
+
+			return 0;
+		}
+
+		printf(KERR "bad HFS+ catalog record (type %d)\n", type);
+		return 1;
+	}
+}
+
+/*
+ * hfs_file_map
+ *
+ * The file's data where it is in the volume, if it is in one piece.
+ */
+const uint8_t* hfs_file_map(hfs_volume_t* vol, hfs_file_t* file)
+{
+	const uint8_t* p;
+	uint32_t contig;
+
+	if (!file->size)
+		return vol->base;
+
+	p = extents_map(vol, file->fork.extents, 0, 0, 0, &contig);
+
+	return (p && contig >= file->size) ? p : NULL;
+}
+
+/*
+ * hfs_file_read
+ *
+ * Copies the file's data out of the volume, for files in pieces.
+ */
+int hfs_file_read(hfs_volume_t* vol, hfs_file_t* file, uint8_t* dst)
+{
+	uint32_t offset = 0;
+
+	while (offset < file->size) {
+		uint32_t contig;
+		const uint8_t* p = fork_map(vol, &file->fork, file->file_id, offset, &contig);
+
+		if (!p)
+			return 1;
+
+		if (contig > file->size - offset)
+			contig = file->size - offset;
+
+		bcopy((void*)p, (void*)(dst + offset), contig);
+		offset += contig;
+	}
+
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * hfs.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Read-only HFS+ access to a volume that is already in memory.
+ */
+
+#ifndef _HFS_H
+#define _HFS_H
+
+#include "hfs_header.h"
+
+typedef struct _hfs_volume_t hfs_volume_t;
+
+typedef struct {
+	hfs_volume_t* vol;
+	struct HFSPlusForkData fork;
+	uint32_t file_id;
+	uint16_t node_size;
+	uint16_t max_key_length;
+	uint32_t root;
+	uint16_t depth;
+	uint32_t attributes;
+	uint8_t* bounce; /* for nodes split over extents */
+} hfs_btree_t;
+
+struct _hfs_volume_t {
+	const uint8_t* base;
+	uint32_t size;
+	uint32_t block_size;
+	boolean_t case_sensitive;
+
+	hfs_btree_t catalog;
+	hfs_btree_t extents;
+};
+
+typedef struct {
+	uint32_t file_id;
+	uint32_t size;
+	struct HFSPlusForkData fork;
+} hfs_file_t;
+
+extern int hfs_open(hfs_volume_t* vol, const void* base, uint32_t size);
+extern int hfs_lookup(hfs_volume_t* vol, const char* path, hfs_file_t* file);
+extern const uint8_t* hfs_file_map(hfs_volume_t* vol, hfs_file_t* file);
+extern int hfs_file_read(hfs_volume_t* vol, hfs_file_t* file, uint8_t* dst);
+
+#endif
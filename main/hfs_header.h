@@ -15,6 +15,27 @@ enum {
 	kFSKMountVersion	= 0x46534b21	/* 'FSK!' for failed journal replay */
 };
 
+/*
+ * Everything on disk is big endian. Records inside B-tree nodes
+ * are only 2 byte aligned, hence the packing.
+ */
+#pragma pack(push, 2)
+
+/* A run of allocation blocks */
+struct HFSPlusExtentDescriptor {
+	uint32_t 	startBlock;		/* first allocation block */
+	uint32_t 	blockCount;		/* number of allocation blocks */
+};
+
+#define kHFSPlusExtentDensity 8
+
+struct HFSPlusForkData {
+	uint64_t 	logicalSize;		/* fork's logical size in bytes */
+	uint32_t 	clumpSize;		/* fork's clump size in bytes */
+	uint32_t 	totalBlocks;		/* total blocks used by this fork */
+	struct HFSPlusExtentDescriptor extents[kHFSPlusExtentDensity]; /* initial set of extents */
+};
+
 struct HFSPlusVolumeHeader {
 	uint16_t 	signature;		/* == kHFSPlusSigWord */
 	uint16_t 	version;		/* == kHFSPlusVersion */
@@ -43,6 +64,146 @@ struct HFSPlusVolumeHeader {
 	uint64_t 	encodingsBitmap;	/* which encodings have been use  on this volume */
 
 	uint8_t 	finderInfo[32];		/* information used by the Finder */
+
+	struct HFSPlusForkData allocationFile;	/* allocation bitmap file */
+	struct HFSPlusForkData extentsFile;	/* extents B-tree file */
+	struct HFSPlusForkData catalogFile;	/* catalog B-tree file */
+	struct HFSPlusForkData attributesFile;	/* extended attributes B-tree file */
+	struct HFSPlusForkData startupFile;	/* boot file */
+};
+
+/* Special catalog node IDs */
+enum {
+	kHFSRootParentID	= 1,	/* parent ID of the root folder */
+	kHFSRootFolderID	= 2,	/* folder ID of the root folder */
+	kHFSExtentsFileID	= 3,	/* file ID of the extents overflow file */
+	kHFSCatalogFileID	= 4	/* file ID of the catalog file */
+};
+
+/* B-tree nodes */
+enum {
+	kBTLeafNode		= -1,
+	kBTIndexNode		= 0,
+	kBTHeaderNode		= 1,
+	kBTMapNode		= 2
+};
+
+struct BTNodeDescriptor {
+	uint32_t 	fLink;			/* next node at this level */
+	uint32_t 	bLink;			/* previous node at this level */
+	int8_t 		kind;			/* kind of node */
+	uint8_t 	height;			/* zero for header, map; child is one more than parent */
+	uint16_t 	numRecords;		/* number of records in this node */
+	uint16_t 	reserved;		/* reserved - initialized as zero */
+};
+
+/* BTHeaderRec attributes */
+enum {
+	kBTBadCloseMask		= 0x00000001,
+	kBTBigKeysMask		= 0x00000002,	/* key length field is 16 bits */
+	kBTVariableIndexKeysMask = 0x00000004	/* keys in index nodes are variable length */
+};
+
+/* BTHeaderRec keyCompareType, HFSX catalogs only */
+enum {
+	kHFSCaseFolding		= 0xCF,		/* case folding (case-insensitive) */
+	kHFSBinaryCompare	= 0xBC		/* binary compare (case-sensitive) */
 };
 
-#endif
\ No newline at end of file
+struct BTHeaderRec {
+	uint16_t 	treeDepth;		/* maximum height (usually leaf nodes) */
+	uint32_t 	rootNode;		/* node number of root node */
+	uint32_t 	leafRecords;		/* number of leaf records in all leaf nodes */
+	uint32_t 	firstLeafNode;		/* node number of first leaf node */
+	uint32_t 	lastLeafNode;		/* node number of last leaf node */
+	uint16_t 	nodeSize;		/* size of a node, in bytes */
+	uint16_t 	maxKeyLength;		/* reserved */
+	uint32_t 	totalNodes;		/* total number of nodes in tree */
+	uint32_t 	freeNodes;		/* number of unused (free) nodes in tree */
+	uint16_t 	reserved1;		/* unused */
+	uint32_t 	clumpSize;		/* reserved */
+	uint8_t 	btreeType;		/* reserved */
+	uint8_t 	keyCompareType;		/* Key string Comparison Type */
+	uint32_t 	attributes;		/* persistent attributes about the tree */
+	uint32_t 	reserved3[16];		/* reserved */
+};
+
+/* Catalog */
+struct HFSUniStr255 {
+	uint16_t 	length;			/* number of unicode characters */
+	uint16_t 	unicode[255];		/* unicode characters */
+};
+
+struct HFSPlusCatalogKey {
+	uint16_t 	keyLength;		/* key length (in bytes) */
+	uint32_t 	parentID;		/* parent folder ID */
+	struct HFSUniStr255 nodeName;		/* name (only as long as it has to be) */
+};
+
+enum {
+	kHFSPlusFolderRecord	= 0x0001,
+	kHFSPlusFileRecord	= 0x0002,
+	kHFSPlusFolderThreadRecord = 0x0003,
+	kHFSPlusFileThreadRecord = 0x0004
+};
+
+struct HFSPlusBSDInfo {
+	uint32_t 	ownerID;
+	uint32_t 	groupID;
+	uint8_t 	adminFlags;
+	uint8_t 	ownerFlags;
+	uint16_t 	fileMode;
+	uint32_t 	special;
+};
+
+/* HFSPlusBSDInfo ownerFlags */
+#define UF_COMPRESSED 0x20 /* data is in a decmpfs attribute */
+
+struct HFSPlusCatalogFolder {
+	int16_t 	recordType;		/* == kHFSPlusFolderRecord */
+	uint16_t 	flags;			/* file flags */
+	uint32_t 	valence;		/* folder's item count */
+	uint32_t 	folderID;		/* folder ID */
+	uint32_t 	dates[5];		/* create, content mod, attribute mod, access, backup */
+	struct HFSPlusBSDInfo bsdInfo;		/* permissions (for MacOS X) */
+	uint8_t 	userInfo[16];		/* Finder information */
+	uint8_t 	finderInfo[16];		/* additional Finder information */
+	uint32_t 	textEncoding;		/* hint for name conversions */
+	uint32_t 	folderCount;		/* number of enclosed folders, active when HasFolderCount is set */
+};
+
+struct HFSPlusCatalogFile {
+	int16_t 	recordType;		/* == kHFSPlusFileRecord */
+	uint16_t 	flags;			/* file flags */
+	uint32_t 	reserved1;		/* reserved - initialized as zero */
+	uint32_t 	fileID;			/* file ID */
+	uint32_t 	dates[5];		/* create, content mod, attribute mod, access, backup */
+	struct HFSPlusBSDInfo bsdInfo;		/* permissions (for MacOS X) */
+	uint32_t 	fileType;		/* Finder information: type */
+	uint32_t 	fileCreator;		/* Finder information: creator */
+	uint8_t 	userInfo[8];		/* rest of the Finder information */
+	uint8_t 	finderInfo[16];		/* additional Finder information */
+	uint32_t 	textEncoding;		/* hint for name conversions */
+	uint32_t 	reserved2;		/* reserved - initialized as zero */
+
+	struct HFSPlusForkData dataFork;	/* size and block data for data fork */
+	struct HFSPlusForkData resourceFork;	/* size and block data for resource fork */
+};
+
+/* Hard links are files of this type and creator pointing at an inode */
+#define kHardLinkFileType 0x686C6E6B	/* 'hlnk' */
+#define kHFSPlusCreator 0x6866732B	/* 'hfs+' */
+#define kSymLinkFileType 0x736C6E6B	/* 'slnk' */
+
+/* Extents overflow */
+struct HFSPlusExtentKey {
+	uint16_t 	keyLength;		/* length of key, excluding this field */
+	uint8_t 	forkType;		/* 0 = data fork, FF = resource fork */
+	uint8_t 	pad;			/* make the other fields align on 32-bit boundary */
+	uint32_t 	fileID;			/* file ID */
+	uint32_t 	startBlock;		/* first file allocation block number in this extent */
+};
+
+#pragma pack(pop)
+
+#endif
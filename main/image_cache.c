@@ -0,0 +1,345 @@
+/*
+ * image_cache.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Keeps decompressed copies of payloads in a chunk of high memory
+ * so reloading the same TOC over and over (which is what happens
+ * during bring-up) doesn't decompress everything from scratch.
+ *
+ * Payloads are keyed by a hash of their compressed bytes and their
+ * sizes. Hashing the compressed bytes is a lot cheaper than running
+ * the decompressor over them. The cache region is allocated as a
+ * ring, older entries get evicted when the ring wraps over them.
+ *
+ * The size of the cache comes from the 'imgx_cache_size' env var
+ * (hex) when the cache is first used. Zero disables it.
+ *
+ * Nothing stops 'fs load' or 'tftp' from writing over the region
+ * between imgx runs. Every entry keeps the hash of its decompressed
+ * bytes, taken when it is stored. Whoever knows a range was written
+ * (imgx does for the last file loaded) calls image_cache_invalidate,
+ * and entries it overlaps are checked against that hash on their next
+ * hit, and dropped if they don't match. Other hits are served as is.
+ */
+
+#include <bootkit/runtime.h>
+
+#include "loader.h"
+#include "image_cache.h"
+
+typedef struct {
+	image_cache_key_t key;
+	uint32_t data;      /* decompressed copy in the cache region */
+	uint32_t dest;      /* where it was last placed */
+	uint32_t data_hash[2]; /* of the decompressed bytes */
+	boolean_t checked;  /* nothing wrote over it since it was hashed */
+	boolean_t valid;
+} image_cache_entry_t;
+
+static image_cache_entry_t gCacheEntries[IMAGE_CACHE_MAX_ENTRIES];
+static uint32_t gCacheNextSlot = 0;
+
+static boolean_t gCacheInitialized = FALSE;
+static uint32_t gCacheBase = 0;
+static uint32_t gCacheSize = 0;
+static uint32_t gCacheHead = 0;
+
+static uint32_t gCacheHits = 0;
+static uint32_t gCacheInPlace = 0;
+static uint32_t gCacheMisses = 0;
+static uint32_t gCacheCorrupt = 0;
+
+#define HASH_MUL_A 0x9E3779B1
+#define HASH_MUL_B 0x85EBCA77
+
+#define hash_round(h, w, m) h = (h ^ (w)) * (m); h ^= (h >> 15)
+
+/*
+ * image_hash
+ *
+ * Two-lane multiplicative hash. Aligned input is consumed a word at
+ * a time, which is the common case since commands are word aligned.
+ * Also used to checksum loaded images for warm boots.
+ */
+void image_hash(const uint8_t* buf, uint32_t len, uint32_t out[2])
+{
+	uint32_t a = 0x811C9DC5 ^ len;
+	uint32_t b = 0x01000193 + len;
+
+	if (((uintptr_t)buf & 3) == 0) {
+		const uint32_t* words = (const uint32_t*)buf;
+
+		while (len >= 16) {
+			hash_round(a, words[0], HASH_MUL_A);
+			hash_round(b, words[1], HASH_MUL_B);
+			hash_round(a, words[2], HASH_MUL_A);
+			hash_round(b, words[3], HASH_MUL_B);
+			words += 4;
+			len -= 16;
+		}
+
+		buf = (const uint8_t*)words;
+	}
+
+	while (len >= 4) {
+		uint32_t w = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+		hash_round(a, w, HASH_MUL_A);
+		hash_round(b, w, HASH_MUL_B);
+		buf += 4;
+		len -= 4;
+	}
+
+	while (len--) {
+		hash_round(a, *buf, HASH_MUL_A);
+		hash_round(b, *buf, HASH_MUL_B);
+		buf++;
+	}
+
+	out[0] = a ^ (b >> 13);
+	out[1] = b ^ (a >> 17);
+}
+
+/*
+ * image_cache_prepare
+ *
+ * Claims the cache region. Called before anything takes temporary
+ * high memory so the cache doesn't end up below it.
+ */
+boolean_t image_cache_prepare(void)
+{
+	char* en;
+
+	if (gCacheInitialized) {
+		return (gCacheSize != 0);
+	}
+
+	gCacheInitialized = TRUE;
+
+	en = getenv("imgx_cache_size");
+	if (en) {
+		gCacheSize = align_up(simple_strtoul(en, NULL, 16), 0x1000);
+	}
+	else {
+		gCacheSize = IMAGE_CACHE_DEFAULT_SIZE;
+	}
+
+	if (!gCacheSize) {
+		printf(KINF "image cache disabled\n");
+		return FALSE;
+	}
+
+	gCacheBase = (uint32_t)memory_reserve(memory_high_region(), gCacheSize, 0x1000);
+	gCacheHead = 0;
+
+	printf(KINF "image cache at [0x%08x-0x%08x]\n", gCacheBase, gCacheBase + gCacheSize);
+
+	return TRUE;
+}
+
+static boolean_t hash_matches(const uint8_t* buf, uint32_t len, uint32_t expected[2])
+{
+	uint32_t hash[2];
+
+	image_hash(buf, len, hash);
+
+	return (hash[0] == expected[0] && hash[1] == expected[1]);
+}
+
+/*
+ * image_cache_lookup
+ *
+ * Finds the entry for a key, if its cached copy is still intact.
+ * A hit that may have been written over is hashed again, and if it
+ * was, it is evicted and counts as a miss.
+ */
+static image_cache_entry_t* image_cache_lookup(image_cache_key_t* key)
+{
+	uint32_t i;
+
+	if (!image_cache_prepare()) {
+		return NULL;
+	}
+
+	for (i = 0; i < IMAGE_CACHE_MAX_ENTRIES; i++) {
+		image_cache_entry_t* ent = &gCacheEntries[i];
+
+		if (ent->valid &&
+			ent->key.hash[0] == key->hash[0] &&
+			ent->key.hash[1] == key->hash[1] &&
+			ent->key.comp_size == key->comp_size &&
+			ent->key.decomp_size == key->decomp_size)
+		{
+			if (!ent->checked) {
+				if (!hash_matches((const uint8_t*)ent->data, key->decomp_size, ent->data_hash)) {
+					ent->valid = FALSE;
+					gCacheCorrupt++;
+					return NULL;
+				}
+
+				ent->checked = TRUE;
+			}
+
+			return ent;
+		}
+	}
+
+	return NULL;
+}
+
+static boolean_t overlaps(image_cache_entry_t* ent, uint32_t base, uint32_t size)
+{
+	return (ent->valid &&
+		ent->data < base + size &&
+		ent->data + ent->key.decomp_size > base);
+}
+
+/*
+ * image_cache_invalidate
+ *
+ * Has entries whose cached copy overlaps [base, base+size) checked
+ * before they are served again, for when something may have been
+ * written over the cache region.
+ */
+void image_cache_invalidate(uint32_t base, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < IMAGE_CACHE_MAX_ENTRIES; i++) {
+		if (overlaps(&gCacheEntries[i], base, size))
+			gCacheEntries[i].checked = FALSE;
+	}
+}
+
+/*
+ * image_cache_alloc
+ *
+ * Carves 'size' bytes out of the cache ring, evicting whatever
+ * was there.
+ */
+static uint32_t image_cache_alloc(uint32_t size)
+{
+	uint32_t start;
+	uint32_t i;
+
+	size = align_up(size, 64);
+
+	if (size > gCacheSize) {
+		return 0;
+	}
+
+	if (gCacheHead + size > gCacheSize) {
+		gCacheHead = 0;
+	}
+
+	start = gCacheBase + gCacheHead;
+	gCacheHead += size;
+
+	for (i = 0; i < IMAGE_CACHE_MAX_ENTRIES; i++) {
+		if (overlaps(&gCacheEntries[i], start, size))
+			gCacheEntries[i].valid = FALSE;
+	}
+
+	return start;
+}
+
+void image_cache_make_key(image_cache_key_t* key, const void* comp, uint32_t comp_size, uint32_t decomp_size)
+{
+	image_hash((const uint8_t*)comp, comp_size, key->hash);
+	key->comp_size = comp_size;
+	key->decomp_size = decomp_size;
+}
+
+/*
+ * image_cache_find
+ *
+ * Returns the cached decompressed payload, for callers that can
+ * read it where it is.
+ */
+const uint8_t* image_cache_find(image_cache_key_t* key)
+{
+	image_cache_entry_t* ent = image_cache_lookup(key);
+
+	if (!ent) {
+		gCacheMisses++;
+		return NULL;
+	}
+
+	gCacheHits++;
+	return (const uint8_t*)ent->data;
+}
+
+/*
+ * image_cache_fetch
+ *
+ * Puts the decompressed payload at 'dest' if it is cached. If it was
+ * last placed at 'dest' and is still intact there, nothing is copied.
+ */
+boolean_t image_cache_fetch(image_cache_key_t* key, uint8_t* dest)
+{
+	image_cache_entry_t* ent = image_cache_lookup(key);
+
+	if (!ent) {
+		gCacheMisses++;
+		return FALSE;
+	}
+
+	gCacheHits++;
+
+	if (ent->dest == (uint32_t)dest &&
+		hash_matches(dest, key->decomp_size, ent->data_hash))
+	{
+		gCacheInPlace++;
+		return TRUE;
+	}
+
+	bcopy((void*)ent->data, (void*)dest, key->decomp_size);
+	ent->dest = (uint32_t)dest;
+
+	return TRUE;
+}
+
+/*
+ * image_cache_store
+ *
+ * Adds a freshly decompressed payload to the cache.
+ */
+void image_cache_store(image_cache_key_t* key, const uint8_t* decomp, uint8_t* dest)
+{
+	image_cache_entry_t* ent;
+	uint32_t data;
+
+	if (!image_cache_prepare()) {
+		return;
+	}
+
+	data = image_cache_alloc(key->decomp_size);
+	if (!data) {
+		/* Doesn't fit at all */
+		return;
+	}
+
+	ent = &gCacheEntries[gCacheNextSlot];
+	gCacheNextSlot = (gCacheNextSlot + 1) % IMAGE_CACHE_MAX_ENTRIES;
+
+	bcopy((void*)decomp, (void*)data, key->decomp_size);
+	image_hash(decomp, key->decomp_size, ent->data_hash);
+
+	ent->key = *key;
+	ent->data = data;
+	ent->dest = (uint32_t)dest;
+	ent->checked = TRUE;
+	ent->valid = TRUE;
+}
+
+void image_cache_report(void)
+{
+	if (!gCacheSize) {
+		return;
+	}
+
+	printf(KINF "image cache: %u hit(s) (%u in place), %u miss(es), %u overwritten\n",
+		gCacheHits,
+		gCacheInPlace,
+		gCacheMisses,
+		gCacheCorrupt);
+}
@@ -0,0 +1,31 @@
+/*
+ * image_cache.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Cache of decompressed payloads that survives between imgx runs.
+ */
+
+#ifndef _IMAGE_CACHE_H
+#define _IMAGE_CACHE_H
+
+#define IMAGE_CACHE_DEFAULT_SIZE 0x2000000
+#define IMAGE_CACHE_MAX_ENTRIES 256
+
+/* Identifies a payload by its compressed contents */
+typedef struct {
+	uint32_t hash[2];
+	uint32_t comp_size;
+	uint32_t decomp_size;
+} image_cache_key_t;
+
+extern void image_hash(const uint8_t* buf, uint32_t len, uint32_t out[2]);
+
+extern boolean_t image_cache_prepare(void);
+extern void image_cache_make_key(image_cache_key_t* key, const void* comp, uint32_t comp_size, uint32_t decomp_size);
+extern const uint8_t* image_cache_find(image_cache_key_t* key);
+extern boolean_t image_cache_fetch(image_cache_key_t* key, uint8_t* dest);
+extern void image_cache_store(image_cache_key_t* key, const uint8_t* decomp, uint8_t* dest);
+extern void image_cache_invalidate(uint32_t base, uint32_t size);
+extern void image_cache_report(void);
+
+#endif
@@ -16,9 +16,13 @@
 #include <fs.h>
 
 #include "loader.h"
-#include "hfs_header.h"
+#include "workers.h"
+#include "image_cache.h"
+#include "hfs.h"
 
-#include <bootkit/compressed/quicklz.h>
+#include "../compressed/sparse.h"
+#include "../compressed/codecs.h"
+#include "../mach-o/macho_ext.h"
 
 DECLARE_GLOBAL_DATA_PTR;
 
@@ -58,22 +62,59 @@ typedef struct {
 }
 command_macho_t;
 
+/* Arguments for printing a command's name, which might not be terminated, with '%.*s' */
+#define COMMAND_NAME(command) NAME_LEN, (const char*)&(command)->name
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t decomp_size;
+	uint32_t flags; /* compression, same bits as Mach-O commands, or sparse */
+
+	/* ... (compressed) HFS+ image ... */
+}
+command_ramdisk_t;
+
+/*
+ * Optional first command of a TOC. Lists every other command in it
+ * so a loader can find or skip commands without walking (or, when
+ * streaming, reading) them.
+ */
+typedef struct {
+	uint32_t offset; /* of the command, from the start of the TOC */
+	uint32_t size;   /* of the command */
+	uint32_t magic;  /* of the command */
+	uint32_t flags;  /* command_macho_t flags, zero otherwise */
+	char name[NAME_LEN];
+}
+index_entry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t nentries;
+
+	/* ... entries ... */
+}
+command_index_t;
+
 #define kTableOfContentsMagic ((uint32_t)'CfoT')
 #define kCommandMachO ((uint32_t)'hcaM')
 #define kCommandXMLDeviceTree ((uint32_t)'TD-X')
 #define kCommandJSDeviceTree ((uint32_t)'TDSJ')
 #define kCommandRamdisk ((uint32_t)'KSDR')
 #define kCommandConfiguration ((uint32_t)'FNOC')
+#define kCommandIndex ((uint32_t)'XDNI')
 
 #define kMachDriver 0x1
 #define kMachKernel 0x2
 
-#define kCommandMachOFlags_CompressedLZSS 0x100
+/* Compression flags are the kCodecFlag bits in codecs.h */
 #define kCommandMachOFlags_HasInfoPlist 0x200
-#define kCommandMachOFlags_CompressedQLZ 0x400
 #define kCommandMachOFlags_NoExec 0x800
 
-extern int decompress_lzss(uint8_t *dst, uint8_t *src, uint32_t srclen);
+/* Ramdisk payload is a sparse image, never combined with compression */
+#define kCommandRamdiskFlags_Sparse 0x2000
 
 typedef struct {
 	uint32_t load_address; /* in, actual addr */
@@ -84,15 +125,33 @@ typedef struct {
 #define DRIVER_PAD_START 256
 
 /* All of these are physical */
-loaded_driver_image_t* gLoadedDriverImages = NULL;
 memory_range_t gKernelMemoryRange = {0,0};
 memory_range_t gRAMDiskRange = {0, 0};
 uint32_t gKernelEntryPoint; 
 uint32_t gKernelMemoryTop = 0;
+
+/*
+ * Free tail of the last page below gKernelMemoryTop, for packing
+ * small driver pieces. Equal to gKernelMemoryTop when there is none.
+ */
+static uint32_t gKernelPackPos = 0;
 uint32_t gKernelVirtualBase = 0;
 uint32_t gKernelPhysicalBase = 0;
 boolean_t gHasDeviceTree = FALSE;
 
+/* Copy of the device tree command, kept for warm boots */
+static command_t* gDeviceTreeSource = NULL;
+
+/*
+ * Set while imgx loads straight out of the ramdisk, which has to be
+ * left as it is.
+ */
+static boolean_t gLoadingFromRamdisk = FALSE;
+
+/* Where every image imgx loaded since the kernel came from */
+static image_source_t gImageSources[IMAGE_SOURCES_MAX];
+static uint32_t gImageSourceCount = 0;
+
 #define __LastEnv(x) \
 static uint32_t last_##x(void) \
 {\
@@ -115,31 +174,28 @@ __LastEnv(fileaddr);
 		return FALSE; \
 	}
 
-static boolean_t load_macho(
-	uint32_t image_address,
-	uint32_t image_size,
+static boolean_t map_macho(
+	mach_loader_context_t* ctx,
 	uint32_t load_bias,
 	uint32_t load_address,
 	uint32_t* out_entry_point,
 	uint32_t* out_size)
 {
-	mach_loader_context_t ctx;
 	loader_return_t macho_ldr_return;
 	uint32_t full_size = 0;
 	
-	CheckLoaderReturn(mach_file_init(&ctx, (uint8_t*)image_address))
-	CheckLoaderReturn(mach_file_vmsize(&ctx, &full_size));
+	CheckLoaderReturn(mach_file_vmsize(ctx, &full_size));
 	
 	printf(KPROC(MMAP) "mapping kernel ...\n");
 	
 	/* kernel is not PIE, so we need to set vm bias */
-	mach_file_set_vm_bias(&ctx, load_bias);
+	mach_file_set_vm_bias(ctx, load_bias);
 
 	/* map in the kernel */
-	CheckLoaderReturn(mach_file_map(&ctx, (uint8_t*)load_address, full_size));
+	CheckLoaderReturn(mach_file_map(ctx, (uint8_t*)load_address, full_size));
 	
 	/* and find entry point */
-	CheckLoaderReturn(mach_file_get_entry_point(&ctx, out_entry_point));
+	CheckLoaderReturn(mach_file_get_entry_point(ctx, out_entry_point));
 	
 	printf(KINF "vmsize=0x%x paddr=0x%x vaddr=0x%x\n", full_size, load_address, load_bias);
 
@@ -148,6 +204,27 @@ static boolean_t load_macho(
 	return true;
 }
 
+static boolean_t load_macho(
+	uint32_t image_address,
+	uint32_t image_size,
+	uint32_t load_bias,
+	uint32_t load_address,
+	uint32_t* out_entry_point,
+	uint32_t* out_size)
+{
+	mach_loader_context_t ctx;
+	loader_return_t macho_ldr_return;
+	boolean_t ret;
+	
+	CheckLoaderReturn(mach_file_init(&ctx, (uint8_t*)image_address))
+
+	ret = map_macho(&ctx, load_bias, load_address, out_entry_point, out_size);
+
+	mach_file_destroy(&ctx);
+
+	return ret;
+}
+
 static boolean_t assert_kernel_load(void)
 {
 	/*
@@ -162,27 +239,6 @@ static boolean_t assert_kernel_load(void)
 	return true;
 }
 
-/*
- * teardown_loaded_driver_images
- *
- * Release loaded driver structs.
- */
-void teardown_loaded_driver_images(void)
-{
-	loaded_driver_image_t* next;
-
-	next = gLoadedDriverImages;
-	if (!next) return;
-
-	do {
-		loaded_driver_image_t* this = next;
-		next = this->next;
-		free((void*)this);
-	} while(next != NULL);
-
-	gLoadedDriverImages = NULL;
-}
-
 /*
  * teardown_old_loader_context
  *
@@ -195,16 +251,38 @@ static void teardown_old_loader_context(void)
 		gHasDeviceTree = FALSE;
 	}
 
+	if (gDeviceTreeSource) {
+		free((void*)gDeviceTreeSource);
+		gDeviceTreeSource = NULL;
+	}
+
 	gKernelMemoryTop = 0;
+	gKernelPackPos = 0;
 	gKernelPhysicalBase = 0;
 	gKernelVirtualBase = 0;
 
+	gImageSourceCount = 0;
+
 	ZERO_RANGE(gKernelMemoryRange);
 	ZERO_RANGE(gRAMDiskRange);
 
 	teardown_loaded_driver_images();
 }
 
+/*
+ * adopt_kernel_memory
+ *
+ * Drops the current loader context and takes over kernel memory a
+ * previous boot laid out up to 'top'. The caller restores the rest.
+ */
+void adopt_kernel_memory(uint32_t top)
+{
+	teardown_old_loader_context();
+
+	gKernelMemoryTop = top;
+	gKernelPackPos = top;
+}
+
 static void increment_kernel_memory(uint32_t by)
 {
 	/*
@@ -216,36 +294,195 @@ static void increment_kernel_memory(uint32_t by)
 	by = align_up(by, 0x1000);
 
 	gKernelMemoryTop += by;
+	gKernelPackPos = gKernelMemoryTop;
 	setenv_hex("KernelMemoryTop", gKernelMemoryTop);
 }
 
-static int load_macho_from_command(command_macho_t* command)
+/*
+ * set_kernel_memory_top
+ *
+ * Moves the kernel memory top and pack position to where a
+ * placement left them.
+ */
+static void set_kernel_memory_top(uint32_t top, uint32_t pack)
 {
-	boolean_t is_compressed = FALSE;
+	gKernelMemoryTop = top;
+	gKernelPackPos = pack;
+	setenv_hex("KernelMemoryTop", gKernelMemoryTop);
+}
 
-	uint32_t image_address;
-	uint32_t image_size;
+/*---------------------------------------------------------------*/
+/* checkpoints */
 
-	uint32_t raw_image_dest;
-	uint32_t blob_size;
+/*
+ * Every load command is run against a checkpoint of the loader
+ * state. If it fails, the state is rolled back to the checkpoint so
+ * the kernel and whatever loaded fine before it stay usable. With
+ * 'imgx_skip_failed' set to 1 the load carries on past the failed
+ * command instead of stopping.
+ *
+ * The kernel itself can't be rolled back (loading one tears down
+ * the previous one), and device tree nodes added by a device tree
+ * that failed half way stay around, it just isn't marked loaded.
+ */
 
-	uint32_t flags;
+typedef struct {
+	uint32_t kernel_memory_top;
+	uint32_t pack_pos;
+	uint32_t driver_count;
+	memory_range_t ramdisk;
+	boolean_t has_device_tree;
+	memory_region_t high;
+} load_checkpoint_t;
+
+static void checkpoint_save(load_checkpoint_t* cp)
+{
+	cp->kernel_memory_top = gKernelMemoryTop;
+	cp->pack_pos = gKernelPackPos;
+	cp->driver_count = gLoadedDriverCount;
+	cp->ramdisk = gRAMDiskRange;
+	cp->has_device_tree = gHasDeviceTree;
+
+	scratch_mark(&cp->high);
+}
+
+static void checkpoint_rollback(load_checkpoint_t* cp)
+{
+	scratch_release(&cp->high);
+
+	driver_registry_truncate(cp->driver_count);
+
+	gRAMDiskRange = cp->ramdisk;
+	gHasDeviceTree = cp->has_device_tree;
+
+	set_kernel_memory_top(cp->kernel_memory_top, cp->pack_pos);
+
+	printf(KINF "rolled back to kernel memory top 0x%08x, %u driver(s)\n",
+		gKernelMemoryTop,
+		gLoadedDriverCount);
+}
+
+static boolean_t skip_failed_commands(void)
+{
+	char* en = getenv("imgx_skip_failed");
+
+	return (en && en[0] == '1');
+}
 
-	/* Image follows the command header */
-	image_address = (uint32_t)(command+1);
-	blob_size = command->size - sizeof(command_macho_t);
+/*---------------------------------------------------------------*/
+/* driver placement */
+
+/*
+ * Normally every driver gets DRIVER_PAD_START bytes for its DriverInfo
+ * in front of the image and the whole thing is rounded up to a page.
+ * That's a lot of waste for pure Info.plist drivers, which are mostly
+ * a kilobyte or two.
+ *
+ * With 'imgx_pack' set to 1 drivers are packed instead:
+ *
+ *  - Executables still start on a page, but their DriverInfo goes in
+ *    the DRIVER_PACKED_PAD bytes right before that page.
+ *  - Pure Info.plist drivers and their DriverInfo are packed back to
+ *    back into the free tail of the last page.
+ *
+ * Either way DriverInfo is directly followed by the image, so one
+ * range still describes each driver in the memory map.
+ */
+
+typedef struct {
+	uint32_t base;  /* DriverInfo, start of the driver's range */
+	uint32_t image; /* image, right after the DriverInfo */
+	uint32_t top;   /* kernel memory top after the driver */
+	uint32_t pack;  /* start of the free tail after the driver */
+} driver_place_t;
+
+static boolean_t packing_enabled(void)
+{
+	char* en = getenv("imgx_pack");
+
+	return (en && en[0] == '1');
+}
 
-	flags = command->flags;
+/*
+ * place_driver
+ *
+ * Works out where a driver with an image of 'image_size' bytes goes
+ * given the current kernel memory 'top' and 'pack' position.
+ */
+static void place_driver(uint32_t top,
+	uint32_t pack,
+	uint32_t image_size,
+	boolean_t has_exec,
+	driver_place_t* place)
+{
+	if (!packing_enabled()) {
+		place->base = top;
+		place->image = top + DRIVER_PAD_START;
+		place->top = top + align_up(image_size + DRIVER_PAD_START, 0x1000);
+		place->pack = place->top;
+	}
+	else if (has_exec) {
+		/* Need room for the DriverInfo in front of the page */
+		if (top - pack < DRIVER_PACKED_PAD)
+			top += 0x1000;
+
+		place->base = top - DRIVER_PACKED_PAD;
+		place->image = top;
+		place->top = top + align_up(image_size, 0x1000);
+		place->pack = align_up(top + image_size, 8);
+	}
+	else {
+		uint32_t size = align_up(DRIVER_PACKED_PAD + image_size, 8);
 
-	if (flags & (kCommandMachOFlags_CompressedLZSS | kCommandMachOFlags_CompressedQLZ))
-		is_compressed = TRUE;
+		if (top - pack >= size) {
+			place->base = pack;
+			place->top = top;
+		}
+		else {
+			place->base = top;
+			place->top = top + align_up(size, 0x1000);
+		}
 
-	/* Sanitize the filename */
-	if (command->name[NAME_LEN-1] != '\0') {
-		printf(KWARN "image name not NULL terminated - adding a NULL\n");
-		command->name[NAME_LEN-1] = '\0';
+		place->image = place->base + DRIVER_PACKED_PAD;
+		place->pack = place->base + size;
 	}
 
+	if (place->pack > place->top)
+		place->pack = place->top;
+}
+
+/*
+ * next_driver_place
+ *
+ * Where the driver of 'command' goes in the current kernel memory.
+ */
+static void next_driver_place(command_macho_t* command, uint32_t image_size, driver_place_t* place)
+{
+	place_driver(gKernelMemoryTop,
+		gKernelPackPos,
+		image_size,
+		(command->flags & kCommandMachOFlags_NoExec) ? FALSE : TRUE,
+		place);
+}
+
+/*
+ * begin_macho_command
+ *
+ * Sets up kernel memory for a Mach-O command and works out
+ * where the image goes. Only looks at the command header so this
+ * can be used before the payload is resident.
+ */
+static int begin_macho_command(command_macho_t* command, uint32_t* out_dest)
+{
+	uint32_t flags = command->flags;
+
+	/*
+	 * Commands might be in the resident ramdisk, so an unterminated
+	 * name is left as it is and only ever printed or copied cut short.
+	 */
+	if (command->name[NAME_LEN-1] != '\0')
+		printf(KWARN "image name not NULL terminated - cutting it short\n");
+
 	/* Setup kernel memory pointer */
 	if (flags & kMachKernel) {
 		bd_t	*bd = gd->bd;
@@ -253,6 +490,11 @@ static int load_macho_from_command(command_macho_t* command)
 		uint32_t slide = (command->load_address & 0xfffff);
 		uint32_t dram_start;
 
+		if (gLoadingFromRamdisk) {
+			printf(KERR "a kernel can't be loaded from the ramdisk, loading one drops it\n");
+			return 1;
+		}
+
 		if (!RANGE_IS_NULL(gKernelMemoryRange)) {
 			printf(KWARN "a kernel is already loaded - tearing it down\n");
 			teardown_old_loader_context();
@@ -267,6 +509,7 @@ static int load_macho_from_command(command_macho_t* command)
 
 		/* Physical load address for the kernel */
 		gKernelMemoryTop = (dram_start + slide);
+		gKernelPackPos = gKernelMemoryTop;
 
 		gKernelVirtualBase  = (command->load_address & ~0xfffff);
 		gKernelPhysicalBase = (dram_start);
@@ -276,97 +519,23 @@ static int load_macho_from_command(command_macho_t* command)
 			return 1;
 	}
 
-	raw_image_dest = gKernelMemoryTop;
-
-	printf(KINF "macho@%08x: '%s' cmp=%d sz=%08x dst=%08x\n",
-		image_address,
-		(const char*)&command->name,
-		is_compressed,
-		command->decomp_size,
-		raw_image_dest);
-
-	/* Pad for drivers */
-	if (flags & kMachDriver) {
-		raw_image_dest += DRIVER_PAD_START;
-	}
-
-	/* Decompress first if it was compressed */
-	if (is_compressed) {
-		uint8_t* decomp_image;
-
-		if (flags & kMachDriver) {
-			decomp_image = (uint8_t*)(raw_image_dest);
-		}
-		else {
-			/*
-			 * Assume that the loaded Mach-O file will be less than 
-			 * 4 times its unloaded form so we can get some memory
-			 * for the buffer from which we will then parse the file.
-			 */
-			decomp_image = (uint8_t*)(raw_image_dest + (command->decomp_size*4));
-		}
-
-		if (flags & kCommandMachOFlags_CompressedLZSS)
-		{
-			/* LZSS.C compression */
-
-			printf(KPROC(LZSS) "0x%08x => 0x%08x ...\n", image_address, decomp_image);
-
-			decompress_lzss(
-					decomp_image,
-					(uint8_t*)image_address,
-					blob_size
-				);
-		}
-		else if (flags & kCommandMachOFlags_CompressedQLZ)
-		{
-			/* QuickLz compression */
-
-			qlz_state_decompress *state_decompress;
-			unsigned int qlz_len;
-
-			qlz_len = qlz_size_decompressed((char*)image_address);
+	*out_dest = gKernelMemoryTop;
 
-			if (qlz_len != command->decomp_size) {
-				printf(KERR "QLZ decomp size mismatch (QLZ:0x%08x IMGX:0x%08x)\n",
-					qlz_len,
-					command->decomp_size);
-
-				return 1;
-			}
-
-			state_decompress =
-			(qlz_state_decompress *)malloc(sizeof(qlz_state_decompress));
-
-			if (!state_decompress) {
-				printf(KERR "unable to allocate %u bytes for QLZ decompressor\n",
-					sizeof(qlz_state_decompress));
-
-				return 1;
-			}
-
-			printf(KPROC3(QLZ) "0x%08x => 0x%08x ...\n", image_address, decomp_image);
-
-			/* go go go! */
-			qlz_decompress(
-				(char*)image_address,
-				(char*)decomp_image,
-				state_decompress);
-
-			free((void*)state_decompress);
-		}
-		else
-		{
-			printf(KERR "Unrecognized compression type\n");
-			return 1;
-		}
+	return 0;
+}
 
-		image_address = (uint32_t)decomp_image;
-		image_size = command->decomp_size;	
-	}
-	else {
-		image_size = blob_size;
-	}
+/*
+ * finish_macho_command
+ *
+ * Second half of a Mach-O command, once the (decompressed) image
+ * is in memory. Either records a driver or maps the kernel.
+ */
+static int finish_macho_command(command_macho_t* command,
+	uint32_t image_address,
+	uint32_t image_size,
+	boolean_t is_compressed)
+{
+	uint32_t flags = command->flags;
 
 	if (flags & kMachDriver) {
 		/*
@@ -374,6 +543,8 @@ static int load_macho_from_command(command_macho_t* command)
 		 * a list of all loaded driver binaries for later.
 		 */
 		loaded_driver_image_t* this;
+		driver_place_t place;
+		char name[NAME_LEN];
 
 		/* Sanity */
 		if (command->info_offset > image_size) {
@@ -381,20 +552,41 @@ static int load_macho_from_command(command_macho_t* command)
 			return 1;
 		}
 
-		this = malloc(sizeof(loaded_driver_image_t));
+		if ((flags & kCommandMachOFlags_NoExec) &&
+			!(flags & kCommandMachOFlags_HasInfoPlist))
+		{
+			printf(KERR "NoExec driver has no info.plist");
+			return 1;
+		}
+
+		/* Catches duplicates too */
+		bcopy((void*)command->name, (void*)name, NAME_LEN);
+		name[NAME_LEN-1] = '\0';
+
+		this = driver_registry_add(name);
+		if (!this)
+			return 1;
 
-		assert(this);
+		next_driver_place(command, image_size, &place);
 
 		if (!is_compressed) {
 			/*
 			 * If not compressed, we need to copy the driver into
 			 * the kernel memory.
 			 */
-			bcopy((void*)image_address, (void*)raw_image_dest, image_size);
+			bcopy((void*)image_address, (void*)place.image, image_size);
+		}
+		else if (image_address != place.image) {
+			printf(KERR "driver '%.*s' decompressed to the wrong place (0x%08x, wanted 0x%08x)\n",
+				COMMAND_NAME(command),
+				image_address,
+				place.image);
+			return 1;
 		}
 
-		this->range.base = gKernelMemoryTop;
-		this->range.size = (image_size + DRIVER_PAD_START);
+		this->range.base = place.base;
+		this->range.size = (place.image - place.base) + image_size;
+		this->image_base = place.image;
 
 		/* Is it a bare Info.plist */
 		if (flags & kCommandMachOFlags_NoExec)
@@ -402,33 +594,18 @@ static int load_macho_from_command(command_macho_t* command)
 		else
 			this->has_exec = TRUE;
 
-		/* Copy as bundle name */
-		bcopy((void*)&command->name, (void*)&this->name, NAME_LEN);
-
-		if (flags & kCommandMachOFlags_HasInfoPlist) {
+		if (flags & kCommandMachOFlags_HasInfoPlist)
 			this->info_offset = command->info_offset;
-		}
-		else {
-			if (flags & kCommandMachOFlags_NoExec) {
-				printf(KERR "NoExec driver has no info.plist");
-				free((void*)this);
-				return 1;
-			}
-			else {
-				this->info_offset = 0;
-			}
-		}
-
-		this->next = gLoadedDriverImages;
-		gLoadedDriverImages = this;
+		else
+			this->info_offset = 0;
 
-		increment_kernel_memory(this->range.size);
+		set_kernel_memory_top(place.top, place.pack);
 
 		if (flags & kCommandMachOFlags_NoExec) {
-			printf(KDONE "loaded pure Info.plist driver '%s'\n", (const char*)&command->name);
+			printf(KDONE "loaded pure Info.plist driver '%.*s'\n", COMMAND_NAME(command));
 		}
 		else {
-			printf(KDONE "loaded Info.plist/Exec driver '%s'\n", (const char*)&command->name);
+			printf(KDONE "loaded Info.plist/Exec driver '%.*s'\n", COMMAND_NAME(command));
 		}
 	}
 	else if (flags & kMachKernel) {
@@ -458,7 +635,7 @@ static int load_macho_from_command(command_macho_t* command)
 
 		increment_kernel_memory(size);
 
-		printf(KDONE "loaded kernel '%s' (ep=%08x)\n", (const char*)&command->name, entry_point);
+		printf(KDONE "loaded kernel '%.*s' (ep=%08x)\n", COMMAND_NAME(command), entry_point);
 	}
 	else {
 		printf(KERR "unsupported mach-o type (want driver or kernel)\n");
@@ -468,141 +645,2888 @@ static int load_macho_from_command(command_macho_t* command)
 	return 0;
 }
 
-static int load_general_image(uint32_t image_address, uint32_t image_size);
-
-/* DT parsers */
-extern boolean_t parse_xml_device_tree(uint32_t base);
-extern boolean_t parse_jsdt_device_tree(uint32_t base);
+/*
+ * The compression flags and payload formats are shared by every
+ * command that carries a compressed payload, Mach-O or ramdisk, and
+ * are looked up in the codec table (compressed/codecs.c). The helpers
+ * below take the payload apart from its command, the macho variants
+ * are shorthands for Mach-O commands.
+ */
 
-static int parse_xdt_command(command_t* cmd)
+/*
+ * check_payload
+ *
+ * Cheap header checks on a compressed payload that can be done
+ * before committing to decompressing it.
+ */
+static int check_payload(uint32_t flags, uint8_t* payload, uint32_t payload_size, uint32_t decomp_size)
 {
-	uint32_t base = (uint32_t)(cmd+1);
-	boolean_t ret;
+	const codec_t* codec = codec_for_flags(flags);
 
-	if (gHasDeviceTree) {
-		/* not fatal */
-		printf(KWARN "a device tree is already loaded, skipping\n");
-		return 0;
+	if (!codec) {
+		printf(KERR "Unrecognized compression type\n");
+		return 1;
 	}
 
-	if (!assert_kernel_load())
+	if (codec_check_trailer(flags, payload, payload_size))
 		return 1;
 
-	/*
-	 * Parse straight away to avoid having to keep the DT blob
-	 * in memory and risking having it overwritten.
-	 */
-	ret = parse_xml_device_tree(base);
-	if (!ret) {
-		return 1;
-	}
+	return codec->check(payload, codec_payload_size(flags, payload_size), decomp_size);
+}
 
-	gHasDeviceTree = TRUE;
+static const codec_t* macho_codec(command_macho_t* command)
+{
+	return codec_for_flags(command->flags);
+}
 
-	return 0;
+static int check_macho_payload(command_macho_t* command)
+{
+	return check_payload(command->flags,
+		(uint8_t*)(command+1),
+		command->size - sizeof(command_macho_t),
+		command->decomp_size);
 }
 
-static int parse_jsdt_command(command_t* cmd)
+/*
+ * alloc_codec_state
+ *
+ * Decoder state for one decode of a (checked) payload, in scratch.
+ * Codecs that don't need any get NULL, which isn't a failure, so
+ * failures are reported through 'ret'.
+ */
+static void* alloc_codec_state(const codec_t* codec, uint8_t* payload, int* ret)
 {
-	uint32_t base = (uint32_t)(cmd+1);
-	boolean_t ret;
+	uint32_t size = codec->state_size(payload);
+	void* state;
 
-	if (gHasDeviceTree) {
-		/* not fatal */
-		printf(KWARN "a device tree is already loaded, skipping\n");
-		return 0;
-	}
+	*ret = 0;
 
-	if (!assert_kernel_load())
-		return 1;
+	if (!size)
+		return NULL;
 
-	/*
-	 * Parse straight away to avoid having to keep the DT blob
-	 * in memory and risking having it overwritten.
-	 */
-	ret = parse_jsdt_device_tree(base);
-	if (!ret) {
-		return 1;
-	}
+	state = scratch_alloc(size, 0);
+	if (!state)
+		*ret = 1;
 
-	gHasDeviceTree = TRUE;
+	return state;
+}
+
+/*
+ * decompress_payload
+ *
+ * Decompresses a (checked) payload to 'decomp_image'. Doesn't
+ * allocate or print so it's safe to call from a worker, callers
+ * have to supply the decoder state.
+ */
+static int decompress_payload(uint32_t flags,
+	uint8_t* payload,
+	uint32_t payload_size,
+	uint32_t decomp_size,
+	uint8_t* decomp_image,
+	void* state)
+{
+	const codec_t* codec = codec_for_flags(flags);
+
+	return codec->decode(payload,
+		codec_payload_size(flags, payload_size),
+		decomp_image,
+		decomp_size,
+		state);
+}
+
+static int decompress_macho_payload(command_macho_t* command,
+	uint8_t* decomp_image,
+	void* state)
+{
+	return decompress_payload(command->flags,
+		(uint8_t*)(command+1),
+		command->size - sizeof(command_macho_t),
+		command->decomp_size,
+		decomp_image,
+		state);
+}
+
+/*---------------------------------------------------------------*/
+/* parallel block decompression */
+
+typedef struct {
+	const codec_t* codec;
+	uint8_t* payload;
+	uint8_t* image;
+	uint32_t nblocks;
+	volatile uint32_t next_block;
+	volatile uint32_t failed;
+} block_decomp_t;
+
+typedef struct {
+	block_decomp_t* decomp;
+	void* state;
+} block_decomp_job_t;
+
+/*
+ * Each worker keeps claiming the next undecoded block, so there is
+ * one job (and one decoder state) per CPU rather than per block.
+ */
+static void block_decomp_worker(void* arg)
+{
+	block_decomp_job_t* job = (block_decomp_job_t*)arg;
+	block_decomp_t* decomp = job->decomp;
+	uint32_t i;
+
+	while ((i = __sync_fetch_and_add(&decomp->next_block, 1)) < decomp->nblocks) {
+		if (decomp->codec->decode_block(decomp->payload, i, decomp->image, job->state)) {
+			decomp->failed = 1;
+		}
+	}
+}
+
+/*
+ * decompress_blocks_parallel
+ *
+ * Decodes a (checked) payload of a codec that can run in parallel
+ * with every CPU in the pool.
+ */
+static int decompress_blocks_parallel(const codec_t* codec, uint8_t* payload, uint8_t* image)
+{
+	block_decomp_t decomp;
+	block_decomp_job_t* jobs;
+	memory_region_t mark;
+	unsigned int cpus = worker_pool_size();
+	unsigned int i;
+	int ret = 0;
+
+	decomp.codec = codec;
+	decomp.payload = payload;
+	decomp.image = image;
+	decomp.nblocks = codec->block_count(payload);
+	decomp.next_block = 0;
+	decomp.failed = 0;
+
+	if (cpus > decomp.nblocks)
+		cpus = decomp.nblocks;
+
+	scratch_mark(&mark);
+
+	jobs = (block_decomp_job_t*)scratch_alloc(sizeof(block_decomp_job_t) * cpus, 0);
+	if (!jobs) {
+		ret = 1;
+		goto out;
+	}
+
+	for (i = 0; i < cpus; i++) {
+		jobs[i].decomp = &decomp;
+		jobs[i].state = alloc_codec_state(codec, payload, &ret);
+
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < cpus; i++) {
+		worker_pool_submit(block_decomp_worker, (void*)&jobs[i]);
+	}
+
+	worker_pool_wait();
+
+	if (decomp.failed) {
+		printf(KERR "block payload failed to decompress\n");
+		ret = 1;
+	}
+
+out:
+	scratch_release(&mark);
+
+	return ret;
+}
+
+/*
+ * decompress_command_payload
+ *
+ * Decompresses a (checked) payload to 'decomp_image' on this CPU,
+ * or over the whole pool if its codec can.
+ */
+static int decompress_command_payload(uint32_t flags,
+	uint8_t* payload,
+	uint32_t payload_size,
+	uint32_t decomp_size,
+	uint8_t* decomp_image)
+{
+	const codec_t* codec = codec_for_flags(flags);
+	memory_region_t mark;
+	void* state;
+	int ret;
+
+	if (codec->caps & kCodecCanParallel) {
+		printf("%s0x%08x => 0x%08x (%u blocks) ...\n",
+			codec->proc,
+			(uint32_t)payload,
+			decomp_image,
+			codec->block_count(payload));
+
+		return decompress_blocks_parallel(codec, payload, decomp_image);
+	}
+
+	scratch_mark(&mark);
+
+	state = alloc_codec_state(codec, payload, &ret);
+	if (ret) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	printf("%s0x%08x => 0x%08x ...\n", codec->proc, (uint32_t)payload, decomp_image);
+
+	/* go go go! */
+	ret = decompress_payload(flags,
+		payload,
+		payload_size,
+		decomp_size,
+		decomp_image,
+		state);
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+static boolean_t fits_below_floor(uint32_t base, uint32_t size)
+{
+	uint32_t floor = memory_high_floor();
+
+	return (base <= floor && size <= floor - base);
+}
+
+/*
+ * decompress_in_place
+ *
+ * Decodes a (checked) payload that sits at the tail of the room its
+ * in-place trailer asks for, forward over itself.
+ */
+static int decompress_in_place(const codec_t* codec,
+	uint8_t* payload,
+	uint32_t payload_size,
+	uint8_t* decomp_image,
+	uint32_t decomp_size)
+{
+	memory_region_t mark;
+	void* state;
+	int ret;
+
+	scratch_mark(&mark);
+
+	state = alloc_codec_state(codec, payload, &ret);
+	if (!ret)
+		ret = codec->decode(payload, payload_size, decomp_image, decomp_size, state);
+
+	scratch_release(&mark);
+
+	if (ret)
+		printf(KERR "%s payload failed to decompress in place\n", codec->name);
+
+	return ret;
+}
+
+/*
+ * decompress_over_payload
+ *
+ * Decompresses a payload that was loaded over its own destination,
+ * which happens when an image is put at the kernel memory top with
+ * 'fs load'. That only works if the packer left an in-place trailer,
+ * then the payload is moved to the tail of the room the trailer asks
+ * for and decoded over itself.
+ */
+static int decompress_over_payload(uint32_t flags,
+	uint8_t* payload,
+	uint32_t payload_size,
+	uint32_t decomp_size,
+	uint8_t* decomp_image)
+{
+	const codec_t* codec = codec_for_flags(flags);
+	codec_inplace_trailer_t trailer;
+	uint32_t size = codec_payload_size(flags, payload_size);
+	uint32_t room;
+
+	if (!(flags & kCodecFlagInPlace) || !(codec->caps & kCodecCanInPlace)) {
+		printf(KERR "%s payload at 0x%08x overlaps its destination 0x%08x (no in-place trailer)\n",
+			codec->name,
+			(uint32_t)payload,
+			(uint32_t)decomp_image);
+		return 1;
+	}
+
+	/* Checked with the payload, but not necessarily aligned */
+	bcopy((void*)(payload + size), (void*)&trailer, sizeof(trailer));
+
+	room = codec_inplace_room(size, decomp_size, trailer.margin);
+
+	if (!fits_below_floor((uint32_t)decomp_image, room)) {
+		printf(KERR "no room to decompress in place (0x%x bytes at 0x%08x)\n",
+			room,
+			(uint32_t)decomp_image);
+		return 1;
+	}
+
+	printf("%s0x%08x => 0x%08x in place ...\n", codec->proc, (uint32_t)payload, decomp_image);
+
+	memmove((void*)(decomp_image + room - size), (void*)payload, size);
+
+	return decompress_in_place(codec, decomp_image + room - size, size, decomp_image, decomp_size);
+}
+
+static int decompress_macho_command(command_macho_t* command, uint8_t* decomp_image)
+{
+	return decompress_command_payload(command->flags,
+		(uint8_t*)(command+1),
+		command->size - sizeof(command_macho_t),
+		command->decomp_size,
+		decomp_image);
+}
+
+/*---------------------------------------------------------------*/
+/* ramdisks */
+
+/*
+ * check_ramdisk
+ *
+ * Makes sure there is an HFS+ volume at 'addr'.
+ */
+static boolean_t check_ramdisk(uint32_t addr, uint32_t size)
+{
+	struct HFSPlusVolumeHeader* hdr;
+
+	if (size < (1024 + sizeof(struct HFSPlusVolumeHeader))) {
+		printf(KERR "loaded ramdisk too small to be valid HFS+ dmg (0x%08x bytes)\n", size);
+		return FALSE;
+	}
+
+	hdr = (struct HFSPlusVolumeHeader*)(addr+1024);
+
+	if (OSSwapInt16(hdr->signature) != kHFSPlusSigWord &&
+		OSSwapInt16(hdr->signature) != kHFSSigWord) {
+		printf(KERR "bad HFS+ signature (got 0x%08x wanted 'H+' or 'HX')\n", (uint32_t)OSSwapInt16(hdr->signature));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * register_ramdisk
+ *
+ * Adds a checked ramdisk at the kernel memory top to kernel memory.
+ */
+static void register_ramdisk(uint32_t addr, uint32_t size)
+{
+	struct HFSPlusVolumeHeader* hdr = (struct HFSPlusVolumeHeader*)(addr+1024);
+
+	gRAMDiskRange.base = addr;
+	gRAMDiskRange.size = size;
+
+	increment_kernel_memory(size);
+
+	printf(KDONE "loaded dmg [0x%08x-0x%08x, %u files, %u dirs]\n",
+		addr,
+		addr+size,
+		OSSwapInt32(hdr->fileCount),
+		OSSwapInt32(hdr->folderCount));
+}
+
+/*
+ * load_ramdisk_command
+ *
+ * Decompresses (or copies) a ramdisk command's image to the kernel
+ * memory top.
+ */
+static int load_ramdisk_command(command_ramdisk_t* command)
+{
+	uint8_t* payload = (uint8_t*)(command+1);
+	uint32_t payload_size = command->size - sizeof(command_ramdisk_t);
+	uint32_t dest = gKernelMemoryTop;
+
+	if (!assert_kernel_load())
+		return 1;
+
+	if (command->flags & kCommandRamdiskFlags_Sparse) {
+		printf(KPROC(RDSK) "expanding sparse ramdisk 0x%08x => 0x%08x ...\n",
+			(uint32_t)payload,
+			dest);
+
+		sparse_image_expand((sparse_image_t*)payload, (uint8_t*)dest);
+	}
+	else if (codec_for_flags(command->flags)) {
+		int ret;
+
+		if ((uint32_t)payload < dest + command->decomp_size &&
+			(uint32_t)payload + payload_size > dest)
+		{
+			ret = decompress_over_payload(command->flags,
+				payload,
+				payload_size,
+				command->decomp_size,
+				(uint8_t*)dest);
+		}
+		else {
+			ret = decompress_command_payload(command->flags,
+				payload,
+				payload_size,
+				command->decomp_size,
+				(uint8_t*)dest);
+		}
+
+		if (ret) {
+			printf(KERR "ramdisk failed to decompress\n");
+			return 1;
+		}
+	}
+	else {
+		bcopy((void*)payload, (void*)dest, payload_size);
+	}
+
+	if (!check_ramdisk(dest, command->decomp_size))
+		return 1;
+
+	register_ramdisk(dest, command->decomp_size);
+
+	return 0;
+}
+
+/*---------------------------------------------------------------*/
+/* load planning */
+
+/*
+ * Loading happens in two passes. The planner walks every command
+ * first, checks it and works out exactly where in kernel memory it
+ * goes, and refuses the image if the result doesn't fit below high
+ * memory. Nothing in kernel memory is touched until the whole plan
+ * checks out, then the steps are executed in order.
+ *
+ * The only thing the planner can't know from headers is how much VM
+ * the kernel maps, so the kernel is decompressed during planning
+ * into scratch taken from high memory (or found in the image cache)
+ * and measured there. That scratch is held until the plan has run.
+ *
+ * A command that fails its own checks (a truncated command, a bad
+ * payload, a malformed driver) doesn't sink the plan. Its step is
+ * marked failed and takes no kernel memory, and execution treats it
+ * like a command that failed to load, so with 'imgx_skip_failed' set
+ * the rest of the image still loads.
+ */
+
+typedef struct {
+	command_t* cmd;
+	uint32_t dest;    /* kernel memory taken by the command */
+	uint32_t size;
+	uint8_t* image;   /* (decompressed) Mach-O image */
+	boolean_t failed; /* refused by the planner */
+} plan_step_t;
+
+typedef struct {
+	plan_step_t* steps;
+	uint32_t nsteps;
+	uint32_t top;     /* kernel memory top once the plan has run */
+	memory_region_t high_mark;
+} load_plan_t;
+
+static boolean_t is_driver_command(command_t* cmd)
+{
+	return (cmd->magic == kCommandMachO &&
+		(((command_macho_t*)cmd)->flags & kMachDriver));
+}
+
+static boolean_t is_kernel_command(command_t* cmd)
+{
+	return (cmd->magic == kCommandMachO &&
+		(((command_macho_t*)cmd)->flags & kMachKernel));
+}
+
+static uint32_t macho_image_size(command_macho_t* command)
+{
+	if (macho_codec(command))
+		return command->decomp_size;
+	else
+		return command->size - sizeof(command_macho_t);
+}
+
+/*
+ * measure_macho
+ *
+ * How much VM a Mach-O image maps.
+ */
+static int measure_macho(uint8_t* image, uint32_t* vmsize)
+{
+	mach_loader_context_t ctx;
+	loader_return_t macho_ldr_return;
+
+	macho_ldr_return = mach_file_init(&ctx, image);
+	if (macho_ldr_return == LOADER_SUCCESS) {
+		macho_ldr_return = mach_file_vmsize(&ctx, vmsize);
+		mach_file_destroy(&ctx);
+	}
+
+	if (macho_ldr_return != LOADER_SUCCESS) {
+		printf(KERR "image at 0x%08x is not a loadable Mach-O (%d)\n",
+			(uint32_t)image,
+			macho_ldr_return);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * plan_kernel_image
+ *
+ * Gets the kernel's decompressed image into memory and measures it.
+ */
+static int plan_kernel_image(command_macho_t* command, plan_step_t* step)
+{
+	if (macho_codec(command)) {
+		image_cache_key_t key;
+		const uint8_t* cached;
+
+		if (check_macho_payload(command))
+			return 1;
+
+		image_cache_make_key(&key,
+			(void*)(command+1),
+			command->size - sizeof(command_macho_t),
+			command->decomp_size);
+
+		cached = image_cache_find(&key);
+
+		if (cached) {
+			printf(KPROC(CACHE) "'%.*s' served from the image cache\n",
+				COMMAND_NAME(command));
+
+			step->image = (uint8_t*)cached;
+		}
+		else {
+			step->image = (uint8_t*)scratch_alloc(align_up(command->decomp_size, 0x1000), 0x1000);
+
+			if (!step->image)
+				return 1;
+
+			if ((uint32_t)step->image < step->dest) {
+				printf(KERR "no room for 0x%x bytes of kernel scratch\n", command->decomp_size);
+				return 1;
+			}
+
+			if (decompress_macho_command(command, step->image))
+				return 1;
+
+			image_cache_store(&key, step->image, step->image);
+		}
+	}
+	else {
+		step->image = (uint8_t*)(command+1);
+	}
+
+	return measure_macho(step->image, &step->size);
+}
+
+/*
+ * plan_commands
+ *
+ * First pass. Fills in 'plan' for the 'ncmds' commands in 'cmds'.
+ */
+static int plan_commands(command_t** cmds, uint32_t ncmds, load_plan_t* plan)
+{
+	boolean_t have_kernel = !RANGE_IS_NULL(gKernelMemoryRange);
+	boolean_t have_drivers = FALSE;
+	boolean_t have_ramdisk = !RANGE_IS_NULL(gRAMDiskRange);
+	uint32_t top = gKernelMemoryTop;
+	uint32_t pack = gKernelPackPos;
+	uint32_t floor;
+	uint32_t i;
+
+	/* Long-lived high memory has to be claimed before any scratch */
+	image_cache_prepare();
+	scratch_mark(&plan->high_mark);
+
+	plan->nsteps = ncmds;
+	plan->steps = (plan_step_t*)scratch_alloc(sizeof(plan_step_t) * ncmds, 0);
+	if (!plan->steps) {
+		return 1;
+	}
+
+	bzero((void*)plan->steps, sizeof(plan_step_t) * ncmds);
+
+	for (i = 0; i < ncmds; i++) {
+		plan_step_t* step = &plan->steps[i];
+		command_t* cmd = cmds[i];
+
+		step->cmd = cmd;
+
+		if (cmd->size < sizeof(command_t)) {
+			printf(KERR "load command %u is truncated\n", i);
+			step->failed = TRUE;
+			continue;
+		}
+
+		if (cmd->magic == kTableOfContentsMagic) {
+			printf(KERR "ToC within a ToC is not allowed\n");
+			step->failed = TRUE;
+		}
+		else if (cmd->magic == kCommandMachO) {
+			command_macho_t* command = (command_macho_t*)cmd;
+
+			if (cmd->size < sizeof(command_macho_t)) {
+				printf(KERR "Mach-O command %u is truncated\n", i);
+				step->failed = TRUE;
+				continue;
+			}
+
+			/* Left as it is, see begin_macho_command */
+			if (command->name[NAME_LEN-1] != '\0')
+				printf(KWARN "image name not NULL terminated - cutting it short\n");
+
+			if (command->flags & kMachKernel) {
+				if (have_drivers) {
+					printf(KERR "kernel '%.*s' has to come before the drivers\n",
+						COMMAND_NAME(command));
+					return 1;
+				}
+
+				/* A new kernel starts kernel memory over */
+				top = gd->bd->bi_dram[0].start + (command->load_address & 0xfffff);
+				have_kernel = TRUE;
+				have_ramdisk = FALSE;
+
+				step->dest = top;
+
+				if (plan_kernel_image(command, step))
+					return 1;
+
+				top += align_up(step->size, 0x1000);
+				pack = top;
+			}
+			else if (command->flags & kMachDriver) {
+				uint32_t image_size = macho_image_size(command);
+				driver_place_t place;
+
+				if (!have_kernel) {
+					printf(KWARN "a kernel image has to be loaded first\n");
+					return 1;
+				}
+
+				if (macho_codec(command) &&
+					check_macho_payload(command))
+				{
+					step->failed = TRUE;
+					continue;
+				}
+
+				if (command->info_offset > image_size) {
+					printf(KERR "Malformed load command (InfoOffset > ImageSize)\n");
+					step->failed = TRUE;
+					continue;
+				}
+
+				place_driver(top,
+					pack,
+					image_size,
+					(command->flags & kCommandMachOFlags_NoExec) ? FALSE : TRUE,
+					&place);
+
+				step->dest = place.base;
+				step->size = place.top - top;
+				step->image = (uint8_t*)place.image;
+
+				top = place.top;
+				pack = place.pack;
+
+				have_drivers = TRUE;
+			}
+			else {
+				printf(KERR "unsupported mach-o type (want driver or kernel)\n");
+				step->failed = TRUE;
+			}
+		}
+		else if (cmd->magic == kCommandRamdisk) {
+			command_ramdisk_t* command = (command_ramdisk_t*)cmd;
+
+			if (cmd->size < sizeof(command_ramdisk_t)) {
+				printf(KERR "ramdisk command %u is truncated\n", i);
+				step->failed = TRUE;
+				continue;
+			}
+
+			if (!have_kernel) {
+				printf(KWARN "a kernel image has to be loaded first\n");
+				return 1;
+			}
+
+			if (have_ramdisk) {
+				printf(KERR "only one ramdisk can be loaded\n");
+				step->failed = TRUE;
+				continue;
+			}
+
+			if (command->flags & kCommandRamdiskFlags_Sparse) {
+				sparse_image_t* img = (sparse_image_t*)(command+1);
+
+				if (codec_for_flags(command->flags)) {
+					printf(KERR "sparse ramdisks can't be compressed\n");
+					step->failed = TRUE;
+					continue;
+				}
+
+				if (!sparse_image_check(img, cmd->size - sizeof(command_ramdisk_t))) {
+					step->failed = TRUE;
+					continue;
+				}
+
+				if (img->image_size != command->decomp_size) {
+					printf(KERR "sparse ramdisk size mismatch (SPRS:0x%08x IMGX:0x%08x)\n",
+						img->image_size,
+						command->decomp_size);
+					step->failed = TRUE;
+					continue;
+				}
+			}
+			else if (codec_for_flags(command->flags)) {
+				if (check_payload(command->flags,
+					(uint8_t*)(command+1),
+					cmd->size - sizeof(command_ramdisk_t),
+					command->decomp_size))
+				{
+					step->failed = TRUE;
+					continue;
+				}
+			}
+			else if (command->decomp_size != cmd->size - sizeof(command_ramdisk_t)) {
+				printf(KERR "ramdisk size mismatch (0x%x in a 0x%x byte command)\n",
+					command->decomp_size,
+					cmd->size);
+				step->failed = TRUE;
+				continue;
+			}
+
+			step->dest = top;
+			step->size = command->decomp_size;
+			have_ramdisk = TRUE;
+
+			top += align_up(step->size, 0x1000);
+			pack = top;
+		}
+		else if (cmd->magic == kCommandXMLDeviceTree ||
+			cmd->magic == kCommandJSDeviceTree)
+		{
+			if (!have_kernel) {
+				printf(KWARN "a kernel image has to be loaded first\n");
+				return 1;
+			}
+		}
+		else {
+			printf(KERR "load command 0x%08x is unknown\n", cmd->magic);
+			step->failed = TRUE;
+		}
+	}
+
+	/* Everything has to stay clear of high memory */
+	floor = memory_high_floor();
+
+	if (top > floor) {
+		printf(KERR "image does not fit: kernel memory would end at 0x%08x, limit is 0x%08x\n",
+			top,
+			floor);
+		return 1;
+	}
+
+	printf(KINF "plan: %u commands, kernel memory up to 0x%08x (0x%x free below 0x%08x)\n",
+		ncmds,
+		top,
+		floor - top,
+		floor);
+
+	plan->top = top;
+
+	/* Execution scratch must not land where the plan puts things */
+	scratch_claim_kernel_memory(top);
+
+	return 0;
+}
+
+/*
+ * release_plan
+ *
+ * Drops the plan and any scratch the planner took.
+ */
+static void release_plan(load_plan_t* plan)
+{
+	scratch_claim_kernel_memory(0);
+	scratch_release(&plan->high_mark);
+
+	plan->steps = NULL;
+}
+
+/*---------------------------------------------------------------*/
+/* parallel driver decompression */
+
+typedef struct {
+	command_macho_t* command;
+	uint8_t* dest;
+	void* state;
+	image_cache_key_t key;
+	boolean_t cached;
+	int ret;
+} driver_decomp_job_t;
+
+static void driver_decomp_worker(void* arg)
+{
+	driver_decomp_job_t* job = (driver_decomp_job_t*)arg;
+	job->ret = decompress_macho_payload(job->command, job->dest, job->state);
+}
+
+/*
+ * load_driver_batch
+ *
+ * Loads a run of planned driver steps. Every destination is known
+ * up front, so the decompressions are independent and get spread
+ * over the worker pool. The drivers are then recorded in plan order
+ * on this CPU so the driver list and kernel memory top come out the
+ * same no matter how the work was scheduled.
+ */
+static int load_driver_batch(plan_step_t* steps, uint32_t count)
+{
+	driver_decomp_job_t* jobs;
+	memory_region_t mark;
+	uint32_t i;
+	int ret = 0;
+
+	scratch_mark(&mark);
+
+	jobs = (driver_decomp_job_t*)scratch_alloc(sizeof(driver_decomp_job_t) * count, 0);
+	if (!jobs) {
+		ret = 1;
+		goto out;
+	}
+
+	bzero((void*)jobs, sizeof(driver_decomp_job_t) * count);
+
+	for (i = 0; i < count; i++) {
+		command_macho_t* command = (command_macho_t*)steps[i].cmd;
+
+		jobs[i].command = command;
+		jobs[i].dest = steps[i].image;
+
+		if (macho_codec(command)) {
+			image_cache_make_key(&jobs[i].key,
+				(void*)(command+1),
+				command->size - sizeof(command_macho_t),
+				command->decomp_size);
+
+			jobs[i].cached = image_cache_fetch(&jobs[i].key, jobs[i].dest);
+
+			if (!jobs[i].cached) {
+				jobs[i].state = alloc_codec_state(macho_codec(command), (uint8_t*)(command+1), &ret);
+
+				if (ret)
+					goto out;
+			}
+		}
+	}
+
+	printf(KPROC(KEXT) "decompressing %u drivers on %u cpu(s) ...\n",
+		count,
+		worker_pool_size());
+
+	/* Decompress */
+	for (i = 0; i < count; i++) {
+		if (macho_codec(jobs[i].command) && !jobs[i].cached) {
+			worker_pool_submit(driver_decomp_worker, (void*)&jobs[i]);
+		}
+	}
+
+	worker_pool_wait();
+
+	/* Record, in plan order */
+	for (i = 0; i < count; i++) {
+		command_macho_t* command = jobs[i].command;
+		driver_place_t place;
+		load_checkpoint_t cp;
+
+		next_driver_place(command, macho_image_size(command), &place);
+
+		if (place.base != steps[i].dest) {
+			printf(KERR "driver '%.*s' strayed from the plan (0x%08x, planned 0x%08x)\n",
+				COMMAND_NAME(command),
+				place.base,
+				steps[i].dest);
+			ret = 1;
+			goto out;
+		}
+
+		checkpoint_save(&cp);
+
+		if (jobs[i].ret) {
+			printf(KERR "driver '%.*s' failed to decompress\n", COMMAND_NAME(command));
+			ret = 1;
+		}
+		else if (macho_codec(command)) {
+			if (!jobs[i].cached)
+				image_cache_store(&jobs[i].key, jobs[i].dest, jobs[i].dest);
+
+			ret = finish_macho_command(command, (uint32_t)jobs[i].dest, command->decomp_size, TRUE);
+		}
+		else {
+			ret = finish_macho_command(command,
+				(uint32_t)(command+1),
+				command->size - sizeof(command_macho_t),
+				FALSE);
+		}
+
+		if (ret) {
+			checkpoint_rollback(&cp);
+
+			if (!skip_failed_commands())
+				goto out;
+
+			/* Leave its space empty so the rest of the plan holds */
+			printf(KWARN "skipped driver '%.*s'\n", COMMAND_NAME(command));
+			set_kernel_memory_top(place.top, place.pack);
+
+			ret = 0;
+		}
+	}
+
+out:
+	scratch_release(&mark);
+
+	return ret;
+}
+
+static int load_general_image(uint32_t image_address, uint32_t image_size);
+
+/* DT parsers */
+extern boolean_t parse_xml_device_tree(uint32_t base);
+extern boolean_t parse_jsdt_device_tree(uint32_t base);
+
+/*
+ * keep_device_tree_source
+ *
+ * Keeps a copy of a device tree command for warm boots and boot
+ * snapshots. Has to happen before parsing, which writes to the command.
+ */
+static void keep_device_tree_source(command_t* cmd)
+{
+	if (gDeviceTreeSource)
+		free((void*)gDeviceTreeSource);
+
+	gDeviceTreeSource = (command_t*)malloc(cmd->size);
+	if (!gDeviceTreeSource) {
+		printf(KWARN "unable to keep the device tree source\n");
+		return;
+	}
+
+	bcopy((void*)cmd, (void*)gDeviceTreeSource, cmd->size);
+}
+
+/*
+ * writable_command
+ *
+ * The parsers write to the command they parse. Commands in the
+ * ramdisk are copied to scratch first.
+ */
+static command_t* writable_command(command_t* cmd)
+{
+	command_t* copy;
+
+	if (!gLoadingFromRamdisk)
+		return cmd;
+
+	copy = (command_t*)scratch_alloc(cmd->size, 0);
+	if (copy)
+		bcopy((void*)cmd, (void*)copy, cmd->size);
+
+	return copy;
+}
+
+const void* device_tree_source(uint32_t* size)
+{
+	if (!gHasDeviceTree || !gDeviceTreeSource)
+		return NULL;
+
+	*size = gDeviceTreeSource->size;
+
+	return gDeviceTreeSource;
+}
+
+static int parse_xdt_command(command_t* cmd)
+{
+	memory_region_t mark;
+	boolean_t ret;
+
+	if (gHasDeviceTree) {
+		/* not fatal */
+		printf(KWARN "a device tree is already loaded, skipping\n");
+		return 0;
+	}
+
+	if (!assert_kernel_load())
+		return 1;
+
+	keep_device_tree_source(cmd);
+
+	/*
+	 * Parse straight away to avoid having to keep the DT blob
+	 * in memory and risking having it overwritten.
+	 */
+	scratch_mark(&mark);
+
+	cmd = writable_command(cmd);
+	ret = cmd ? parse_xml_device_tree((uint32_t)(cmd+1)) : FALSE;
+
+	scratch_release(&mark);
+
+	if (!ret) {
+		return 1;
+	}
+
+	gHasDeviceTree = TRUE;
+
+	return 0;
+}
+
+static int parse_jsdt_command(command_t* cmd)
+{
+	memory_region_t mark;
+	boolean_t ret;
+
+	if (gHasDeviceTree) {
+		/* not fatal */
+		printf(KWARN "a device tree is already loaded, skipping\n");
+		return 0;
+	}
+
+	if (!assert_kernel_load())
+		return 1;
+
+	keep_device_tree_source(cmd);
+
+	/*
+	 * Parse straight away to avoid having to keep the DT blob
+	 * in memory and risking having it overwritten.
+	 */
+	scratch_mark(&mark);
+
+	cmd = writable_command(cmd);
+	ret = cmd ? parse_jsdt_device_tree((uint32_t)(cmd+1)) : FALSE;
+
+	scratch_release(&mark);
+
+	if (!ret) {
+		return 1;
+	}
+
+	gHasDeviceTree = TRUE;
+
+	return 0;
+}
+
+/*
+ * load_device_tree_source
+ *
+ * Parses a device tree command kept by a previous boot. The parser
+ * works on a copy in scratch.
+ */
+int load_device_tree_source(const void* source, uint32_t size)
+{
+	memory_region_t mark;
+	command_t* cmd;
+	int ret = 1;
+
+	if (size < sizeof(command_t) || ((command_t*)source)->size != size)
+		return 1;
+
+	scratch_mark(&mark);
+
+	cmd = (command_t*)scratch_alloc(size, 0);
+	if (cmd) {
+		bcopy((void*)source, (void*)cmd, size);
+
+		if (cmd->magic == kCommandXMLDeviceTree)
+			ret = parse_xdt_command(cmd);
+		else if (cmd->magic == kCommandJSDeviceTree)
+			ret = parse_jsdt_command(cmd);
+	}
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+/*
+ * execute_kernel_step
+ *
+ * Maps the kernel from the image the planner prepared.
+ */
+static int execute_kernel_step(plan_step_t* step)
+{
+	command_macho_t* command = (command_macho_t*)step->cmd;
+	uint32_t dest;
+
+	if (begin_macho_command(command, &dest))
+		return 1;
+
+	printf(KINF "macho@%08x: '%.*s' cmp=%d sz=%08x dst=%08x\n",
+		(uint32_t)(command+1),
+		COMMAND_NAME(command),
+		macho_codec(command) ? 1 : 0,
+		command->decomp_size,
+		dest);
+
+	return finish_macho_command(command,
+		(uint32_t)step->image,
+		macho_image_size(command),
+		macho_codec(command) ? TRUE : FALSE);
+}
+
+/*
+ * execute_step
+ *
+ * Runs a single planned step that isn't a driver.
+ */
+static int execute_step(plan_step_t* step)
+{
+	command_t* cmd = step->cmd;
+
+	if (is_kernel_command(cmd)) {
+		return execute_kernel_step(step);
+	}
+	else if (cmd->magic == kCommandRamdisk) {
+		if (gKernelMemoryTop != step->dest) {
+			printf(KERR "ramdisk strayed from the plan (0x%08x, planned 0x%08x)\n",
+				gKernelMemoryTop,
+				step->dest);
+			return 1;
+		}
+
+		return load_ramdisk_command((command_ramdisk_t*)cmd);
+	}
+	else if (cmd->magic == kCommandXMLDeviceTree) {
+		return parse_xdt_command(cmd);
+	}
+	else if (cmd->magic == kCommandJSDeviceTree) {
+		return parse_jsdt_command(cmd);
+	}
+
+	return 0;
+}
+
+/*
+ * execute_plan
+ *
+ * Second pass. Runs the planned steps in order, loading runs of
+ * drivers as one batch. Failed steps are rolled back (and maybe
+ * skipped), see the checkpoints section.
+ */
+static int execute_plan(load_plan_t* plan)
+{
+	uint32_t i = 0;
+	int ret = 0;
+
+	while (i < plan->nsteps) {
+		plan_step_t* step = &plan->steps[i];
+		command_t* cmd = step->cmd;
+		uint32_t run = 1;
+
+		if (step->failed) {
+			/* Nothing was done for it, so there's nothing to roll back */
+			if (!skip_failed_commands()) {
+				printf(KERR "load command %u was refused by the planner\n", i);
+				return 1;
+			}
+
+			printf(KWARN "skipped load command %u (0x%08x)\n", i, cmd->magic);
+		}
+		else if (is_driver_command(cmd)) {
+			while (i + run < plan->nsteps &&
+				!plan->steps[i + run].failed &&
+				is_driver_command(plan->steps[i + run].cmd))
+			{
+				run++;
+			}
+
+			/* Checkpoints each driver itself */
+			ret = load_driver_batch(step, run);
+		}
+		else {
+			load_checkpoint_t cp;
+
+			checkpoint_save(&cp);
+
+			ret = execute_step(step);
+
+			if (ret && !is_kernel_command(cmd)) {
+				checkpoint_rollback(&cp);
+
+				if (skip_failed_commands()) {
+					printf(KWARN "skipped load command %u (0x%08x)\n", i, cmd->magic);
+
+					/* Leave its space empty so the rest of the plan holds */
+					if (cmd->magic == kCommandRamdisk) {
+						uint32_t top = step->dest + align_up(step->size, 0x1000);
+						set_kernel_memory_top(top, top);
+					}
+
+					ret = 0;
+				}
+			}
+		}
+
+		if (ret) {
+			return ret;
+		}
+
+		i += run;
+	}
+
+	return 0;
+}
+
+static int load_commands(command_t** cmds, uint32_t ncmds)
+{
+	load_plan_t plan;
+	int ret;
+
+	plan.steps = NULL;
+
+	ret = plan_commands(cmds, ncmds, &plan);
+	if (!ret) {
+		ret = execute_plan(&plan);
+	}
+
+	release_plan(&plan);
+
+	return ret;
+}
+
+/*---------------------------------------------------------------*/
+/* command selection */
+
+/*
+ * 'imgx only' and 'imgx skip' narrow down which drivers of an image
+ * get loaded, so one image can serve boards that need different sets
+ * of drivers. Kernels and device trees are always loaded.
+ */
+enum {
+	kSelectAll = 0,
+	kSelectOnly,
+	kSelectSkip
+};
+
+static int gSelectMode = kSelectAll;
+static const char* gSelectList = NULL;
+
+/*
+ * name_in_list
+ *
+ * Checks a comma separated list for 'name'.
+ */
+static boolean_t name_in_list(const char* name, const char* list)
+{
+	size_t len = strlen(name);
+
+	while (*list) {
+		const char* end = strchr(list, ',');
+		size_t n = end ? (size_t)(end - list) : strlen(list);
+
+		if (n == len && strncmp(list, name, n) == 0)
+			return TRUE;
+
+		if (!end)
+			break;
+
+		list = end + 1;
+	}
+
+	return FALSE;
+}
+
+/*
+ * command_wanted
+ *
+ * Whether 'imgx only' or 'imgx skip' lets a command through. Quiet
+ * for the streamed planning pass, which looks at every command once
+ * before it is loaded.
+ */
+static boolean_t command_wanted(uint32_t magic, uint32_t flags, const char* cmd_name, boolean_t quiet)
+{
+	char name[NAME_LEN];
+	boolean_t listed;
+
+	if (gSelectMode == kSelectAll || magic != kCommandMachO || !(flags & kMachDriver))
+		return TRUE;
+
+	/* Might not be terminated yet */
+	bcopy((void*)cmd_name, (void*)name, NAME_LEN);
+	name[NAME_LEN-1] = '\0';
+
+	listed = name_in_list(name, gSelectList);
+
+	if ((gSelectMode == kSelectOnly) ? !listed : listed) {
+		if (!quiet)
+			printf(KINF "skipping driver '%s'\n", name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static boolean_t command_selected(uint32_t magic, uint32_t flags, const char* cmd_name)
+{
+	return command_wanted(magic, flags, cmd_name, FALSE);
+}
+
+/*
+ * check_index
+ *
+ * Sanity checks the index command of a TOC with 'ncmds' commands.
+ */
+static boolean_t check_index(command_index_t* index, uint32_t ncmds)
+{
+	if (index->size < sizeof(command_index_t) ||
+		index->nentries != ncmds - 1 ||
+		(index->size - sizeof(command_index_t)) / sizeof(index_entry_t) < index->nentries)
+	{
+		printf(KERR "malformed TOC index (%u entries, 0x%x bytes)\n",
+			index->nentries,
+			index->size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * select_commands
+ *
+ * Collects the commands of 'toc' that are going to be loaded. When
+ * the TOC has an index, it is used instead of walking the commands
+ * and skipped commands are never touched.
+ */
+static int select_commands(table_of_contents_t* toc, command_t** cmds, uint32_t* out_count)
+{
+	command_t* cmd = (command_t*)(toc+1);
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (toc->ncmds && cmd->magic == kCommandIndex) {
+		command_index_t* index = (command_index_t*)cmd;
+		index_entry_t* entries = (index_entry_t*)(index+1);
+
+		if (!check_index(index, toc->ncmds))
+			return 1;
+
+		for (i = 0; i < index->nentries; i++) {
+			index_entry_t* ent = &entries[i];
+
+			if (!command_selected(ent->magic, ent->flags, ent->name))
+				continue;
+
+			if (ent->offset < sizeof(table_of_contents_t) || (ent->offset & 3)) {
+				printf(KERR "TOC index entry %u has a bad offset (0x%x)\n", i, ent->offset);
+				return 1;
+			}
+
+			cmd = (command_t*)((uint32_t)toc + ent->offset);
+
+			if (cmd->magic != ent->magic || cmd->size != ent->size) {
+				printf(KERR "TOC index entry %u doesn't match its command\n", i);
+				return 1;
+			}
+
+			cmds[count++] = cmd;
+		}
+	}
+	else {
+		for (i = 0; i < toc->ncmds; i++) {
+			boolean_t selected = TRUE;
+
+			if (cmd->magic == kCommandMachO) {
+				command_macho_t* command = (command_macho_t*)cmd;
+				selected = command_selected(cmd->magic, command->flags, command->name);
+			}
+			else if (cmd->magic == kCommandIndex) {
+				selected = FALSE;
+			}
+
+			if (selected)
+				cmds[count++] = cmd;
+
+			cmd = (command_t*)((uint32_t)cmd + (uint32_t)cmd->size);
+		}
+	}
+
+	*out_count = count;
+
+	return 0;
+}
+
+/*---------------------------------------------------------------*/
+/* boot driver pruning */
+
+/*
+ * The kernel only ever starts drivers that are required for booting
+ * (have OSBundleRequired) or that those depend on, so there is no
+ * point in decompressing or publishing anything else. Before the
+ * load is planned, every driver's Info.plist is read and the list
+ * is cut down to the OSBundleRequired drivers and the closure of
+ * their OSBundleLibraries.
+ *
+ * Drivers without a usable Info.plist are kept, the kernel gets to
+ * decide what to do with them. Pruning is off unless 'imgx_prune' is
+ * set to 1, and only done for images loaded from memory or out of the
+ * ramdisk. Streamed images would have to be read twice to get at the
+ * plists first, so they always load every driver.
+ */
+
+typedef struct {
+	command_macho_t* command;
+	char* plist_buf;
+	TagPtr plist;
+	const char* bundle_id;
+	boolean_t needed;
+} prune_driver_t;
+
+static boolean_t pruning_enabled(void)
+{
+	char* en = getenv("imgx_prune");
+
+	return (en && en[0] == '1');
+}
+
+static char* copy_plist(char* plist, const uint8_t* plist_start, uint32_t plist_size)
+{
+	/* The XML parser writes to its buffer, so it always gets a copy */
+	bcopy((void*)plist_start, (void*)plist, plist_size);
+	plist[plist_size] = '\0';
+
+	return plist;
+}
+
+/*
+ * read_driver_plist
+ *
+ * Returns a NUL terminated copy of a driver's Info.plist, or NULL.
+ * The copy is in scratch and lives until the caller's mark is
+ * released. Codecs that can decode a range only decode what holds
+ * the plist, other payloads have to be decoded whole and are put in
+ * the image cache so the load doesn't have to decode them again.
+ */
+static char* read_driver_plist(command_macho_t* command)
+{
+	uint32_t image_size = macho_image_size(command);
+	uint32_t plist_size;
+	memory_region_t mark;
+	const codec_t* codec = macho_codec(command);
+	void* state;
+	uint8_t* image;
+	char* plist_buf;
+	char* plist = NULL;
+	int ret;
+
+	if (!(command->flags & kCommandMachOFlags_HasInfoPlist) ||
+		command->info_offset >= image_size)
+	{
+		return NULL;
+	}
+
+	plist_size = image_size - command->info_offset;
+
+	/* Taken before the mark so it outlives the decode below */
+	plist_buf = (char*)scratch_alloc(plist_size + 1, 0);
+	if (!plist_buf)
+		return NULL;
+
+	if (!codec)
+		return copy_plist(plist_buf, (uint8_t*)(command+1) + command->info_offset, plist_size);
+
+	if (check_macho_payload(command))
+		return NULL;
+
+	scratch_mark(&mark);
+
+	image = (uint8_t*)scratch_alloc(align_up(image_size, 0x1000), 0x1000);
+	if (!image)
+		goto out;
+
+	state = alloc_codec_state(codec, (uint8_t*)(command+1), &ret);
+	if (ret)
+		goto out;
+
+	if (codec->caps & kCodecCanRange) {
+		ret = codec->decode_range((uint8_t*)(command+1),
+			image,
+			command->info_offset,
+			plist_size,
+			state);
+	}
+	else {
+		image_cache_key_t key;
+
+		ret = decompress_macho_payload(command, image, state);
+
+		if (!ret) {
+			image_cache_make_key(&key,
+				(void*)(command+1),
+				command->size - sizeof(command_macho_t),
+				command->decomp_size);
+
+			image_cache_store(&key, image, NULL);
+		}
+	}
+
+	if (!ret)
+		plist = copy_plist(plist_buf, image + command->info_offset, plist_size);
+
+out:
+	scratch_release(&mark);
+
+	return plist;
+}
+
+static prune_driver_t* find_driver_by_id(prune_driver_t* drivers, uint32_t count, const char* bundle_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (drivers[i].bundle_id && strcmp(drivers[i].bundle_id, bundle_id) == 0)
+			return &drivers[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * mark_needed
+ *
+ * Marks a driver and, recursively, everything in its
+ * OSBundleLibraries. Libraries that aren't in the image are
+ * provided by the kernel or missing, neither is our problem.
+ */
+static void mark_needed(prune_driver_t* drivers, uint32_t count, prune_driver_t* drv)
+{
+	TagPtr libs;
+	TagPtr tag;
+
+	if (drv->needed)
+		return;
+
+	drv->needed = TRUE;
+
+	if (!drv->plist)
+		return;
+
+	libs = XMLGetProperty(drv->plist, "OSBundleLibraries");
+	if (!libs || libs->type != kTagTypeDict)
+		return;
+
+	for (tag = libs->tag; tag; tag = tag->tagNext) {
+		prune_driver_t* dep;
+
+		if (tag->type != kTagTypeKey || !tag->string)
+			continue;
+
+		dep = find_driver_by_id(drivers, count, tag->string);
+		if (dep)
+			mark_needed(drivers, count, dep);
+	}
+}
+
+/*
+ * prune_drivers
+ *
+ * Drops drivers the kernel won't need from 'cmds'.
+ */
+static int prune_drivers(command_t** cmds, uint32_t* count)
+{
+	prune_driver_t* drivers;
+	memory_region_t mark;
+	uint32_t ndrivers = 0;
+	uint32_t nroots = 0;
+	uint32_t kept;
+	uint32_t i, j;
+
+	if (!pruning_enabled())
+		return 0;
+
+	for (i = 0; i < *count; i++) {
+		if (is_driver_command(cmds[i]))
+			ndrivers++;
+	}
+
+	if (!ndrivers)
+		return 0;
+
+	scratch_mark(&mark);
+
+	drivers = (prune_driver_t*)scratch_alloc(sizeof(prune_driver_t) * ndrivers, 0);
+	if (!drivers) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	bzero((void*)drivers, sizeof(prune_driver_t) * ndrivers);
+
+	for (i = 0, j = 0; i < *count; i++) {
+		prune_driver_t* drv;
+		TagPtr tag;
+
+		if (!is_driver_command(cmds[i]))
+			continue;
+
+		drv = &drivers[j++];
+		drv->command = (command_macho_t*)cmds[i];
+		drv->plist_buf = read_driver_plist(drv->command);
+
+		if (!drv->plist_buf || XMLParseFile(drv->plist_buf, &drv->plist) != 0) {
+			/* Can't tell, keep it */
+			drv->plist = NULL;
+			drv->needed = TRUE;
+			continue;
+		}
+
+		tag = XMLGetProperty(drv->plist, "CFBundleIdentifier");
+		if (tag && tag->type == kTagTypeString)
+			drv->bundle_id = tag->string;
+	}
+
+	for (i = 0; i < ndrivers; i++) {
+		if (drivers[i].plist && XMLGetProperty(drivers[i].plist, "OSBundleRequired")) {
+			mark_needed(drivers, ndrivers, &drivers[i]);
+			nroots++;
+		}
+	}
+
+	if (nroots == 0) {
+		printf(KWARN "no driver has OSBundleRequired, not pruning\n");
+
+		for (i = 0; i < ndrivers; i++)
+			drivers[i].needed = TRUE;
+	}
+
+	/* Compact the command list, keeping the order */
+	for (i = 0, j = 0, kept = 0; i < *count; i++) {
+		if (is_driver_command(cmds[i])) {
+			prune_driver_t* drv = &drivers[j++];
+
+			if (!drv->needed) {
+				printf(KINF "pruned driver '%.*s'\n", COMMAND_NAME(drv->command));
+				continue;
+			}
+		}
+
+		cmds[kept++] = cmds[i];
+	}
+
+	printf(KINF "pruning kept %u of %u drivers (%u required)\n",
+		ndrivers - (*count - kept),
+		ndrivers,
+		nroots);
+
+	*count = kept;
+
+	for (i = 0; i < ndrivers; i++) {
+		if (drivers[i].plist)
+			XMLFreeTag(drivers[i].plist);
+	}
+
+	/* Drops the plist copies along with the state */
+	scratch_release(&mark);
+
+	return 0;
+}
+
+static int parse_table_of_contents(table_of_contents_t* toc)
+{
+	command_t** cmds;
+	memory_region_t mark;
+	uint32_t count;
+	int ret;
+
+	printf(KINF "toc@%08x: %u load commands\n", (uint32_t)toc, toc->ncmds);
+
+	scratch_mark(&mark);
+
+	cmds = (command_t**)scratch_alloc(sizeof(command_t*) * (toc->ncmds + 1), 0);
+	if (!cmds) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	ret = select_commands(toc, cmds, &count);
+	if (!ret) {
+		ret = prune_drivers(cmds, &count);
+	}
+	if (!ret) {
+		ret = load_commands(cmds, count);
+	}
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+static int load_general_image(uint32_t image_address, uint32_t image_size)
+{
+	uint32_t* image_magic_ptr = (uint32_t*)image_address;
+	uint32_t image_magic = *image_magic_ptr;
+	char* cm = (char*)&image_magic;
+
+	printf(
+		KINF "image at 0x%08x, magic %c%c%c%c\n",
+		image_address,
+		cm[0],
+		cm[1],
+		cm[2],
+		cm[3]
+	);
+
+	if (image_magic == kCommandMachO || image_magic == kCommandRamdisk) {
+		command_t* cmd = (command_t*)image_address;
+		return load_commands(&cmd, 1);
+	}
+	else if (image_magic == kCommandXMLDeviceTree) {
+		command_t* cmd = (command_t*)image_address;
+		return parse_xdt_command(cmd);
+	}
+	else if (image_magic == kCommandJSDeviceTree) {
+		command_t* cmd = (command_t*)image_address;
+		return parse_jsdt_command(cmd);
+	}
+	else if (image_magic == kTableOfContentsMagic) {
+		table_of_contents_t* toc = (table_of_contents_t*)image_address;
+		return parse_table_of_contents(toc);
+	}
+	else {
+		printf(KERR "unknown image type (hex: 0x%08X)\n", image_magic);
+		return 1;
+	}
+}
+
+/*---------------------------------------------------------------*/
+/* streaming loader */
+
+/*
+ * Size of the window the streaming loader reads through. Big enough
+ * for the block layer to issue large transfers, small enough to
+ * stay resident in L2 while the decompressor chews through it.
+ */
+#define STREAM_CHUNK_SIZE 0x40000
+
+typedef struct {
+	const char* ifname;
+	const char* dev_part;
+	const char* path;
+
+	uint32_t offset; /* current file offset */
+	uint8_t* chunk;  /* read window */
+
+	/* Command being streamed, zero end until its header is read */
+	uint32_t cmd_end;
+	boolean_t cmd_is_kernel;
+
+	/* From plan_stream, what has to fit after a kernel and below what */
+	uint32_t plan_after_kernel;
+	uint32_t plan_floor;
+} imgx_stream_t;
+
+/*
+ * stream_read
+ *
+ * Reads the next 'len' bytes of the file to 'dst'. uBoot closes
+ * the filesystem after every read, so the device is selected
+ * again each time.
+ */
+static int stream_read(imgx_stream_t* st, void* dst, uint32_t len)
+{
+	int ret;
+
+	if (fs_set_blk_dev(st->ifname, st->dev_part, FS_TYPE_ANY)) {
+		printf(KERR "unable to select %s %s\n", st->ifname, st->dev_part);
+		return 1;
+	}
+
+	ret = fs_read(st->path, (ulong)dst, st->offset, len);
+
+	if (ret < 0 || (uint32_t)ret != len) {
+		printf(KERR "short read from '%s' (0x%x bytes at 0x%x, got %d)\n",
+			st->path,
+			len,
+			st->offset,
+			ret);
+		return 1;
+	}
+
+	st->offset += len;
+
+	return 0;
+}
+
+/*
+ * stream_payload
+ *
+ * Reads the next 'left' bytes of the file as a payload of a codec
+ * that can stream, feeding each chunk to the decoder as soon as it
+ * lands.
+ */
+static int stream_payload(imgx_stream_t* st, const codec_t* codec, uint32_t left, uint8_t* dst, uint32_t decomp_size)
+{
+	void* stream;
+	memory_region_t mark;
+	uint32_t produced;
+
+	scratch_mark(&mark);
+
+	stream = scratch_alloc(codec->stream_state_size, 0);
+	if (!stream) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	codec->stream_init(stream, dst, decomp_size);
+
+	while (left) {
+		uint32_t len = (left > STREAM_CHUNK_SIZE) ? STREAM_CHUNK_SIZE : left;
+
+		if (stream_read(st, st->chunk, len)) {
+			scratch_release(&mark);
+			return 1;
+		}
+
+		if (codec->stream_feed(stream, st->chunk, len)) {
+			printf(KERR "%s payload decodes past 0x%08x bytes\n",
+				codec->name,
+				decomp_size);
+			scratch_release(&mark);
+			return 1;
+		}
+
+		left -= len;
+	}
+
+	produced = codec->stream_produced(stream);
+	scratch_release(&mark);
+
+	if (produced != decomp_size) {
+		printf(KERR "%s decomp size mismatch (%s:0x%08x IMGX:0x%08x)\n",
+			codec->name,
+			codec->name,
+			produced,
+			decomp_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * stream_payload_in_place
+ *
+ * Reads the next 'payload_size' bytes of the file to the tail of
+ * the 'room' bytes at 'dst' and decodes them forward into the same
+ * bytes, so the payload never needs a buffer of its own.
+ */
+static int stream_payload_in_place(imgx_stream_t* st,
+	const codec_t* codec,
+	uint32_t payload_size,
+	uint8_t* dst,
+	uint32_t decomp_size,
+	uint32_t room)
+{
+	uint8_t* payload = dst + room - payload_size;
+
+	if (stream_read(st, payload, payload_size))
+		return 1;
+
+	if (codec->check(payload, payload_size, decomp_size))
+		return 1;
+
+	return decompress_in_place(codec, payload, payload_size, dst, decomp_size);
+}
+
+/*
+ * How the payload of the command being streamed gets decoded.
+ * Codecs that can stream are fed as the payload is read, other
+ * in-place payloads are read into the tail of their destination
+ * and need 'room' bytes there instead of just the decoded size.
+ */
+typedef struct {
+	const codec_t* codec;
+	uint32_t payload_size; /* without the in-place trailer */
+	uint32_t room;
+	boolean_t in_place;
+} stream_decode_t;
+
+/*
+ * stream_decode_prepare
+ *
+ * Works out how to decode the rest of the current command. Reads
+ * the in-place trailer, if needed, without moving the stream.
+ */
+static int stream_decode_prepare(imgx_stream_t* st, uint32_t flags, uint32_t decomp_size, stream_decode_t* dec)
+{
+	codec_inplace_trailer_t trailer;
+	uint32_t left = st->cmd_end - st->offset;
+	uint32_t offset = st->offset;
+	int ret;
+
+	dec->codec = codec_for_flags(flags);
+	dec->payload_size = codec_payload_size(flags, left);
+	dec->room = decomp_size;
+	dec->in_place = FALSE;
+
+	if (dec->codec->caps & kCodecCanStream)
+		return 0;
+
+	if (left < sizeof(trailer)) {
+		printf(KERR "payload too small for an in-place trailer (0x%x bytes)\n", left);
+		return 1;
+	}
+
+	st->offset = st->cmd_end - sizeof(trailer);
+	ret = stream_read(st, &trailer, sizeof(trailer));
+	st->offset = offset;
+
+	if (ret || codec_check_trailer(flags, (uint8_t*)&trailer, sizeof(trailer)))
+		return 1;
+
+	dec->room = codec_inplace_room(dec->payload_size, decomp_size, trailer.margin);
+	dec->in_place = TRUE;
+
+	return 0;
+}
+
+/*
+ * stream_decode
+ *
+ * Decodes the rest of the current command to 'dst', which has
+ * 'dec->room' bytes, and leaves the stream past the command.
+ */
+static int stream_decode(imgx_stream_t* st, stream_decode_t* dec, uint8_t* dst, uint32_t decomp_size)
+{
+	int ret;
+
+	if (dec->in_place) {
+		ret = stream_payload_in_place(st,
+			dec->codec,
+			dec->payload_size,
+			dst,
+			decomp_size,
+			dec->room);
+	}
+	else {
+		ret = stream_payload(st, dec->codec, dec->payload_size, dst, decomp_size);
+	}
+
+	/* Past the trailer, if any */
+	st->offset = st->cmd_end;
+
+	return ret;
+}
+
+/*
+ * fits_plan
+ *
+ * Whether what plan_stream found after the kernel fits from 'base'.
+ */
+static boolean_t fits_plan(imgx_stream_t* st, uint32_t base)
+{
+	return (base <= st->plan_floor && st->plan_after_kernel <= st->plan_floor - base);
+}
+
+/*
+ * stream_macho
+ *
+ * Reads a compressed Mach-O payload chunk by chunk and feeds
+ * each chunk to the decompressor as soon as it lands, or decodes
+ * it in place, so the compressed image is never staged in DRAM
+ * on its own. Kernels are decompressed to scratch in high memory,
+ * drivers straight into place.
+ */
+static int stream_macho(imgx_stream_t* st, command_macho_t* command)
+{
+	stream_decode_t dec;
+	memory_region_t mark;
+	uint32_t raw_image_dest;
+	uint8_t* decomp_image;
+	uint32_t produced;
+	int ret = 1;
+
+	if (begin_macho_command(command, &raw_image_dest))
+		return 1;
+
+	if (stream_decode_prepare(st, command->flags, command->decomp_size, &dec))
+		return 1;
+
+	scratch_mark(&mark);
+
+	if (command->flags & kMachKernel) {
+		decomp_image = (uint8_t*)scratch_alloc(align_up(dec.room, 0x1000), 0x1000);
+		if (!decomp_image)
+			goto out;
+	}
+	else {
+		driver_place_t place;
+
+		next_driver_place(command, command->decomp_size, &place);
+		decomp_image = (uint8_t*)place.image;
+	}
+
+	if (command->flags & kMachKernel) {
+		if ((uint32_t)decomp_image < raw_image_dest) {
+			printf(KERR "no room for 0x%x bytes of kernel scratch\n", command->decomp_size);
+			goto out;
+		}
+	}
+	else if (!fits_below_floor((uint32_t)decomp_image, dec.room)) {
+		printf(KERR "driver '%.*s' does not fit below 0x%08x\n",
+			COMMAND_NAME(command),
+			memory_high_floor());
+		goto out;
+	}
+
+	printf("%s%s '%.*s' (0x%x bytes) => 0x%08x ...\n",
+		dec.codec->proc,
+		dec.in_place ? "in place" : "streaming",
+		COMMAND_NAME(command),
+		dec.payload_size,
+		decomp_image);
+
+	if (stream_decode(st, &dec, decomp_image, command->decomp_size))
+		goto out;
+
+	produced = command->decomp_size;
+
+	if (command->flags & kMachKernel) {
+		uint32_t vmsize;
+
+		if (measure_macho(decomp_image, &vmsize))
+			goto out;
+
+		if (raw_image_dest + vmsize > memory_high_floor()) {
+			printf(KERR "kernel does not fit below 0x%08x (vmsize=0x%x)\n",
+				memory_high_floor(),
+				vmsize);
+			goto out;
+		}
+
+		/* Nothing is mapped yet, the rest of the image has to fit too */
+		if (!fits_plan(st, align_up(raw_image_dest + vmsize, 0x1000))) {
+			printf(KERR "image does not fit: 0x%x bytes after the kernel (vmsize=0x%x) would end past 0x%08x\n",
+				st->plan_after_kernel,
+				vmsize,
+				st->plan_floor);
+			goto out;
+		}
+	}
+
+	ret = finish_macho_command(command, (uint32_t)decomp_image, produced, TRUE);
+
+out:
+	scratch_release(&mark);
+
+	return ret;
+}
+
+/*
+ * stream_ramdisk
+ *
+ * Streams a compressed ramdisk straight to the kernel memory top,
+ * so only the compressed image is ever read.
+ */
+static int stream_ramdisk(imgx_stream_t* st, command_ramdisk_t* command)
+{
+	stream_decode_t dec;
+	uint32_t dest = gKernelMemoryTop;
+
+	if (!assert_kernel_load())
+		return 1;
+
+	if (!RANGE_IS_NULL(gRAMDiskRange)) {
+		printf(KERR "only one ramdisk can be loaded\n");
+		return 1;
+	}
+
+	if (stream_decode_prepare(st, command->flags, command->decomp_size, &dec))
+		return 1;
+
+	if (!fits_below_floor(dest, dec.room)) {
+		printf(KERR "ramdisk does not fit below 0x%08x\n", memory_high_floor());
+		return 1;
+	}
+
+	printf("%s%s ramdisk (0x%x bytes) => 0x%08x ...\n",
+		dec.codec->proc,
+		dec.in_place ? "in place" : "streaming",
+		dec.payload_size,
+		dest);
+
+	if (stream_decode(st, &dec, (uint8_t*)dest, command->decomp_size))
+		return 1;
+
+	if (!check_ramdisk(dest, command->decomp_size))
+		return 1;
+
+	register_ramdisk(dest, command->decomp_size);
+
+	return 0;
+}
+
+/*
+ * can_stream
+ *
+ * Whether a payload can be decoded as it is read, or read straight
+ * to where it is decoded in place. Everything else is staged whole.
+ */
+static boolean_t can_stream(uint32_t flags)
+{
+	const codec_t* codec = codec_for_flags(flags);
+
+	if (!codec)
+		return FALSE;
+
+	if (codec->caps & kCodecCanStream)
+		return TRUE;
+
+	return ((flags & kCodecFlagInPlace) && (codec->caps & kCodecCanInPlace)) ? TRUE : FALSE;
+}
+
+static int stream_command(imgx_stream_t* st)
+{
+	command_macho_t header;
+	memory_region_t mark;
+	uint8_t* staged;
+	uint32_t header_size;
+	int ret;
+
+	/* Command headers are tiny, read the largest one we know about */
+	if (stream_read(st, &header, sizeof(command_t)))
+		return 1;
+
+	if (header.size < sizeof(command_t)) {
+		printf(KERR "load command 0x%08x is truncated\n", header.magic);
+		return 1;
+	}
+
+	st->cmd_end = st->offset - sizeof(command_t) + header.size;
+
+	if (header.magic == kCommandMachO) {
+		header_size = sizeof(command_macho_t);
+
+		if (stream_read(st, (uint8_t*)&header + sizeof(command_t), header_size - sizeof(command_t)))
+			return 1;
+
+		if (header.size < header_size) {
+			printf(KERR "load command 0x%08x is truncated\n", header.magic);
+			return 1;
+		}
+
+		st->cmd_is_kernel = (header.flags & kMachKernel) ? TRUE : FALSE;
+
+		if (!command_selected(header.magic, header.flags, header.name)) {
+			/* Never read it */
+			st->offset += header.size - header_size;
+			return 0;
+		}
+
+		if (can_stream(header.flags))
+			return stream_macho(st, &header);
+	}
+	else if (header.magic == kCommandRamdisk) {
+		command_ramdisk_t* ramdisk = (command_ramdisk_t*)&header;
+
+		header_size = sizeof(command_ramdisk_t);
+
+		if (stream_read(st, (uint8_t*)&header + sizeof(command_t), header_size - sizeof(command_t)))
+			return 1;
+
+		if (header.size < header_size) {
+			printf(KERR "load command 0x%08x is truncated\n", header.magic);
+			return 1;
+		}
+
+		if (!(ramdisk->flags & kCommandRamdiskFlags_Sparse) && can_stream(ramdisk->flags))
+			return stream_ramdisk(st, ramdisk);
+	}
+	else if (header.magic == kTableOfContentsMagic) {
+		printf(KERR "ToC within a ToC is not allowed\n");
+		return 1;
+	}
+	else if (header.magic == kCommandIndex) {
+		/* Only meaningful at the head of a TOC */
+		st->offset += header.size - sizeof(command_t);
+		return 0;
+	}
+	else {
+		header_size = sizeof(command_t);
+	}
+
+	if (header.size < header_size) {
+		printf(KERR "load command 0x%08x is truncated\n", header.magic);
+		return 1;
+	}
+
+	/*
+	 * Stage the whole command in high memory and hand it to the
+	 * in-memory path, which plans around it.
+	 */
+	scratch_mark(&mark);
+
+	staged = (uint8_t*)scratch_alloc(header.size, 0x1000);
+	if (!staged) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	bcopy((void*)&header, (void*)staged, header_size);
+
+	ret = stream_read(st, staged + header_size, header.size - header_size);
+	if (!ret) {
+		ret = load_general_image((uint32_t)staged, header.size);
+	}
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+/*
+ * stream_command_checked
+ *
+ * Streams one command against a checkpoint.
+ */
+static int stream_command_checked(imgx_stream_t* st)
+{
+	load_checkpoint_t cp;
+	uint32_t start = st->offset;
+	int ret;
+
+	st->cmd_end = 0;
+	st->cmd_is_kernel = FALSE;
+
+	checkpoint_save(&cp);
+
+	ret = stream_command(st);
+
+	if (ret && st->cmd_end > start && !st->cmd_is_kernel) {
+		checkpoint_rollback(&cp);
+
+		if (skip_failed_commands()) {
+			printf(KWARN "skipped load command at 0x%x\n", start);
+			st->offset = st->cmd_end;
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Streamed images are planned from their command headers before any
+ * payload is read, the way plan_commands plans images in memory, so
+ * one that can't fit is refused before anything is written. Only the
+ * headers (and in-place trailers) are read for it. A kernel's vmsize
+ * isn't known until it is decompressed, so the plan measures what
+ * comes after a kernel from the kernel's end, and stream_macho checks
+ * it once the kernel is measured, before the kernel is mapped.
+ */
+typedef struct {
+	uint32_t top;
+	uint32_t pack;
+	uint32_t end;    /* highest byte anything decodes to */
+	uint32_t limit;  /* what 'end' must stay within */
+	boolean_t kernel;
+	boolean_t stopped; /* hit a command too broken to walk past */
+} stream_plan_t;
+
+/*
+ * plan_grow
+ *
+ * Notes that the plan writes up to 'base + size'.
+ */
+static boolean_t plan_grow(stream_plan_t* plan, uint32_t base, uint32_t size)
+{
+	if (base > plan->limit || size > plan->limit - base)
+		return FALSE;
+
+	if (base + size > plan->end)
+		plan->end = base + size;
+
+	return TRUE;
+}
+
+/*
+ * plan_streamed_command
+ *
+ * Adds the command at 'st->offset' to the plan and leaves the stream
+ * at the next one. A command the streaming pass will refuse anyway
+ * adds nothing, it gets reported there.
+ */
+static int plan_streamed_command(imgx_stream_t* st, stream_plan_t* plan, boolean_t selected)
+{
+	command_macho_t header;
+	command_ramdisk_t* ramdisk = (command_ramdisk_t*)&header;
+	stream_decode_t dec;
+	uint32_t start = st->offset;
+	uint32_t header_size;
+	uint32_t flags;
+	uint32_t decomp_size;
+
+	if (stream_read(st, &header, sizeof(command_t)))
+		return 1;
+
+	/* Too broken to walk past, the streaming pass stops here too */
+	if (header.size < sizeof(command_t)) {
+		plan->stopped = TRUE;
+		return 0;
+	}
+
+	st->offset = start + header.size;
+
+	if (header.magic == kCommandMachO)
+		header_size = sizeof(command_macho_t);
+	else if (header.magic == kCommandRamdisk)
+		header_size = sizeof(command_ramdisk_t);
+	else
+		return 0;
+
+	if (header.size < header_size)
+		return 0;
+
+	st->offset = start + sizeof(command_t);
+
+	if (stream_read(st, (uint8_t*)&header + sizeof(command_t), header_size - sizeof(command_t)))
+		return 1;
+
+	st->offset = start + header.size;
+
+	if (header.magic == kCommandMachO) {
+		if (!selected && !command_wanted(header.magic, header.flags, header.name, TRUE))
+			return 0;
+
+		flags = header.flags;
+		decomp_size = macho_image_size(&header);
+
+		if (flags & kMachKernel) {
+			/* Starts kernel memory over, at an end only known later */
+			plan->kernel = TRUE;
+			plan->top = 0;
+			plan->pack = 0;
+			plan->end = 0;
+			plan->limit = 0xFFFFFFFF;
+			return 0;
+		}
+
+		if (!(flags & kMachDriver))
+			return 0;
+	}
+	else {
+		if (ramdisk->flags & kCommandRamdiskFlags_Sparse)
+			flags = 0;
+		else
+			flags = ramdisk->flags;
+
+		decomp_size = ramdisk->decomp_size;
+	}
+
+	dec.room = decomp_size;
+
+	if (codec_for_flags(flags) && can_stream(flags)) {
+		st->cmd_end = start + header.size;
+		st->offset = start + header_size;
+
+		if (stream_decode_prepare(st, flags, decomp_size, &dec)) {
+			if (!skip_failed_commands())
+				return 1;
+
+			/* Will be skipped */
+			st->offset = start + header.size;
+			return 0;
+		}
+
+		st->offset = start + header.size;
+	}
+
+	if (header.magic == kCommandMachO) {
+		driver_place_t place;
+
+		if (decomp_size > plan->limit) {
+			printf(KERR "driver '%.*s' does not fit (0x%x bytes)\n",
+				NAME_LEN,
+				(const char*)&header.name,
+				decomp_size);
+			return 1;
+		}
+
+		place_driver(plan->top,
+			plan->pack,
+			decomp_size,
+			(flags & kCommandMachOFlags_NoExec) ? FALSE : TRUE,
+			&place);
+
+		if (!plan_grow(plan, place.base, place.top - place.base) ||
+			!plan_grow(plan, place.image, dec.room))
+		{
+			printf(KERR "driver '%.*s' does not fit (0x%x bytes)\n",
+				NAME_LEN,
+				(const char*)&header.name,
+				decomp_size);
+			return 1;
+		}
+
+		plan->top = place.top;
+		plan->pack = place.pack;
+	}
+	else {
+		if (!plan_grow(plan, plan->top, dec.room) ||
+			!plan_grow(plan, plan->top, align_up(decomp_size, 0x1000)))
+		{
+			printf(KERR "ramdisk does not fit (0x%x bytes)\n", decomp_size);
+			return 1;
+		}
+
+		plan->top += align_up(decomp_size, 0x1000);
+		plan->pack = plan->top;
+	}
+
+	return 0;
+}
+
+/*
+ * plan_stream_begin
+ *
+ * Starts a plan from the current kernel memory top.
+ */
+static void plan_stream_begin(stream_plan_t* plan)
+{
+	plan->top = gKernelMemoryTop;
+	plan->pack = gKernelPackPos;
+	plan->end = plan->top;
+	plan->limit = memory_high_floor();
+	plan->kernel = FALSE;
+	plan->stopped = FALSE;
+}
+
+/*
+ * plan_stream_end
+ *
+ * Checks what a finished plan adds up to against high memory, and
+ * leaves what comes after a kernel for stream_macho to check.
+ */
+static int plan_stream_end(imgx_stream_t* st, stream_plan_t* plan, uint32_t ncmds)
+{
+	uint32_t floor = memory_high_floor();
+
+	st->plan_floor = floor;
+	st->plan_after_kernel = 0;
+
+	if (plan->kernel) {
+		st->plan_after_kernel = plan->end;
+
+		printf(KINF "plan: %u commands, 0x%x bytes after the kernel, limit is 0x%08x\n",
+			ncmds,
+			plan->end,
+			floor);
+
+		if (!fits_plan(st, gd->bd->bi_dram[0].start)) {
+			printf(KERR "image does not fit: 0x%x bytes after the kernel, limit is 0x%08x\n",
+				plan->end,
+				floor);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (plan->end > floor) {
+		printf(KERR "image does not fit: kernel memory would end at 0x%08x, limit is 0x%08x\n",
+			plan->end,
+			floor);
+		return 1;
+	}
+
+	printf(KINF "plan: %u commands, kernel memory up to 0x%08x (0x%x free below 0x%08x)\n",
+		ncmds,
+		plan->end,
+		floor - plan->end,
+		floor);
+
+	return 0;
+}
+
+/*
+ * stream_indexed_toc
+ *
+ * Streams the commands listed in the index at 'st->offset', seeking
+ * straight to the selected ones.
+ */
+static int stream_indexed_toc(imgx_stream_t* st, uint32_t ncmds)
+{
+	command_index_t index;
+	index_entry_t* entries;
+	stream_plan_t plan;
+	memory_region_t mark;
+	uint32_t entries_size;
+	uint32_t index_end;
+	uint32_t i;
+	int ret = 0;
+
+	if (stream_read(st, &index, sizeof(index)))
+		return 1;
+
+	if (!check_index(&index, ncmds))
+		return 1;
+
+	index_end = st->offset - sizeof(index) + index.size;
+	entries_size = sizeof(index_entry_t) * index.nentries;
+
+	scratch_mark(&mark);
+
+	entries = (index_entry_t*)scratch_alloc(entries_size ? entries_size : 1, 0);
+	if (!entries || stream_read(st, entries, entries_size)) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	for (i = 0; i < index.nentries; i++) {
+		if (entries[i].offset < index_end || (entries[i].offset & 3)) {
+			printf(KERR "TOC index entry %u has a bad offset (0x%x)\n", i, entries[i].offset);
+			scratch_release(&mark);
+			return 1;
+		}
+	}
+
+	plan_stream_begin(&plan);
 
-	return 0;
+	for (i = 0; i < index.nentries && !ret; i++) {
+		index_entry_t* ent = &entries[i];
+
+		if (!command_wanted(ent->magic, ent->flags, ent->name, TRUE))
+			continue;
+
+		st->offset = ent->offset;
+		ret = plan_streamed_command(st, &plan, TRUE);
+	}
+
+	if (!ret)
+		ret = plan_stream_end(st, &plan, ncmds);
+
+	for (i = 0; i < index.nentries && !ret; i++) {
+		index_entry_t* ent = &entries[i];
+
+		if (!command_selected(ent->magic, ent->flags, ent->name))
+			continue;
+
+		st->offset = ent->offset;
+
+		ret = stream_command_checked(st);
+	}
+
+	scratch_release(&mark);
+
+	return ret;
 }
 
-static int parse_table_of_contents(table_of_contents_t* toc)
+static int load_streamed_image(const char* ifname, const char* dev_part, const char* path)
 {
-	uint32_t left_cmds = toc->ncmds;
-	command_t* cmd = (command_t*)(toc+1);
+	imgx_stream_t st;
+	memory_region_t mark;
+	table_of_contents_t toc;
+	stream_plan_t plan;
+	command_t first;
+	uint32_t left_cmds;
+	uint32_t start;
+	uint32_t i;
+	int ret = 0;
+
+	st.ifname = ifname;
+	st.dev_part = dev_part;
+	st.path = path;
+	st.offset = 0;
+	st.plan_after_kernel = 0;
+	st.plan_floor = 0xFFFFFFFF;
+
+	scratch_mark(&mark);
+
+	st.chunk = (uint8_t*)scratch_alloc(STREAM_CHUNK_SIZE, 64);
+	if (!st.chunk || stream_read(&st, &toc, sizeof(toc))) {
+		scratch_release(&mark);
+		return 1;
+	}
 
-	printf(KINF "toc@%08x: %u load commands\n", (uint32_t)toc, left_cmds);
+	if (pruning_enabled())
+		printf(KWARN "streamed images aren't pruned, loading every driver\n");
 
-	while (left_cmds--) {
-		int ret = 0;
+	if (toc.magic == kTableOfContentsMagic) {
+		left_cmds = toc.ncmds;
+		printf(KINF "toc@%s: %u load commands\n", path, left_cmds);
 
-		if (cmd->magic == kTableOfContentsMagic) {
-			printf(KERR "ToC within a ToC is not allowed\n");
-			ret = 1;
-		}
-		else if (cmd->magic == kCommandMachO) {
-			ret = load_macho_from_command((command_macho_t*)cmd);
-		}
-		else if (cmd->magic == kCommandXMLDeviceTree) {
-			ret = parse_xdt_command(cmd);
-		}
-		else if (cmd->magic == kCommandJSDeviceTree) {
-			ret = parse_jsdt_command(cmd);
+		if (left_cmds) {
+			if (stream_read(&st, &first, sizeof(first))) {
+				scratch_release(&mark);
+				return 1;
+			}
+
+			st.offset -= sizeof(first);
+
+			if (first.magic == kCommandIndex) {
+				ret = stream_indexed_toc(&st, left_cmds);
+				scratch_release(&mark);
+				return ret;
+			}
 		}
-		else {
-			printf(KERR "load command 0x%08x is unknown\n", cmd->magic);
-			ret = 1;
+	}
+	else {
+		/* Single command, rewind */
+		left_cmds = 1;
+		st.offset = 0;
+	}
+
+	/* Plan from the headers, then come back for the payloads */
+	start = st.offset;
+	plan_stream_begin(&plan);
+
+	for (i = 0; i < left_cmds && !ret && !plan.stopped; i++)
+		ret = plan_streamed_command(&st, &plan, FALSE);
+
+	if (!ret)
+		ret = plan_stream_end(&st, &plan, left_cmds);
+
+	st.offset = start;
+
+	while (!ret && left_cmds--)
+		ret = stream_command_checked(&st);
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+/*---------------------------------------------------------------*/
+/* image sources */
+
+/*
+ * imgx keeps a list of where the images it loaded since the kernel
+ * came from, so boot snapshots can tell when those images have been
+ * rebuilt. Nothing is read for it while loading. When a snapshot is
+ * saved or loaded, every image on storage is stamped again (see
+ * stamp_image_source): quickly from its TOC, command headers and
+ * length, or if asked for, by reading it back and hashing it whole.
+ *
+ * Images loaded from memory can't be read back later, so a boot
+ * with any of them can't be snapshotted. Images out of the ramdisk
+ * don't need to be, they are as current as the ramdisk itself.
+ */
+
+/*
+ * record_image_source
+ *
+ * Notes where an image imgx just loaded came from. 'location' is a
+ * path, or for images in memory just something to show.
+ */
+static void record_image_source(uint32_t kind, const char* ifname, const char* dev_part, const char* location)
+{
+	image_source_t* src;
+
+	/* Past the end only counts, image_sources reports it */
+	if (gImageSourceCount++ >= IMAGE_SOURCES_MAX)
+		return;
+
+	src = &gImageSources[gImageSourceCount - 1];
+
+	bzero((void*)src, sizeof(image_source_t));
+	src->kind = kind;
+
+	if (ifname)
+		strncpy(src->ifname, ifname, sizeof(src->ifname) - 1);
+	if (dev_part)
+		strncpy(src->dev_part, dev_part, sizeof(src->dev_part) - 1);
+
+	strncpy(src->path, location, sizeof(src->path) - 1);
+}
+
+/*
+ * image_sources
+ *
+ * Where the images imgx loaded since the kernel came from, in load
+ * order. The count can be more than IMAGE_SOURCES_MAX, in which case
+ * the list is incomplete.
+ */
+uint32_t image_sources(const image_source_t** sources)
+{
+	*sources = gImageSources;
+
+	return gImageSourceCount;
+}
+
+static void stamp_fold(uint32_t stamp[2], const void* buf, uint32_t len)
+{
+	uint32_t words[4];
+
+	words[0] = stamp[0];
+	words[1] = stamp[1];
+	image_hash((const uint8_t*)buf, len, &words[2]);
+
+	image_hash((const uint8_t*)words, sizeof(words), stamp);
+}
+
+/*
+ * Bytes of each command a quick stamp covers. Enough for the header
+ * with the name and sizes, and the start of the payload.
+ */
+#define STAMP_HEAD_SIZE 0x200
+
+/*
+ * stamp_image_source
+ *
+ * Hashes the image an image source on storage points at into
+ * 'stamp'. A quick stamp covers the TOC, the start of every command
+ * and where the last one ends, a rebuilt image nearly always changes
+ * one of those. With 'full' set every command is hashed with its
+ * whole payload. The image is read through a window in scratch.
+ */
+int stamp_image_source(const image_source_t* source, boolean_t full, uint32_t stamp[2])
+{
+	imgx_stream_t st;
+	table_of_contents_t toc;
+	command_t cmd;
+	memory_region_t mark;
+	uint32_t offset;
+	uint32_t ncmds;
+	uint32_t i;
+	int ret = 1;
+
+	if (source->kind != kImageSourceFile) {
+		printf(KERR "'%s' isn't on storage, it can't be checked\n", source->path);
+		return 1;
+	}
+
+	st.ifname = source->ifname;
+	st.dev_part = source->dev_part;
+	st.path = source->path;
+	st.offset = 0;
+
+	stamp[0] = 0;
+	stamp[1] = 0;
+
+	scratch_mark(&mark);
+
+	st.chunk = (uint8_t*)scratch_alloc(STREAM_CHUNK_SIZE, 64);
+	if (!st.chunk || stream_read(&st, &toc, sizeof(toc)))
+		goto out;
+
+	if (toc.magic == kTableOfContentsMagic) {
+		stamp_fold(stamp, &toc, sizeof(toc));
+		ncmds = toc.ncmds;
+		offset = sizeof(toc);
+	}
+	else {
+		ncmds = 1;
+		offset = 0;
+	}
+
+	for (i = 0; i < ncmds; i++) {
+		uint32_t stamp_size;
+		uint32_t done;
+
+		st.offset = offset;
+
+		if (stream_read(&st, &cmd, sizeof(cmd)))
+			goto out;
+
+		if (cmd.size < sizeof(command_t)) {
+			printf(KERR "load command at 0x%x is truncated\n", offset);
+			goto out;
 		}
 
-		if (ret) {
-			return ret;
+		st.offset = offset;
+		stamp_size = cmd.size;
+
+		if (!full && stamp_size > STAMP_HEAD_SIZE)
+			stamp_size = STAMP_HEAD_SIZE;
+
+		for (done = 0; done < stamp_size; ) {
+			uint32_t len = stamp_size - done;
+
+			if (len > STREAM_CHUNK_SIZE)
+				len = STREAM_CHUNK_SIZE;
+
+			if (stream_read(&st, st.chunk, len))
+				goto out;
+
+			stamp_fold(stamp, st.chunk, len);
+			done += len;
 		}
 
-		cmd = (command_t*)((uint32_t)cmd + (uint32_t)cmd->size);
+		offset += cmd.size;
 	}
 
-	return 0;
+	/* And where the last one ends, the length of the image */
+	stamp_fold(stamp, &offset, sizeof(offset));
+
+	ret = 0;
+
+out:
+	scratch_release(&mark);
+
+	return ret;
 }
 
-static int load_general_image(uint32_t image_address, uint32_t image_size)
-{
-	uint32_t* image_magic_ptr = (uint32_t*)image_address;
-	uint32_t image_magic = *image_magic_ptr;
-	char* cm = (char*)&image_magic;
+/*---------------------------------------------------------------*/
+/* ramdisk images */
 
-	printf(
-		KINF "image at 0x%08x, magic %c%c%c%c\n",
-		image_address,
-		cm[0],
-		cm[1],
-		cm[2],
-		cm[3]
-	);
+/*
+ * load_ramdisk_image
+ *
+ * Loads the image at 'path' in the ramdisk. A file in one piece is
+ * used where it is, one in pieces is put together in scratch first.
+ */
+static int load_ramdisk_image(const char* path)
+{
+	hfs_volume_t vol;
+	hfs_file_t file;
+	const uint8_t* image;
+	int ret;
 
-	if (image_magic == kCommandMachO) {
-		command_macho_t* cmd = (command_macho_t*)image_address;
-		return load_macho_from_command(cmd);
+	if (RANGE_IS_NULL(gRAMDiskRange)) {
+		printf(KERR "no ramdisk is loaded\n");
+		return 1;
 	}
-	else if (image_magic == kCommandXMLDeviceTree) {
-		command_t* cmd = (command_t*)image_address;
-		return parse_xdt_command(cmd);
+
+	if (hfs_open(&vol, (void*)gRAMDiskRange.base, gRAMDiskRange.size) ||
+		hfs_lookup(&vol, path, &file))
+	{
+		return 1;
 	}
-	else if (image_magic == kCommandJSDeviceTree) {
-		command_t* cmd = (command_t*)image_address;
-		return parse_jsdt_command(cmd);
+
+	if (file.size < sizeof(command_t)) {
+		printf(KERR "'%s' is too small to be an image (0x%x bytes)\n", path, file.size);
+		return 1;
 	}
-	else if (image_magic == kTableOfContentsMagic) {
-		table_of_contents_t* toc = (table_of_contents_t*)image_address;
-		return parse_table_of_contents(toc);
+
+	image = hfs_file_map(&vol, &file);
+
+	if (image) {
+		printf(KINF "'%s' is contiguous in the ramdisk, loading it in place\n", path);
 	}
 	else {
-		printf(KERR "unknown image type (hex: 0x%08X)\n", image_magic);
-		return 1;
+		uint8_t* copy = (uint8_t*)scratch_alloc(align_up(file.size, 0x1000), 0x1000);
+
+		if (!copy || hfs_file_read(&vol, &file, copy))
+			return 1;
+
+		image = copy;
 	}
+
+	gLoadingFromRamdisk = TRUE;
+
+	ret = load_general_image((uint32_t)image, file.size);
+
+	gLoadingFromRamdisk = FALSE;
+
+	return ret;
 }
 
 /*---------------------------------------------------------------*/
@@ -610,10 +3534,57 @@ static int load_general_image(uint32_t image_address, uint32_t image_size)
 static int do_imgx(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 {
 	unsigned long addr;
+	memory_region_t mark;
+	char where[16];
+	int ret;
+
+	gSelectMode = kSelectAll;
+	gSelectList = NULL;
+
+	if (argc >= 3 &&
+		(strcmp(argv[1], "only") == 0 || strcmp(argv[1], "skip") == 0))
+	{
+		gSelectMode = (argv[1][0] == 'o') ? kSelectOnly : kSelectSkip;
+		gSelectList = argv[2];
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	/*
+	 * The cache goes first so it sits above all scratch, and all
+	 * scratch is gone by the time this returns.
+	 */
+	image_cache_prepare();
+	scratch_mark(&mark);
+
+	/* 'fs load' or 'tftp' may have put the image over cached copies */
+	if (last_fileaddr() && last_filesize())
+		image_cache_invalidate(last_fileaddr(), last_filesize());
+
+	if (argc == 3 && strcmp(argv[1], "rd") == 0) {
+		/* out of the ramdisk */
+		ret = load_ramdisk_image(argv[2]);
+		image_cache_report();
+
+		if (!ret)
+			record_image_source(kImageSourceRamdisk, NULL, NULL, argv[2]);
+		goto out;
+	}
+
+	if (argc == 4) {
+		/* stream straight from storage */
+		ret = load_streamed_image(argv[1], argv[2], argv[3]);
+
+		if (!ret)
+			record_image_source(kImageSourceFile, argv[1], argv[2], argv[3]);
+		goto out;
+	}
 
 	if (argc != 2) {
 		printf(KERR "wrong number of arguments (got %d)\n", argc);
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	if (strcmp(argv[1], "last") == 0 ||
@@ -624,7 +3595,8 @@ static int do_imgx(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 
 		if (!addr) {
 			printf(KERR "last address is NULL\n");
-			return 1;
+			ret = 1;
+			goto out;
 		}
 	}
 	else
@@ -633,11 +3605,35 @@ static int do_imgx(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 		addr = simple_strtoul(argv[1], NULL, 16);
 	}
 
-	return load_general_image((uint32_t)addr, 0);
+	ret = load_general_image((uint32_t)addr, 0);
+
+	image_cache_report();
+
+	if (!ret) {
+		sprintf(where, "0x%08x", (uint32_t)addr);
+		record_image_source(kImageSourceMemory, NULL, NULL, where);
+	}
+
+out:
+	scratch_release(&mark);
+	gSelectMode = kSelectAll;
+
+	return ret;
 }
 
 static char imgx_help_text[] =
-	"\t  imgx - can load either a TOC, MachO command or a an XML DT command.\n";
+	"\t  imgx - can load either a TOC, MachO command, ramdisk or a an XML DT command.\n"
+	"\t  imgx <addr|last> - load an image already in memory\n"
+	"\t  imgx <interface> <dev[:part]> <path> - stream an image from storage,\n"
+	"\t      decompressing LZSS commands and ramdisks as they are read (needs\n"
+	"\t      a filesystem that supports offset reads, such as FAT); the command\n"
+	"\t      headers are read first to check the whole image fits\n"
+	"\t  imgx rd <path> - load an image from the HFS+ ramdisk already loaded\n"
+	"\t      with rdx, in place if the file is contiguous (not the kernel)\n"
+	"\t  imgx only <name[,name...]> ... - load only the listed drivers\n"
+	"\t  imgx skip <name[,name...]> ... - load all drivers but the listed ones\n"
+	"\t  With 'imgx_prune' set to 1, drivers outside the OSBundleRequired closure\n"
+	"\t      are dropped, except from streamed images\n";
 
 U_BOOT_CMD(
 	imgx,	CONFIG_SYS_MAXARGS,	1,	do_imgx,
@@ -646,11 +3642,142 @@ U_BOOT_CMD(
 
 /*---------------------------------------------------------------*/
 
+/*
+ * read_over_kernel
+ *
+ * Whether a ramdisk was read over kernel memory something is
+ * already loaded in, which it can't be moved out of in time.
+ */
+static boolean_t read_over_kernel(uint32_t addr, uint32_t size)
+{
+	uint32_t top = gKernelMemoryTop;
+
+	if (addr < top && addr + size > gKernelMemoryRange.base) {
+		printf(KERR "ramdisk at 0x%08x was read over loaded kernel memory (0x%08x-0x%08x)\n",
+			addr,
+			gKernelMemoryRange.base,
+			top);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * adopt_ramdisk
+ *
+ * Makes the ramdisk at 'addr' part of kernel memory. A page aligned
+ * ramdisk that lies entirely in free memory above the kernel memory
+ * top is used where it is, the memory skipped to get to it just
+ * becomes part of kernel memory. Anything else is moved down to the
+ * kernel memory top with one copy.
+ */
+static int adopt_ramdisk(uint32_t addr, uint32_t size)
+{
+	uint32_t top = gKernelMemoryTop;
+	uint32_t floor = memory_high_floor();
+
+	if (read_over_kernel(addr, size))
+		return 1;
+
+	if (addr >= top && !(addr & 0xfff) && addr + size <= floor && addr + size > addr) {
+		if (addr != top) {
+			printf(KINF "adopting ramdisk at 0x%08x (0x%x bytes of kernel memory skipped)\n",
+				addr,
+				addr - top);
+
+			gKernelMemoryTop = addr;
+		}
+
+		return 0;
+	}
+
+	if (top + size > floor) {
+		printf(KERR "ramdisk does not fit below 0x%08x (0x%x bytes at 0x%08x)\n",
+			floor,
+			size,
+			top);
+		return 1;
+	}
+
+	printf(KPROC(RDSK) "relocating ramdisk 0x%08x => 0x%08x (0x%x bytes) ...\n",
+		addr,
+		top,
+		size);
+
+	/* The ranges can overlap, which bcopy doesn't cope with */
+	memmove((void*)top, (void*)addr, size);
+
+	/* It might have been read over anything in high memory */
+	if (addr + size > floor)
+		image_cache_invalidate(addr, size);
+
+	return 0;
+}
+
+/*
+ * expand_sparse_ramdisk
+ *
+ * Expands a sparse image loaded at 'addr' to the kernel memory top.
+ * If the image is in the way of its own expansion it is moved to
+ * high memory scratch first.
+ */
+static int expand_sparse_ramdisk(uint32_t addr, uint32_t size, uint32_t* out_size)
+{
+	sparse_image_t* img = (sparse_image_t*)addr;
+	uint32_t top = gKernelMemoryTop;
+	memory_region_t mark;
+	int ret = 0;
+
+	if (read_over_kernel(addr, size) || !sparse_image_check(img, size))
+		return 1;
+
+	if (top > memory_high_floor() || img->image_size > memory_high_floor() - top) {
+		printf(KERR "ramdisk does not fit below 0x%08x (0x%x bytes at 0x%08x)\n",
+			memory_high_floor(),
+			img->image_size,
+			top);
+		return 1;
+	}
+
+	image_cache_prepare();
+	scratch_mark(&mark);
+
+	if (addr < top + img->image_size && addr + size > top) {
+		uint8_t* scratch;
+
+		scratch_claim_kernel_memory(top + img->image_size);
+		scratch = (uint8_t*)scratch_alloc(align_up(size, 0x1000), 0x1000);
+		scratch_claim_kernel_memory(0);
+
+		if (!scratch) {
+			printf(KERR "no room to move the sparse ramdisk out of the way\n");
+			ret = 1;
+			goto out;
+		}
+
+		bcopy((void*)addr, (void*)scratch, size);
+		img = (sparse_image_t*)scratch;
+	}
+
+	printf(KPROC(RDSK) "expanding sparse ramdisk 0x%08x => 0x%08x ...\n",
+		(uint32_t)img,
+		top);
+
+	sparse_image_expand(img, (uint8_t*)top);
+
+	*out_size = img->image_size;
+
+out:
+	scratch_release(&mark);
+
+	return ret;
+}
+
 static int do_rdx(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 {
 	uint32_t addr;
 	uint32_t size;
-	struct HFSPlusVolumeHeader* hdr;
 
 	addr = last_fileaddr();
 	size = last_filesize();
@@ -664,43 +3791,41 @@ static int do_rdx(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 		return 1;
 	}
 
-	/* uhhh, uboot */
-	if (addr != gKernelMemoryTop) {
-		printf(KERR "ramdisk loaded at the wrong address (use KernelMemoryTop env var)\n");
-		printf(KERR "  (0x%08x instead of 0x%08x)\n", addr, gKernelMemoryTop);
+	if (!assert_kernel_load())
 		return 1;
-	}
 
-	/* validate the ramdisk */
-	if (size < (1024 + sizeof(struct HFSPlusVolumeHeader))) {
-		printf(KERR "loaded ramdisk too small to be valid HFS+ dmg (0x%08x bytes)\n", size);
+	if (!RANGE_IS_NULL(gRAMDiskRange)) {
+		printf(KERR "a ramdisk is already loaded\n");
 		return 1;
 	}
 
-	hdr = (struct HFSPlusVolumeHeader*)(addr+1024);
+	if (size >= sizeof(uint32_t) && *(uint32_t*)addr == kSparseImageMagic) {
+		if (expand_sparse_ramdisk(addr, size, &size))
+			return 1;
 
-	if (OSSwapInt16(hdr->signature) != kHFSPlusSigWord &&
-		OSSwapInt16(hdr->signature) != kHFSSigWord) {
-		printf(KERR "bad HFS+ signature (got 0x%08x wanted 'H+' or 'HX')\n", (uint32_t)OSSwapInt16(hdr->signature));
-		return 1;
+		if (!check_ramdisk(gKernelMemoryTop, size))
+			return 1;
 	}
+	else {
+		/* validate the ramdisk where it is, before moving anything */
+		if (!check_ramdisk(addr, size))
+			return 1;
 
-	gRAMDiskRange.base = addr;
-	gRAMDiskRange.size = size;
-
-	increment_kernel_memory(size);
+		if (adopt_ramdisk(addr, size))
+			return 1;
+	}
 
-	printf(KDONE "loaded dmg [0x%08x-0x%08x, %u files, %u dirs]\n",
-		addr,
-		addr+size,
-		OSSwapInt32(hdr->fileCount),
-		OSSwapInt32(hdr->folderCount));
+	register_ramdisk(gKernelMemoryTop, size);
+	record_image_source(kImageSourceMemory, NULL, NULL, "rdx");
 
 	return 0;
 }
 
 static char rdx_help_text[] =
-	"\t  rdx - call after ramdisk load to add it to kernel memory\n";
+	"\t  rdx - call after ramdisk load to add it to kernel memory. The ramdisk\n"
+	"\t      is used in place if it is page aligned and above KernelMemoryTop,\n"
+	"\t      otherwise it is moved to KernelMemoryTop. Sparse images (see\n"
+	"\t      tools/mksparse.c) are expanded to KernelMemoryTop\n";
 
 U_BOOT_CMD(
 	rdx,	CONFIG_SYS_MAXARGS,	1,	do_rdx,
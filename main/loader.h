@@ -2,20 +2,27 @@
 #ifndef _LOADER_H
 #define _LOADER_H
 
+#include "scratch.h"
+
 #define NAME_LEN 64
 
 typedef struct _loaded_driver_image_t {
-	memory_range_t range;
+	memory_range_t range; /* DriverInfo followed by the image */
+	uint32_t image_base;
 	uint32_t info_offset;
-	struct _loaded_driver_image_t* next;
 	boolean_t has_exec;
 	char name[NAME_LEN];
 } loaded_driver_image_t;
 
+/* Most drivers a single load can have */
+#define DRIVER_REGISTRY_MAX 1024
+
 #define DRIVER_PAD_START 256
 
+/* Room for DriverInfo and the bundle name when packing drivers */
+#define DRIVER_PACKED_PAD 96
+
 /* All of these are physical */
-extern loaded_driver_image_t* gLoadedDriverImages;
 extern memory_range_t gKernelMemoryRange;
 extern memory_range_t gRAMDiskRange;
 extern uint32_t gKernelEntryPoint; 
@@ -26,6 +33,49 @@ extern uint32_t gKernelPhysicalBase;
 
 extern boolean_t gHasDeviceTree;
 
+/* Device tree command the current tree was parsed from, if kept */
+extern const void* device_tree_source(uint32_t* size);
+extern int load_device_tree_source(const void* cmd, uint32_t size);
+
+/* Where the images imgx loaded since the kernel came from */
+enum {
+	kImageSourceFile = 1, /* imgx <interface> <dev[:part]> <path> */
+	kImageSourceRamdisk,  /* imgx rd <path> */
+	kImageSourceMemory    /* imgx <addr|last>, rdx */
+};
+
+typedef struct {
+	uint32_t kind;
+	char ifname[16];
+	char dev_part[16];
+	char path[128];
+} image_source_t;
+
+#define IMAGE_SOURCES_MAX 16
+
+extern uint32_t image_sources(const image_source_t** sources);
+extern int stamp_image_source(const image_source_t* source, boolean_t full, uint32_t stamp[2]);
+
+/* Takes over kernel memory laid out by a previous boot */
+extern void adopt_kernel_memory(uint32_t top);
+
+/* Loaded drivers, in load order */
+extern uint32_t gLoadedDriverCount;
+extern loaded_driver_image_t* driver_registry_add(const char* name);
+extern loaded_driver_image_t* driver_registry_find(const char* name);
+extern loaded_driver_image_t* loaded_driver_image(uint32_t index);
+extern void driver_registry_truncate(uint32_t count);
 extern void teardown_loaded_driver_images(void);
 
+/* High memory (top of DRAM, grows down) */
+extern memory_region_t* memory_high_region(void);
+extern uint32_t memory_high_floor(void);
+
+/* Kept across soft resets, above the high region (see warm_boot.c) */
+#define WARM_BOOT_AREA_SIZE 0x400000
+extern uint32_t memory_warm_area(void);
+
+/* Loader scratch, see scratch.h */
+extern void scratch_claim_kernel_memory(uint32_t top);
+
 #endif
\ No newline at end of file
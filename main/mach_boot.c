@@ -18,6 +18,10 @@
 #include "boot_args.h"
 
 #include "loader.h"
+#include "warm_boot.h"
+#include "mkext.h"
+
+#include "../mach-o/macho_ext.h"
 
 /* Driver info for IOKit */
 struct DriverInfo {
@@ -200,8 +204,9 @@ static boolean_t map_booter_extension(Node* memory_map, loaded_driver_image_t* i
 	 * We have a pad region in front of every driver image, but
 	 * let's check that we have enough, because of paranoia.
 	 */
-	if ((sizeof(*driver)+NAME_LEN) > DRIVER_PAD_START) {
-		printf(KERR "DRIVER_PAD_START is too small. please fix this.\n");
+	if ((sizeof(*driver)+NAME_LEN) > (image->image_base - image->range.base)) {
+		printf(KERR "driver pad is too small (0x%x). please fix this.\n",
+			image->image_base - image->range.base);
 		return false;
 	}
 
@@ -220,8 +225,8 @@ static boolean_t map_booter_extension(Node* memory_map, loaded_driver_image_t* i
 
 	/* Skip the padding at the front of the image */
 
-	actual_base = image->range.base + DRIVER_PAD_START;
-	actual_size = image->range.size - DRIVER_PAD_START;
+	actual_base = image->image_base;
+	actual_size = image->range.size - (image->image_base - image->range.base);
 
 	/* Driver info passed to XNU */
 
@@ -276,30 +281,50 @@ static boolean_t map_booter_extension(Node* memory_map, loaded_driver_image_t* i
 	return true;
 }
 
-boolean_t map_add_drivers(Node* memory_map)
+static boolean_t map_mkext(Node* memory_map)
 {
+	memory_range_t range;
+
+	if (!build_mkext(kernel_mem, &range)) {
+		return false;
+	}
+
+	/* Published as 'DriversPackage-<addr>' */
+	return
+	enter_memory_range(memory_map,
+					 "DriversPackage",
+					 range.base,
+					 kBootDriverTypeMKEXT,
+					 &range);
+}
 
-	loaded_driver_image_t* next;
-	unsigned int driver_cnt = 0;
+boolean_t map_add_drivers(Node* memory_map)
+{
+	uint32_t i;
 
-	next = gLoadedDriverImages;
-	if (!next) {
+	if (!gLoadedDriverCount) {
 		printf(KINF "no kexts are loaded\n");
 		return true;
 	}
 
-	do {
-		loaded_driver_image_t* this = next;
-
-		if (!map_booter_extension(memory_map, this)) {
+	if (mkext_enabled()) {
+		if (!map_mkext(memory_map)) {
 			return false;
 		}
 
-		driver_cnt += 1;
-		next = this->next;
-	} while(next != NULL);
+		printf(KINF "%u kext(s) loaded as an mkext\n", gLoadedDriverCount);
+		teardown_loaded_driver_images();
+
+		return true;
+	}
+
+	for (i = 0; i < gLoadedDriverCount; i++) {
+		if (!map_booter_extension(memory_map, loaded_driver_image(i))) {
+			return false;
+		}
+	}
 
-	printf(KINF "%u kext(s) loaded\n", driver_cnt);
+	printf(KINF "%u kext(s) loaded\n", gLoadedDriverCount);
 
 	/* Free the loaded driver list */
 	teardown_loaded_driver_images();
@@ -398,6 +423,9 @@ static int mach_boot(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 		return 1;
 	}
 
+	if (warm_boot_enabled())
+		warm_boot_save();
+
 	/*---------------------------------------------------------------*/
 
 	printf(KINF "kmem start=0x%08x size=0x%08x\n",
@@ -477,6 +505,10 @@ static int mach_boot(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
 	args->dt_size = r_device_tree.size;
 	
 	args->mem_size = (total_memory_size());
+
+	/* The warm area has to outlive the kernel, keep it out of its reach */
+	if (warm_boot_enabled())
+		args->mem_size = memory_warm_area() - KERNEL_PHYS;
 	args->data_end = (kernel_mem->pos);
 
 	/*---------------------------------------------------------------*/
@@ -503,9 +535,132 @@ out_err:
 }
 
 static char darwin_help_text[] =
-	"\t  mach_boot - Takes no arguments. Memory ranges have to be populated prior.\n";
+	"\t  mach_boot - Takes no arguments. Memory ranges have to be populated prior.\n"
+	"\t      With mach_mkext=1, drivers are handed over as one mkext archive.\n";
 
 U_BOOT_CMD(
 	mach_boot,	CONFIG_SYS_MAXARGS,	1,	mach_boot,
 	"boot previously loaded mach kernel", darwin_help_text
-);
\ No newline at end of file
+);
+
+/*
+ * mach_warm
+ *
+ * Takes over the kernel the previous mach_boot left in RAM (see
+ * warm_boot.c), and boots it right away if asked to.
+ */
+static int mach_warm(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
+{
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "boot") != 0)) {
+		printf(KERR "unknown mach_warm argument or wrong number of arguments\n");
+		return 1;
+	}
+
+	if (warm_boot_restore()) {
+		printf(KERR "warm boot failed - load the images again and use mach_boot\n");
+		return 1;
+	}
+
+	if (argc == 1) {
+		printf(KINF "load the drivers and ramdisk again, then use mach_boot\n");
+		return 0;
+	}
+
+	return mach_boot(cmdtp, flag, 1, argv);
+}
+
+static char warm_help_text[] =
+	"\t  mach_warm [boot] - Takes over the kernel the last mach_boot left in RAM if it is\n"
+	"\t              intact. Needs warm_boot=1 when it was booted. Only the kernel is kept:\n"
+	"\t              XNU frees the driver ranges and writes to the ramdisk, so drivers and\n"
+	"\t              the ramdisk have to be loaded again before mach_boot. With 'boot', the\n"
+	"\t              kernel is booted right away, without drivers or a ramdisk.\n";
+
+U_BOOT_CMD(
+	mach_warm,	CONFIG_SYS_MAXARGS,	1,	mach_warm,
+	"take over the mach kernel left in RAM by the last boot", warm_help_text
+);
+
+/*
+ * mach_sym
+ *
+ * Names the kernel symbols addresses fall in, for making sense of a
+ * boot that died. Addresses can be kernel virtual or physical ones
+ * in the loaded kernel. Exported symbol names get their addresses.
+ */
+static int mach_sym(cmd_tbl_t *cmdtp, int flag, int argc, char * const argv[])
+{
+	mach_loader_context_t ctx;
+	loader_return_t ret;
+	int i;
+
+	if (argc < 2) {
+		printf(KERR "wrong number of arguments (got %d)\n", argc);
+		return 1;
+	}
+
+	if (RANGE_IS_NULL(gKernelMemoryRange)) {
+		printf(KWARN "a kernel image has to be loaded first\n");
+		return 1;
+	}
+
+	ret = mach_file_init_mapped(&ctx,
+		(uint8_t*)gKernelMemoryRange.base,
+		ptokv(gKernelMemoryRange.base));
+
+	if (ret != LOADER_SUCCESS) {
+		printf(KERR "loaded kernel has no usable symbol table (%d)\n", ret);
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		uint32_t addr;
+		const char* name;
+		uint32_t offset;
+
+		if (argv[i][0] == '_') {
+			/* A symbol name, the other way around */
+			ret = mach_file_find_symbol(&ctx, argv[i], &addr);
+
+			if (ret == LOADER_SUCCESS)
+				printf("%s 0x%08x\n", argv[i], addr);
+			else
+				printf("%s ?\n", argv[i]);
+
+			continue;
+		}
+
+		addr = simple_strtoul(argv[i], NULL, 16);
+
+		if (addr >= gKernelMemoryRange.base &&
+			addr - gKernelMemoryRange.base < gKernelMemoryRange.size)
+		{
+			addr = ptokv(addr);
+		}
+
+		ret = mach_file_symbol_for_address(&ctx, addr, &name, &offset);
+
+		if (ret == LOADER_SUCCESS)
+			printf("0x%08x %s+0x%x\n", addr, name, offset);
+		else if (ret == LOADER_SYMBOL_NOT_FOUND)
+			printf("0x%08x ?\n", addr);
+		else {
+			printf(KERR "unable to index kernel symbols (%d)\n", ret);
+			break;
+		}
+	}
+
+	mach_file_destroy(&ctx);
+
+	return (i == argc) ? 0 : 1;
+}
+
+static char sym_help_text[] =
+	"\t  mach_sym <addr|_symbol>... - Prints the kernel symbol each address is in,\n"
+	"\t              or the address of each exported symbol. Addresses are hex,\n"
+	"\t              kernel virtual or physical in the loaded kernel.\n";
+
+U_BOOT_CMD(
+	mach_sym,	CONFIG_SYS_MAXARGS,	1,	mach_sym,
+	"look up kernel symbols by address or name", sym_help_text
+);
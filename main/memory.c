@@ -2,6 +2,8 @@
 #include <bootkit/runtime.h>
 #include <asm/global_data.h>
 
+#include "loader.h"
+
 DECLARE_GLOBAL_DATA_PTR;
 
 void memory_region_restore(memory_region_t* dest, memory_region_t* src)
@@ -49,6 +51,120 @@ void* memory_reserve(memory_region_t* region, uint32_t size, uint32_t align_boun
 	return (void*)start;
 }
 
+/*
+ * Headroom left below uBoot's stack. Everything above this is uBoot's
+ * own (relocated image, malloc arena, gd/bd, stack).
+ */
+#define HIGH_MEMORY_STACK_HEADROOM 0x100000
+
+static memory_region_t __high_mem_store;
+static memory_region_t* high_mem = NULL;
+
+/*
+ * memory_warm_area
+ *
+ * WARM_BOOT_AREA_SIZE bytes right at the top of usable DRAM, above
+ * the high region. It is at the same place on every boot of the same
+ * uBoot, so it can pass state (see warm_boot.c) across a soft reset.
+ */
+uint32_t memory_warm_area(void)
+{
+	uintptr_t top = gd->start_addr_sp - HIGH_MEMORY_STACK_HEADROOM;
+
+	return (uint32_t)align_down(top, 0x100000) - WARM_BOOT_AREA_SIZE;
+}
+
+/*
+ * memory_high_region
+ *
+ * Region growing down from the top of usable DRAM, for loader
+ * bookkeeping that has to stay clear of kernel memory growing up
+ * from the bottom.
+ */
+memory_region_t* memory_high_region(void)
+{
+	if (!high_mem) {
+		high_mem = &__high_mem_store;
+		high_mem->base = memory_warm_area();
+		high_mem->pos = high_mem->base;
+		high_mem->down = true;
+	}
+
+	return high_mem;
+}
+
+/*
+ * memory_high_floor
+ *
+ * Lowest address currently reserved from the high region. Kernel
+ * memory must stay below this.
+ */
+uint32_t memory_high_floor(void)
+{
+	return (uint32_t)memory_high_region()->pos;
+}
+
+/*
+ * Scratch arena.
+ *
+ * Loader temporaries (decompressor state, read windows, parser tokens,
+ * plans) are bump allocated from the high region instead of the heap,
+ * so a big image can't fragment the heap into not booting. Nothing is
+ * freed on its own, scratch is released in one go by restoring a mark
+ * taken with scratch_mark, and at the latest at the end of each imgx.
+ *
+ * Scratch has to stay clear of kernel memory, both what is already
+ * loaded and what a load plan has claimed.
+ */
+
+static uint32_t scratch_claimed_top = 0;
+
+/*
+ * scratch_claim_kernel_memory
+ *
+ * Keeps scratch above 'top' while kernel memory is growing towards
+ * it, zero drops the claim.
+ */
+void scratch_claim_kernel_memory(uint32_t top)
+{
+	scratch_claimed_top = top;
+}
+
+void* scratch_alloc(uint32_t size, uint32_t align_boundary)
+{
+	memory_region_t* high = memory_high_region();
+	uint32_t limit = gKernelMemoryTop;
+	uint32_t start;
+
+	if (scratch_claimed_top > limit)
+		limit = scratch_claimed_top;
+
+	if (!align_boundary)
+		align_boundary = 8;
+
+	start = align_down((uint32_t)high->pos - size, align_boundary);
+
+	if (size > (uint32_t)high->pos || start < limit) {
+		printf(KERR "out of scratch (0x%x bytes wanted, 0x%x free above 0x%08x)\n",
+			size,
+			((uint32_t)high->pos > limit) ? (uint32_t)high->pos - limit : 0,
+			limit);
+		return NULL;
+	}
+
+	return memory_reserve(high, size, align_boundary);
+}
+
+void scratch_mark(memory_region_t* mark)
+{
+	memory_region_save(memory_high_region(), mark);
+}
+
+void scratch_release(memory_region_t* mark)
+{
+	memory_region_restore(memory_high_region(), mark);
+}
+
 uint32_t get_memory_base(void)
 {
 	return 0x20000000;
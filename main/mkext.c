@@ -0,0 +1,429 @@
+/*
+ * mkext.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * With 'mach_mkext' set to 1, mach_boot hands the kernel every loaded
+ * driver in one mkext (version 2) archive, published as a single
+ * 'DriversPackage' memory map range, instead of a DriverInfo and a
+ * range for each driver.
+ *
+ * The archive is an mkext2_header, the executables (stored, not
+ * compressed) and an XML plist listing each driver's Info.plist
+ * dictionary with two keys added: the bundle path, and the offset of
+ * the executable in the archive. Everything in the headers is big
+ * endian, as in libkern/mkext.h.
+ *
+ * The archive is put together in scratch and then takes the place of
+ * the driver images it was made from, which nothing needs after that,
+ * if they are all together. Otherwise it goes at the end of kernel
+ * memory.
+ */
+
+#include <bootkit/runtime.h>
+
+#include "loader.h"
+#include "mkext.h"
+
+#define MKEXT_MAGIC 0x4D4B5854 /* 'MKXT' */
+#define MKEXT_SIGN 0x4D4F5358  /* 'MOSX' */
+#define MKEXT_VERS_2 0x02002001
+
+#define MKEXT_CPU_TYPE_ARM 12
+#define MKEXT_CPU_SUBTYPE_ARM_ALL 0
+
+#define kMKEXTInfoDictionariesKey "_MKEXTInfoDictionaries"
+#define kMKEXTBundlePathKey "_MKEXTBundlePath"
+#define kMKEXTExecutableKey "_MKEXTExecutable"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t signature;
+	uint32_t length;
+	uint32_t adler32; /* of everything from 'version' on */
+	uint32_t version;
+	uint32_t numkexts;
+	uint32_t cputype;
+	uint32_t cpusubtype;
+
+	uint32_t plist_offset;
+	uint32_t plist_compressed_size; /* zero, stored */
+	uint32_t plist_full_size;
+} mkext2_header_t;
+
+typedef struct {
+	uint32_t compressed_size; /* zero, stored */
+	uint32_t full_size;
+
+	/* ... executable ... */
+} mkext2_file_entry_t;
+
+#define be32(x) OSSwapInt32(x)
+
+boolean_t mkext_enabled(void)
+{
+	char* en = getenv("mach_mkext");
+
+	return (en && en[0] == '1');
+}
+
+/*---------------------------------------------------------------*/
+
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+static uint32_t mkext_adler32(const uint8_t* buf, uint32_t len)
+{
+	uint32_t s1 = 1;
+	uint32_t s2 = 0;
+
+	while (len) {
+		uint32_t k = (len < ADLER_NMAX) ? len : ADLER_NMAX;
+
+		len -= k;
+
+		while (k--) {
+			s1 += *buf++;
+			s2 += s1;
+		}
+
+		s1 %= ADLER_BASE;
+		s2 %= ADLER_BASE;
+	}
+
+	return (s2 << 16) | s1;
+}
+
+/*---------------------------------------------------------------*/
+/* plist */
+
+/*
+ * The plist is emitted twice, once with no buffer to size it and
+ * once into the archive.
+ */
+typedef struct {
+	char* buf;
+	uint32_t len;
+} plist_out_t;
+
+static void emit(plist_out_t* out, const char* str, uint32_t len)
+{
+	if (out->buf)
+		bcopy((void*)str, (void*)(out->buf + out->len), len);
+
+	out->len += len;
+}
+
+static void emit_str(plist_out_t* out, const char* str)
+{
+	emit(out, str, strlen(str));
+}
+
+/*
+ * emit_escaped
+ *
+ * Emits a string as XML character data.
+ */
+static void emit_escaped(plist_out_t* out, const char* str)
+{
+	for (; *str; str++) {
+		if (*str == '&')
+			emit_str(out, "&amp;");
+		else if (*str == '<')
+			emit_str(out, "&lt;");
+		else if (*str == '>')
+			emit_str(out, "&gt;");
+		else
+			emit(out, str, 1);
+	}
+}
+
+static const char* find_str(const char* buf, uint32_t len, const char* str)
+{
+	uint32_t n = strlen(str);
+	uint32_t i;
+
+	for (i = 0; i + n <= len; i++) {
+		if (memcmp(buf + i, str, n) == 0)
+			return buf + i;
+	}
+
+	return NULL;
+}
+
+static const char* find_last_str(const char* buf, uint32_t len, const char* str)
+{
+	uint32_t n = strlen(str);
+	uint32_t i;
+
+	for (i = len; i >= n; i--) {
+		if (memcmp(buf + i - n, str, n) == 0)
+			return buf + i - n;
+	}
+
+	return NULL;
+}
+
+/*
+ * info_dict_body
+ *
+ * Finds what is between the <dict> and </dict> of a driver's
+ * Info.plist, so it can be emitted into the archive's plist.
+ */
+static boolean_t info_dict_body(loaded_driver_image_t* image, const char** body, uint32_t* body_len)
+{
+	const char* plist = (const char*)(image->image_base + image->info_offset);
+	uint32_t len = image->range.size - (image->image_base - image->range.base) - image->info_offset;
+	const char* start;
+	const char* end;
+
+	start = find_str(plist, len, "<dict>");
+	end = find_last_str(plist, len, "</dict>");
+
+	if (!start || !end || end < start + 6) {
+		printf(KERR "%s has no Info.plist dictionary\n", (const char*)&image->name);
+		return false;
+	}
+
+	*body = start + 6;
+	*body_len = end - *body;
+
+	return true;
+}
+
+/*
+ * emit_plist
+ *
+ * Emits the archive's plist. 'offsets' has the archive offset of
+ * each driver's executable, zero for none.
+ */
+static boolean_t emit_plist(plist_out_t* out, uint32_t* offsets)
+{
+	char num[16];
+	uint32_t i;
+
+	emit_str(out, "<plist version=\"1.0\">\n<dict>\n<key>" kMKEXTInfoDictionariesKey "</key>\n<array>\n");
+
+	for (i = 0; i < gLoadedDriverCount; i++) {
+		loaded_driver_image_t* image = loaded_driver_image(i);
+		const char* body;
+		uint32_t body_len;
+
+		if (!info_dict_body(image, &body, &body_len))
+			return false;
+
+		emit_str(out, "<dict>");
+		emit(out, body, body_len);
+
+		emit_str(out, "<key>" kMKEXTBundlePathKey "</key><string>");
+		emit_escaped(out, (const char*)&image->name);
+		emit_str(out, "</string>\n");
+
+		if (offsets[i]) {
+			sprintf(num, "%u", offsets[i]);
+
+			emit_str(out, "<key>" kMKEXTExecutableKey "</key><integer size=\"32\">");
+			emit_str(out, num);
+			emit_str(out, "</integer>\n");
+		}
+
+		emit_str(out, "</dict>\n");
+	}
+
+	emit_str(out, "</array>\n</dict>\n</plist>\n");
+
+	/* OSUnserializeXML wants it terminated */
+	emit(out, "", 1);
+
+	return true;
+}
+
+/*---------------------------------------------------------------*/
+
+static uint32_t executable_size(loaded_driver_image_t* image)
+{
+	return image->has_exec ? image->info_offset : 0;
+}
+
+/*
+ * driver_area
+ *
+ * The range the loaded drivers take, if there is nothing else in it
+ * the archive could overwrite.
+ */
+static boolean_t driver_area(memory_range_t* area)
+{
+	uint32_t lo = 0xFFFFFFFF;
+	uint32_t hi = 0;
+	uint32_t i;
+
+	for (i = 0; i < gLoadedDriverCount; i++) {
+		loaded_driver_image_t* image = loaded_driver_image(i);
+
+		if (image->range.base < lo)
+			lo = image->range.base;
+		if (image->range.base + image->range.size > hi)
+			hi = image->range.base + image->range.size;
+	}
+
+	if (hi <= lo)
+		return false;
+
+	if (!RANGE_IS_NULL(gRAMDiskRange) &&
+		gRAMDiskRange.base < hi &&
+		gRAMDiskRange.base + gRAMDiskRange.size > lo)
+	{
+		return false;
+	}
+
+	if (gKernelMemoryRange.base < hi &&
+		gKernelMemoryRange.base + gKernelMemoryRange.size > lo)
+	{
+		return false;
+	}
+
+	area->base = lo;
+	area->size = hi - lo;
+
+	return true;
+}
+
+/*
+ * build_mkext
+ *
+ * Packs every loaded driver into an mkext archive, in place of the
+ * drivers or reserved from 'mem'. 'range' gets where it ended up.
+ */
+boolean_t build_mkext(memory_region_t* mem, memory_range_t* range)
+{
+	mkext2_header_t* hdr;
+	plist_out_t out;
+	memory_region_t mark;
+	memory_range_t area;
+	uint32_t* offsets;
+	uint32_t offset;
+	uint32_t length;
+	uint8_t* archive;
+	uint8_t* dest;
+	boolean_t in_place;
+	uint32_t i;
+
+	/* Everything here is scratch, released on the way out */
+	scratch_mark(&mark);
+
+	offsets = (uint32_t*)scratch_alloc(sizeof(uint32_t) * (gLoadedDriverCount + 1), 0);
+	if (!offsets) {
+		scratch_release(&mark);
+		return false;
+	}
+
+	/* Lay out the executables */
+	offset = sizeof(mkext2_header_t);
+
+	for (i = 0; i < gLoadedDriverCount; i++) {
+		loaded_driver_image_t* image = loaded_driver_image(i);
+
+		if (image->has_exec && !image->info_offset) {
+			printf(KERR "driver %s has no Info.plist\n", (const char*)&image->name);
+			scratch_release(&mark);
+			return false;
+		}
+
+		if (!image->has_exec) {
+			offsets[i] = 0;
+			continue;
+		}
+
+		offset = align_up(offset, 8);
+		offsets[i] = offset;
+		offset += sizeof(mkext2_file_entry_t) + executable_size(image);
+	}
+
+	/* Size the plist */
+	out.buf = NULL;
+	out.len = 0;
+
+	if (!emit_plist(&out, offsets)) {
+		scratch_release(&mark);
+		return false;
+	}
+
+	length = offset + out.len;
+
+	archive = (uint8_t*)scratch_alloc(length, 64);
+	if (!archive) {
+		scratch_release(&mark);
+		return false;
+	}
+
+	hdr = (mkext2_header_t*)archive;
+
+	/* Alignment padding is checksummed too */
+	bzero((void*)archive, offset);
+
+	printf(KPROC(KEXT) "packing %u kext(s) into mkext (0x%x bytes) ...\n",
+		gLoadedDriverCount,
+		length);
+
+	for (i = 0; i < gLoadedDriverCount; i++) {
+		loaded_driver_image_t* image = loaded_driver_image(i);
+		mkext2_file_entry_t* entry;
+
+		if (!offsets[i])
+			continue;
+
+		entry = (mkext2_file_entry_t*)(archive + offsets[i]);
+		entry->compressed_size = 0;
+		entry->full_size = be32(executable_size(image));
+
+		bcopy((void*)image->image_base, (void*)(entry + 1), executable_size(image));
+	}
+
+	out.buf = (char*)(archive + offset);
+	out.len = 0;
+	emit_plist(&out, offsets);
+
+	hdr->magic = be32(MKEXT_MAGIC);
+	hdr->signature = be32(MKEXT_SIGN);
+	hdr->length = be32(length);
+	hdr->version = be32(MKEXT_VERS_2);
+	hdr->numkexts = be32(gLoadedDriverCount);
+	hdr->cputype = be32(MKEXT_CPU_TYPE_ARM);
+	hdr->cpusubtype = be32(MKEXT_CPU_SUBTYPE_ARM_ALL);
+	hdr->plist_offset = be32(offset);
+	hdr->plist_compressed_size = 0;
+	hdr->plist_full_size = be32(out.len);
+
+	hdr->adler32 = be32(mkext_adler32((uint8_t*)&hdr->version,
+		length - offsetof(mkext2_header_t, version)));
+
+	in_place = driver_area(&area) && length <= area.size;
+
+	if (in_place) {
+		dest = (uint8_t*)area.base;
+	}
+	else {
+		dest = (uint8_t*)memory_reserve(mem, length, 0);
+
+		if (!dest ||
+			(uint32_t)dest > memory_high_floor() ||
+			length > memory_high_floor() - (uint32_t)dest)
+		{
+			printf(KERR "no room for a 0x%x byte mkext at 0x%08x\n", length, (uint32_t)dest);
+			scratch_release(&mark);
+			return false;
+		}
+	}
+
+	bcopy((void*)archive, (void*)dest, length);
+
+	scratch_release(&mark);
+
+	printf(KINF "mkext at 0x%08x%s\n",
+		(uint32_t)dest,
+		in_place ? ", in place of the drivers" : "");
+
+	range->base = (uint32_t)dest;
+	range->size = length;
+
+	return true;
+}
@@ -0,0 +1,14 @@
+/*
+ * mkext.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Packs the loaded drivers into one mkext archive for the kernel.
+ */
+
+#ifndef _MKEXT_H
+#define _MKEXT_H
+
+extern boolean_t mkext_enabled(void);
+extern boolean_t build_mkext(memory_region_t* mem, memory_range_t* range);
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * scratch.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Loader scratch arena, carved from high memory (see memory.c).
+ * Shared by the loader and the mach-o code.
+ */
+
+#ifndef _SCRATCH_H
+#define _SCRATCH_H
+
+extern void* scratch_alloc(uint32_t size, uint32_t align_boundary);
+extern void scratch_mark(memory_region_t* mark);
+extern void scratch_release(memory_region_t* mark);
+
+#endif
@@ -0,0 +1,646 @@
+/*
+ * warm_boot.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Soak tests reboot over and over into the same kernel. With
+ * 'warm_boot' set to 1, mach_boot leaves a descriptor of the kernel
+ * it booted in the warm area (see memory_warm_area), with a checksum
+ * of what the kernel doesn't touch while it runs. After a soft reset
+ * the 'mach_warm' command checks that is still intact and takes the
+ * kernel over again without reading or decompressing it; only the
+ * device tree (kept in the descriptor) and the boot args are built
+ * again.
+ *
+ * Only the kernel survives a run. XNU frees the booter extension
+ * ranges the drivers are in, mounts the ramdisk read-write and
+ * releases __KLD and __LINKEDIT once it is up, so drivers and the
+ * ramdisk aren't kept and have to be loaded again before mach_boot.
+ * The descriptor keeps a pristine copy of each writable or released
+ * kernel segment, which is put back on restore, and only the rest is
+ * checked in place. If that changed too, the kernel has to be loaded
+ * again. The warm area itself is kept out of the memory the kernel
+ * is given.
+ *
+ * The same descriptor, with the drivers and ramdisk in it, is written
+ * out with the loaded images by the 'snapshot' command, see
+ * boot_snapshot.c.
+ */
+
+#include <bootkit/runtime.h>
+#include <bootkit/mach-o/macho_loader.h>
+
+#include "loader.h"
+#include "workers.h"
+#include "image_cache.h"
+#include "warm_boot.h"
+
+#define kWarmBootMagic ((uint32_t)'MRAW')
+#define WARM_BOOT_VERSION 2
+
+#define WARM_MAX_SEGMENTS 16
+
+/* Ranges are hashed in chunks of this, spread over the worker pool */
+#define WARM_CHUNK_SIZE 0x100000
+
+typedef struct {
+	memory_range_t range;
+	uint32_t sum[2];
+} warm_range_t;
+
+typedef struct {
+	loaded_driver_image_t image;
+	uint32_t sum[2];
+} warm_driver_t;
+
+typedef struct {
+	memory_range_t range;
+	uint32_t copy;   /* offset of the pristine copy, 0 if checked in place */
+	uint32_t sum[2]; /* of a segment checked in place */
+} warm_segment_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;   /* of everything, device tree included */
+	uint32_t sum[2]; /* of everything, with this zeroed */
+
+	uint32_t kernel_top;
+	uint32_t entry_point;
+	uint32_t virtual_base;
+	uint32_t physical_base;
+
+	memory_range_t kernel;
+	uint32_t nsegments;
+	warm_segment_t segments[WARM_MAX_SEGMENTS];
+
+	warm_range_t ramdisk;
+
+	uint32_t ndrivers;
+	uint32_t dt_size;
+	uint32_t copy_size;
+
+	warm_driver_t drivers[];
+
+	/* ... device tree command, pristine segment copies ... */
+} warm_descriptor_t;
+
+boolean_t warm_boot_enabled(void)
+{
+	char* en = getenv("warm_boot");
+
+	return (en && en[0] == '1');
+}
+
+/*---------------------------------------------------------------*/
+/* parallel range checksums */
+
+typedef struct {
+	uint32_t base;
+	uint32_t len;
+} warm_chunk_t;
+
+typedef struct {
+	warm_chunk_t* chunks;
+	uint32_t (*sums)[2];
+	uint32_t nchunks;
+	volatile uint32_t next_chunk;
+} warm_hash_t;
+
+static void warm_hash_worker(void* arg)
+{
+	warm_hash_t* hash = (warm_hash_t*)arg;
+	uint32_t i;
+
+	while ((i = __sync_fetch_and_add(&hash->next_chunk, 1)) < hash->nchunks) {
+		image_hash((const uint8_t*)hash->chunks[i].base,
+			hash->chunks[i].len,
+			hash->sums[i]);
+	}
+}
+
+/*
+ * checksum_ranges
+ *
+ * Hashes every range in 'ranges' into 'sums'. Ranges are cut into
+ * chunks that are hashed on every CPU, and a range's sum is the hash
+ * of its chunk hashes.
+ */
+static int checksum_ranges(memory_range_t* ranges, uint32_t count, uint32_t (*sums)[2])
+{
+	warm_hash_t hash;
+	memory_region_t mark;
+	unsigned int cpus = worker_pool_size();
+	uint32_t i, j, n;
+
+	hash.nchunks = 0;
+	hash.next_chunk = 0;
+
+	for (i = 0; i < count; i++)
+		hash.nchunks += (ranges[i].size + WARM_CHUNK_SIZE - 1) / WARM_CHUNK_SIZE;
+
+	scratch_mark(&mark);
+
+	hash.chunks = (warm_chunk_t*)scratch_alloc(sizeof(warm_chunk_t) * hash.nchunks + 1, 0);
+	hash.sums = (uint32_t(*)[2])scratch_alloc(sizeof(hash.sums[0]) * hash.nchunks + 1, 0);
+
+	if (!hash.chunks || !hash.sums) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < ranges[i].size; j += WARM_CHUNK_SIZE, n++) {
+			hash.chunks[n].base = ranges[i].base + j;
+			hash.chunks[n].len = (ranges[i].size - j > WARM_CHUNK_SIZE) ? WARM_CHUNK_SIZE : ranges[i].size - j;
+		}
+	}
+
+	if (cpus > hash.nchunks)
+		cpus = hash.nchunks;
+
+	/* Every job is the same, they just share the chunk counter */
+	for (i = 0; i < cpus; i++)
+		worker_pool_submit(warm_hash_worker, (void*)&hash);
+
+	worker_pool_wait();
+
+	for (i = 0, n = 0; i < count; i++) {
+		uint32_t nchunks = (ranges[i].size + WARM_CHUNK_SIZE - 1) / WARM_CHUNK_SIZE;
+
+		image_hash((const uint8_t*)hash.sums[n], nchunks * sizeof(hash.sums[0]), sums[i]);
+		n += nchunks;
+	}
+
+	scratch_release(&mark);
+
+	return 0;
+}
+
+/* Sums of a descriptor's ranges: segments, ramdisk, then drivers */
+#define range_count(desc) ((desc)->nsegments + 1 + (desc)->ndrivers)
+#define ramdisk_sum(desc, sums) (sums[(desc)->nsegments])
+#define driver_sum(desc, sums, i) (sums[(desc)->nsegments + 1 + (i)])
+
+/*
+ * checksum_descriptor_ranges
+ *
+ * Hashes what a descriptor covers into 'sums', which has room for
+ * range_count(desc) sums. Writable segments are skipped, their copy
+ * is covered by the descriptor's own sum. So is the pad in front of
+ * each driver, mach_boot writes the DriverInfo there.
+ */
+static int checksum_descriptor_ranges(warm_descriptor_t* desc, uint32_t (*sums)[2])
+{
+	memory_range_t* ranges;
+	memory_region_t mark;
+	uint32_t i;
+	int ret;
+
+	scratch_mark(&mark);
+
+	ranges = (memory_range_t*)scratch_alloc(sizeof(memory_range_t) * range_count(desc), 0);
+	if (!ranges) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	for (i = 0; i < desc->nsegments; i++) {
+		if (desc->segments[i].copy) {
+			ranges[i].base = 0;
+			ranges[i].size = 0;
+		}
+		else {
+			ranges[i] = desc->segments[i].range;
+		}
+	}
+
+	ranges[desc->nsegments] = desc->ramdisk.range;
+
+	for (i = 0; i < desc->ndrivers; i++) {
+		loaded_driver_image_t* image = &desc->drivers[i].image;
+		memory_range_t* range = &ranges[desc->nsegments + 1 + i];
+
+		range->base = image->image_base;
+		range->size = image->range.size - (image->image_base - image->range.base);
+	}
+
+	ret = checksum_ranges(ranges, range_count(desc), sums);
+
+	scratch_release(&mark);
+
+	return ret;
+}
+
+static boolean_t sum_matches(uint32_t a[2], uint32_t b[2])
+{
+	return (a[0] == b[0] && a[1] == b[1]);
+}
+
+static void descriptor_sum(warm_descriptor_t* desc, uint32_t sum[2])
+{
+	uint32_t saved[2];
+
+	saved[0] = desc->sum[0];
+	saved[1] = desc->sum[1];
+
+	desc->sum[0] = 0;
+	desc->sum[1] = 0;
+
+	image_hash((const uint8_t*)desc, desc->size, sum);
+
+	desc->sum[0] = saved[0];
+	desc->sum[1] = saved[1];
+}
+
+/*---------------------------------------------------------------*/
+/* descriptors */
+
+/*
+ * segment_changes
+ *
+ * Whether a running kernel writes to a segment or gives it back, so
+ * it can't be checked in place after a reset.
+ */
+static boolean_t segment_changes(struct segment_command* seg)
+{
+	if (seg->initprot & VM_PROT_WRITE)
+		return TRUE;
+
+	/* Released by the kernel once it is up */
+	return (!strncmp(seg->segname, "__KLD", sizeof(seg->segname)) ||
+		!strncmp(seg->segname, "__LINKEDIT", sizeof(seg->segname)));
+}
+
+/*
+ * describe_kernel_segments
+ *
+ * Lists the segments of the mapped kernel in 'desc' and copies the
+ * ones a running kernel changes to 'desc' from 'offset' on, without
+ * going past 'room'. Returns the bytes the copies took, or -1.
+ */
+static int describe_kernel_segments(warm_descriptor_t* desc, uint32_t offset, uint32_t room)
+{
+	mach_header_t* head = (mach_header_t*)gKernelMemoryRange.base;
+	uint8_t* lc = (uint8_t*)(head + 1);
+	uint8_t* end = lc + head->sizeofcmds;
+	uint32_t bias = 0;
+	uint32_t used = 0;
+	uint32_t i;
+
+	desc->nsegments = 0;
+
+	if (head->magic != MH_MAGIC || head->sizeofcmds > gKernelMemoryRange.size - sizeof(*head)) {
+		printf(KWARN "loaded kernel has no usable header\n");
+		return -1;
+	}
+
+	for (i = 0; i < head->ncmds; i++) {
+		struct load_command* cmd = (struct load_command*)lc;
+
+		if (cmd->cmdsize < sizeof(*cmd) || (uint32_t)(end - lc) < cmd->cmdsize)
+			return -1;
+
+		if (cmd->cmd == LC_SEGMENT && cmd->cmdsize >= sizeof(struct segment_command)) {
+			struct segment_command* seg = (struct segment_command*)cmd;
+			warm_segment_t* s = &desc->segments[desc->nsegments];
+
+			/* The first one is __TEXT, which has the header */
+			if (!desc->nsegments)
+				bias = seg->vmaddr;
+
+			if (!seg->vmsize)
+				goto next;
+
+			if (desc->nsegments == WARM_MAX_SEGMENTS ||
+				seg->vmaddr < bias ||
+				seg->vmaddr - bias > gKernelMemoryRange.size ||
+				seg->vmsize > gKernelMemoryRange.size - (seg->vmaddr - bias))
+			{
+				printf(KWARN "can't describe kernel segment '%.16s'\n", seg->segname);
+				return -1;
+			}
+
+			s->range.base = gKernelMemoryRange.base + (seg->vmaddr - bias);
+			s->range.size = seg->vmsize;
+			s->copy = 0;
+
+			if (segment_changes(seg)) {
+				uint32_t size = align_up(seg->vmsize, 4);
+
+				if (size > room - offset) {
+					printf(KWARN "no room for a copy of kernel segment '%.16s' (0x%x bytes)\n",
+						seg->segname,
+						seg->vmsize);
+					return -1;
+				}
+
+				s->copy = offset;
+				bcopy((void*)s->range.base, (void*)((uint8_t*)desc + offset), seg->vmsize);
+
+				offset += size;
+				used += size;
+			}
+
+			desc->nsegments++;
+		}
+
+next:
+		lc += cmd->cmdsize;
+	}
+
+	return (int)used;
+}
+
+/*
+ * describe_boot
+ *
+ * Describes what is about to be booted in the 'room' bytes at 'buf',
+ * only the kernel if 'kernel_only' is set. Returns the size of the
+ * descriptor, zero if it couldn't be made.
+ */
+static uint32_t describe_boot(void* buf, uint32_t room, boolean_t kernel_only)
+{
+	warm_descriptor_t* desc = (warm_descriptor_t*)buf;
+	uint32_t (*sums)[2];
+	memory_region_t mark;
+	const void* dt;
+	uint32_t dt_size;
+	uint32_t ndrivers;
+	uint32_t size;
+	int copy_size;
+	uint32_t i;
+
+	dt = device_tree_source(&dt_size);
+	if (!dt) {
+		printf(KWARN "device tree wasn't kept, can't describe the boot\n");
+		return 0;
+	}
+
+	ndrivers = kernel_only ? 0 : gLoadedDriverCount;
+	size = sizeof(warm_descriptor_t) + sizeof(warm_driver_t) * ndrivers + align_up(dt_size, 4);
+
+	if (size > room) {
+		printf(KWARN "boot state doesn't fit (0x%x bytes, room for 0x%x)\n", size, room);
+		return 0;
+	}
+
+	desc->magic = 0;
+	desc->version = WARM_BOOT_VERSION;
+	desc->size = size;
+
+	/* The kernel is the first thing loaded, the rest goes above it */
+	if (kernel_only)
+		desc->kernel_top = gKernelMemoryRange.base + align_up(gKernelMemoryRange.size, 0x1000);
+	else
+		desc->kernel_top = gKernelMemoryTop;
+	desc->entry_point = gKernelEntryPoint;
+	desc->virtual_base = gKernelVirtualBase;
+	desc->physical_base = gKernelPhysicalBase;
+
+	desc->kernel = gKernelMemoryRange;
+
+	if (kernel_only)
+		ZERO_RANGE(desc->ramdisk.range);
+	else
+		desc->ramdisk.range = gRAMDiskRange;
+
+	desc->ndrivers = ndrivers;
+	desc->dt_size = dt_size;
+
+	for (i = 0; i < ndrivers; i++)
+		desc->drivers[i].image = *loaded_driver_image(i);
+
+	bcopy((void*)dt, (void*)&desc->drivers[ndrivers], dt_size);
+
+	copy_size = describe_kernel_segments(desc, size, room);
+	if (copy_size < 0)
+		return 0;
+
+	desc->copy_size = copy_size;
+	desc->size = size + copy_size;
+
+	scratch_mark(&mark);
+
+	sums = (uint32_t(*)[2])scratch_alloc(sizeof(sums[0]) * range_count(desc), 0);
+	if (!sums || checksum_descriptor_ranges(desc, sums)) {
+		scratch_release(&mark);
+		return 0;
+	}
+
+	for (i = 0; i < desc->nsegments; i++)
+		bcopy((void*)sums[i], (void*)desc->segments[i].sum, sizeof(sums[0]));
+
+	bcopy((void*)ramdisk_sum(desc, sums), (void*)desc->ramdisk.sum, sizeof(sums[0]));
+
+	for (i = 0; i < desc->ndrivers; i++)
+		bcopy((void*)driver_sum(desc, sums, i), (void*)desc->drivers[i].sum, sizeof(sums[0]));
+
+	scratch_release(&mark);
+
+	desc->magic = kWarmBootMagic;
+	descriptor_sum(desc, desc->sum);
+
+	return desc->size;
+}
+
+/*
+ * boot_state_save
+ *
+ * Describes the kernel, drivers and ramdisk about to be booted in
+ * the 'room' bytes at 'buf'. Returns the size of the descriptor,
+ * zero if it couldn't be made.
+ */
+uint32_t boot_state_save(void* buf, uint32_t room)
+{
+	return describe_boot(buf, room, FALSE);
+}
+
+/*
+ * boot_state_check
+ *
+ * Checks a descriptor is whole, without looking at what it covers.
+ * 'span' gets the kernel memory it lays out.
+ */
+int boot_state_check(void* buf, uint32_t room, memory_range_t* span)
+{
+	warm_descriptor_t* desc = (warm_descriptor_t*)buf;
+	uint32_t copies;
+	uint32_t sum[2];
+	uint32_t i;
+
+	if (room < sizeof(warm_descriptor_t) ||
+		desc->magic != kWarmBootMagic ||
+		desc->version != WARM_BOOT_VERSION ||
+		desc->size < sizeof(warm_descriptor_t) ||
+		desc->size > room)
+	{
+		printf(KERR "no boot state at 0x%08x\n", (uint32_t)desc);
+		return 1;
+	}
+
+	descriptor_sum(desc, sum);
+
+	copies = sizeof(warm_descriptor_t) + sizeof(warm_driver_t) * desc->ndrivers + align_up(desc->dt_size, 4);
+
+	if (!sum_matches(sum, desc->sum) ||
+		desc->ndrivers > DRIVER_REGISTRY_MAX ||
+		desc->nsegments > WARM_MAX_SEGMENTS ||
+		copies + desc->copy_size != desc->size ||
+		desc->kernel_top < desc->physical_base)
+	{
+		printf(KERR "boot state is corrupt\n");
+		return 1;
+	}
+
+	for (i = 0; i < desc->nsegments; i++) {
+		warm_segment_t* s = &desc->segments[i];
+
+		if (s->copy && (s->copy < copies ||
+			s->copy > desc->size ||
+			s->range.size > desc->size - s->copy))
+		{
+			printf(KERR "boot state is corrupt\n");
+			return 1;
+		}
+	}
+
+	if (desc->kernel_top > memory_high_floor()) {
+		printf(KERR "boot state overlaps high memory (top 0x%08x)\n", desc->kernel_top);
+		return 1;
+	}
+
+	if (span) {
+		span->base = desc->physical_base;
+		span->size = desc->kernel_top - desc->physical_base;
+	}
+
+	return 0;
+}
+
+/*
+ * boot_state_restore
+ *
+ * Makes what a descriptor covers the current loader context, if all
+ * of it is still intact.
+ */
+int boot_state_restore(void* buf, uint32_t room)
+{
+	warm_descriptor_t* desc = (warm_descriptor_t*)buf;
+	uint32_t (*sums)[2];
+	memory_region_t mark;
+	uint32_t i;
+	int ret = 0;
+
+	if (boot_state_check(buf, room, NULL))
+		return 1;
+
+	printf(KPROC(BOOT) "checking boot state (%u driver(s)) ...\n", desc->ndrivers);
+
+	scratch_mark(&mark);
+
+	sums = (uint32_t(*)[2])scratch_alloc(sizeof(sums[0]) * range_count(desc), 0);
+	if (!sums || checksum_descriptor_ranges(desc, sums)) {
+		scratch_release(&mark);
+		return 1;
+	}
+
+	for (i = 0; i < desc->nsegments; i++) {
+		if (!desc->segments[i].copy && !sum_matches(sums[i], desc->segments[i].sum)) {
+			printf(KERR "kernel changed since it was loaded (0x%08x)\n", desc->segments[i].range.base);
+			ret = 1;
+		}
+	}
+
+	if (!sum_matches(ramdisk_sum(desc, sums), desc->ramdisk.sum)) {
+		printf(KERR "ramdisk changed since it was loaded\n");
+		ret = 1;
+	}
+
+	for (i = 0; i < desc->ndrivers; i++) {
+		if (!sum_matches(driver_sum(desc, sums, i), desc->drivers[i].sum)) {
+			printf(KERR "driver '%s' changed since it was loaded\n",
+				(const char*)&desc->drivers[i].image.name);
+			ret = 1;
+		}
+	}
+
+	scratch_release(&mark);
+
+	if (ret)
+		return 1;
+
+	/* All intact, put the kernel's data back and take it over */
+	for (i = 0; i < desc->nsegments; i++) {
+		warm_segment_t* s = &desc->segments[i];
+
+		if (s->copy)
+			bcopy((void*)((uint8_t*)desc + s->copy), (void*)s->range.base, s->range.size);
+	}
+
+	adopt_kernel_memory(desc->kernel_top);
+
+	gKernelMemoryRange = desc->kernel;
+	gRAMDiskRange = desc->ramdisk.range;
+	gKernelEntryPoint = desc->entry_point;
+	gKernelVirtualBase = desc->virtual_base;
+	gKernelPhysicalBase = desc->physical_base;
+
+	for (i = 0; i < desc->ndrivers; i++) {
+		loaded_driver_image_t* image = driver_registry_add(desc->drivers[i].image.name);
+
+		if (!image) {
+			/* Drop it all again */
+			adopt_kernel_memory(0);
+			return 1;
+		}
+
+		*image = desc->drivers[i].image;
+	}
+
+	if (load_device_tree_source(&desc->drivers[desc->ndrivers], desc->dt_size)) {
+		printf(KERR "unable to parse the saved device tree\n");
+		adopt_kernel_memory(0);
+		return 1;
+	}
+
+	printf(KDONE "restored kernel and %u driver(s)%s\n",
+		desc->ndrivers,
+		RANGE_IS_NULL(gRAMDiskRange) ? "" : " with a ramdisk");
+
+	return 0;
+}
+
+/*---------------------------------------------------------------*/
+
+/*
+ * warm_boot_save
+ *
+ * Describes the kernel about to be booted in the warm area. Called
+ * by mach_boot before it starts the kernel.
+ */
+void warm_boot_save(void)
+{
+	warm_descriptor_t* desc = (warm_descriptor_t*)memory_warm_area();
+
+	printf(KPROC(BOOT) "saving warm boot state ...\n");
+
+	/* Whatever was there isn't what is being booted */
+	desc->magic = 0;
+
+	describe_boot((void*)desc, WARM_BOOT_AREA_SIZE, TRUE);
+
+	/* Has to be in DRAM, not the cache, when the reset comes */
+	flush_dcache_range((unsigned long)desc, (unsigned long)desc + WARM_BOOT_AREA_SIZE);
+}
+
+/*
+ * warm_boot_restore
+ *
+ * Checks the warm area for the kernel a previous boot left and makes
+ * it the current loader context if it is still intact. Drivers and
+ * the ramdisk have to be loaded again.
+ */
+int warm_boot_restore(void)
+{
+	return boot_state_restore((void*)memory_warm_area(), WARM_BOOT_AREA_SIZE);
+}
@@ -0,0 +1,20 @@
+/*
+ * warm_boot.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Keeps a booted kernel usable across a soft reset.
+ */
+
+#ifndef _WARM_BOOT_H
+#define _WARM_BOOT_H
+
+/* Descriptors of a loaded boot, also stored by boot snapshots */
+extern uint32_t boot_state_save(void* buf, uint32_t room);
+extern int boot_state_check(void* buf, uint32_t room, memory_range_t* span);
+extern int boot_state_restore(void* buf, uint32_t room);
+
+extern boolean_t warm_boot_enabled(void);
+extern void warm_boot_save(void);
+extern int warm_boot_restore(void);
+
+#endif
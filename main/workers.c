@@ -0,0 +1,247 @@
+/*
+ * workers.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Fork/join job pool. Jobs are queued with worker_pool_submit and
+ * nothing runs until worker_pool_wait, which starts every worker
+ * (including the calling CPU) pulling jobs off the queue and only
+ * returns once the queue is drained. Jobs must not call into
+ * anything that isn't reentrant (malloc, printf, the DT code).
+ *
+ * Backends:
+ *   HOST_CODE          - pthreads, for measuring scaling on a host
+ *                        (see tools/workbench.c).
+ *   CONFIG_BOOTKIT_SMP - secondary cores that the board code sent to
+ *                        bootkit_cpu_park, driven through a mailbox.
+ *   otherwise          - everything runs on the boot CPU.
+ */
+
+#ifndef HOST_CODE
+#define HOST_CODE 0
+#endif
+
+#if HOST_CODE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workers.h"
+
+#define HOST_WORKERS_DEFAULT 4
+#else
+#include <bootkit/runtime.h>
+
+#include "workers.h"
+
+#endif
+
+typedef struct {
+	worker_job_fn fn;
+	void* arg;
+} worker_job_t;
+
+static worker_job_t gJobs[WORKER_MAX_JOBS];
+static uint32_t gJobCount = 0;
+static volatile uint32_t gNextJob = 0;
+
+/*
+ * worker_drain
+ *
+ * Body of every worker. Jobs are claimed with an atomic increment
+ * so no two workers ever run the same job.
+ */
+static void worker_drain(void* unused)
+{
+	uint32_t i;
+
+	(void)unused;
+
+	while ((i = __sync_fetch_and_add(&gNextJob, 1)) < gJobCount) {
+		gJobs[i].fn(gJobs[i].arg);
+	}
+}
+
+#if HOST_CODE
+static void* worker_thread(void* arg)
+{
+	worker_drain(arg);
+	return NULL;
+}
+#elif defined(CONFIG_BOOTKIT_SMP)
+/*---------------------------------------------------------------*/
+/* secondary cores */
+
+enum {
+	kCPUOffline = 0, /* never reached bootkit_cpu_park */
+	kCPUParked,
+	kCPUBusy
+};
+
+typedef struct {
+	volatile uint32_t state;
+	worker_job_fn fn;
+	void* arg;
+} cpu_mailbox_t;
+
+static cpu_mailbox_t gMailboxes[CONFIG_BOOTKIT_SMP_CPUS];
+
+#define cpu_wfe() __asm__ __volatile__("wfe" ::: "memory")
+#define cpu_sev() __asm__ __volatile__("sev" ::: "memory")
+
+/*
+ * bootkit_cpu_park
+ *
+ * Where the board code sends each secondary core once it's up.
+ * The core waits on its mailbox for jobs and never returns.
+ */
+void bootkit_cpu_park(unsigned int cpu)
+{
+	cpu_mailbox_t* mb = &gMailboxes[cpu];
+
+	mb->state = kCPUParked;
+	__sync_synchronize();
+	cpu_sev();
+
+	for (;;) {
+		while (mb->state != kCPUBusy)
+			cpu_wfe();
+
+		__sync_synchronize();
+		mb->fn(mb->arg);
+		__sync_synchronize();
+
+		mb->state = kCPUParked;
+		cpu_sev();
+	}
+}
+
+/*
+ * bootkit_cpu_run
+ *
+ * Makes a parked secondary core call fn(arg). Cores that never
+ * parked are left out, the boot CPU drains the queue either way.
+ */
+static boolean_t bootkit_cpu_run(unsigned int cpu, worker_job_fn fn, void* arg)
+{
+	cpu_mailbox_t* mb;
+
+	if (cpu >= CONFIG_BOOTKIT_SMP_CPUS)
+		return false;
+
+	mb = &gMailboxes[cpu];
+	if (mb->state != kCPUParked)
+		return false;
+
+	mb->fn = fn;
+	mb->arg = arg;
+	__sync_synchronize();
+
+	mb->state = kCPUBusy;
+	cpu_sev();
+
+	return true;
+}
+
+static void bootkit_cpu_wait(unsigned int cpu)
+{
+	while (gMailboxes[cpu].state == kCPUBusy)
+		cpu_wfe();
+
+	__sync_synchronize();
+}
+#endif
+
+/*
+ * worker_pool_size
+ *
+ * Number of CPUs that take part in a join, counting the caller.
+ */
+unsigned int worker_pool_size(void)
+{
+#if HOST_CODE
+	const char* en = getenv("BOOTKIT_WORKERS");
+
+	if (en && atoi(en) > 0) {
+		return (unsigned int)atoi(en);
+	}
+
+	return HOST_WORKERS_DEFAULT;
+#elif defined(CONFIG_BOOTKIT_SMP)
+	return CONFIG_BOOTKIT_SMP_CPUS;
+#else
+	return 1;
+#endif
+}
+
+void worker_pool_submit(worker_job_fn fn, void* arg)
+{
+	if (gJobCount == WORKER_MAX_JOBS) {
+		/* Queue is full, flush what we have so far */
+		worker_pool_wait();
+	}
+
+	gJobs[gJobCount].fn = fn;
+	gJobs[gJobCount].arg = arg;
+	gJobCount++;
+}
+
+void worker_pool_wait(void)
+{
+	unsigned int cpus = worker_pool_size();
+	unsigned int i;
+
+	if (gJobCount == 0) {
+		return;
+	}
+
+	/* No point waking up more cores than there are jobs */
+	if (cpus > gJobCount) {
+		cpus = gJobCount;
+	}
+
+	gNextJob = 0;
+	__sync_synchronize();
+
+#if HOST_CODE
+	{
+		pthread_t threads[cpus];
+		int started[cpus];
+
+		for (i = 1; i < cpus; i++) {
+			/* A thread that didn't start just leaves more for the rest */
+			started[i] = (pthread_create(&threads[i], NULL, worker_thread, NULL) == 0);
+		}
+
+		worker_drain(NULL);
+
+		for (i = 1; i < cpus; i++) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+		}
+	}
+#elif defined(CONFIG_BOOTKIT_SMP)
+	{
+		boolean_t started[CONFIG_BOOTKIT_SMP_CPUS];
+
+		for (i = 1; i < cpus; i++) {
+			started[i] = bootkit_cpu_run(i, worker_drain, NULL);
+		}
+
+		worker_drain(NULL);
+
+		for (i = 1; i < cpus; i++) {
+			if (started[i])
+				bootkit_cpu_wait(i);
+		}
+	}
+#else
+	(void)i;
+	worker_drain(NULL);
+#endif
+
+	__sync_synchronize();
+
+	gJobCount = 0;
+	gNextJob = 0;
+}
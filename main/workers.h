@@ -0,0 +1,26 @@
+/*
+ * workers.h
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Tiny fork/join job pool for spreading independent work
+ * (mostly decompression) over the available cores.
+ */
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+typedef void (*worker_job_fn)(void* arg);
+
+/* Maximum number of jobs queued between two joins */
+#define WORKER_MAX_JOBS 256
+
+extern unsigned int worker_pool_size(void);
+extern void worker_pool_submit(worker_job_fn fn, void* arg);
+extern void worker_pool_wait(void);
+
+#ifdef CONFIG_BOOTKIT_SMP
+/* Secondary core entry, for the board code to jump to once a core is up */
+extern void bootkit_cpu_park(unsigned int cpu);
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * mkblocks.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Packs an image into a block-indexed payload (see compressed/blocks.h),
+ * each block compressed on its own with LZSS, or stored if that doesn't
+ * make it smaller. With -c the payload is wrapped in a ramdisk ('KSDR')
+ * load command that can go into a TOC.
+ *
+ *   cc -O2 -o mkblocks tools/mkblocks.c
+ *   mkblocks [-b block_size] [-c] <in> <out>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HOST_CODE 1
+#include "../compressed/blocks.h"
+
+#define kCommandRamdisk ((uint32_t)'KSDR')
+#define kCodecFlagBlocks 0x1000
+
+/* LZSS parameters, as in compressed/lzss.c */
+#define N 4096
+#define F 18
+#define THRESHOLD 2
+
+#define HASH_SIZE 4096
+#define CHAIN_MAX 256
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mkblocks [-b block_size] [-c] <in> <out>\n");
+	fprintf(stderr, "  -b  decompressed block size (default 65536)\n");
+	fprintf(stderr, "  -c  wrap the payload in a ramdisk (KSDR) load command\n");
+	exit(1);
+}
+
+static uint8_t* read_file(const char* path, uint32_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	uint8_t* buf;
+	long len;
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(len ? len : 1);
+	if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "%s: read failed\n", path);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+
+	fclose(f);
+	*size = (uint32_t)len;
+
+	return buf;
+}
+
+static uint32_t hash3(const uint8_t* p)
+{
+	return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+/*
+ * lzss_encode
+ *
+ * Greedy LZSS encoder producing what decompress_lzss reads. Matches
+ * only reach back into the block itself, never into the blanks the
+ * ring starts out with. Returns the encoded size, or 0 if it isn't
+ * smaller than 'len' (the block is then stored).
+ */
+static uint32_t lzss_encode(const uint8_t* src, uint32_t len, uint8_t* dst, int32_t* head, int32_t* prev)
+{
+	uint32_t in = 0;
+	uint32_t out = 0;
+	uint32_t flag_at = 0;
+	uint32_t nbits = 8;
+	uint32_t i;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		head[i] = -1;
+
+	while (in < len) {
+		uint32_t best_len = 0;
+		uint32_t best_pos = 0;
+
+		if (nbits == 8) {
+			/* Room for a flag byte and a full group of matches */
+			if (out + 1 + 16 >= len)
+				return 0;
+
+			flag_at = out++;
+			dst[flag_at] = 0;
+			nbits = 0;
+		}
+
+		if (len - in > THRESHOLD) {
+			uint32_t max = (len - in > F) ? F : len - in;
+			int32_t cand = head[hash3(src + in)];
+			uint32_t chain = 0;
+
+			for (; cand >= 0 && in - cand <= N - F && chain < CHAIN_MAX; cand = prev[cand], chain++) {
+				uint32_t l = 0;
+
+				while (l < max && src[cand + l] == src[in + l])
+					l++;
+
+				if (l > best_len) {
+					best_len = l;
+					best_pos = cand;
+
+					if (l == max)
+						break;
+				}
+			}
+		}
+
+		if (best_len > THRESHOLD) {
+			/* Where the match is in the decoder's ring */
+			uint32_t ring = (best_pos + N - F) & (N - 1);
+
+			dst[out++] = ring & 0xff;
+			dst[out++] = ((ring >> 4) & 0xf0) | (best_len - THRESHOLD - 1);
+		}
+		else {
+			best_len = 1;
+			dst[flag_at] |= (1 << nbits);
+			dst[out++] = src[in];
+		}
+
+		nbits++;
+
+		for (i = 0; i < best_len; i++, in++) {
+			if (len - in > THRESHOLD) {
+				uint32_t h = hash3(src + in);
+
+				prev[in] = head[h];
+				head[h] = in;
+			}
+		}
+	}
+
+	return (out < len) ? out : 0;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t block_size = 0x10000;
+	int wrap = 0;
+	int ch;
+
+	uint8_t* image;
+	uint32_t image_size;
+	uint32_t nblocks;
+	uint32_t header_size;
+	uint32_t payload_size;
+	uint32_t nstored = 0;
+	uint32_t i;
+
+	block_payload_t* hdr;
+	uint8_t** blocks;
+	uint8_t* scratch;
+	int32_t* head;
+	int32_t* prev;
+	FILE* out;
+
+	while ((ch = getopt(argc, argv, "b:c")) != -1) {
+		switch (ch) {
+			case 'b':
+				block_size = (uint32_t)strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				wrap = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2 || block_size == 0)
+		usage();
+
+	image = read_file(argv[0], &image_size);
+	if (!image)
+		return 1;
+
+	if (image_size == 0) {
+		fprintf(stderr, "%s: empty\n", argv[0]);
+		return 1;
+	}
+
+	nblocks = image_size / block_size + (image_size % block_size != 0);
+	header_size = sizeof(block_payload_t) + (nblocks + 1) * sizeof(uint32_t);
+
+	hdr = calloc(1, header_size);
+	blocks = calloc(nblocks, sizeof(uint8_t*));
+	scratch = malloc(block_size);
+	head = malloc(HASH_SIZE * sizeof(int32_t));
+	prev = malloc(block_size * sizeof(int32_t));
+
+	if (!hdr || !blocks || !scratch || !head || !prev) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	hdr->magic = kBlockPayloadMagic;
+	hdr->codec = kBlockCodecLZSS;
+	hdr->block_size = block_size;
+	hdr->nblocks = nblocks;
+	hdr->decomp_size = image_size;
+
+	payload_size = header_size;
+
+	for (i = 0; i < nblocks; i++) {
+		uint32_t off = i * block_size;
+		uint32_t len = (image_size - off > block_size) ? block_size : image_size - off;
+		uint32_t enc = lzss_encode(image + off, len, scratch, head, prev);
+
+		hdr->offsets[i] = payload_size;
+
+		if (enc) {
+			blocks[i] = malloc(enc);
+			if (!blocks[i]) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+
+			memcpy(blocks[i], scratch, enc);
+			payload_size += enc;
+		}
+		else {
+			/* Stored, the decoder tells by the length */
+			payload_size += len;
+			nstored++;
+		}
+	}
+
+	hdr->offsets[nblocks] = payload_size;
+
+	out = fopen(argv[1], "wb");
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (wrap) {
+		/* command_ramdisk_t */
+		uint32_t cmd[4];
+
+		cmd[0] = kCommandRamdisk;
+		cmd[1] = sizeof(cmd) + ((payload_size + 3) & ~3U);
+		cmd[2] = image_size;
+		cmd[3] = kCodecFlagBlocks;
+
+		fwrite(cmd, sizeof(cmd), 1, out);
+	}
+
+	fwrite(hdr, header_size, 1, out);
+
+	for (i = 0; i < nblocks; i++) {
+		uint32_t len = hdr->offsets[i+1] - hdr->offsets[i];
+
+		fwrite(blocks[i] ? blocks[i] : image + i * block_size, len, 1, out);
+	}
+
+	if (wrap) {
+		/* Keep the next command word aligned */
+		static const uint8_t pad[4];
+		fwrite(pad, (4 - (payload_size & 3)) & 3, 1, out);
+	}
+
+	if (fclose(out)) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("%s: %u blocks (%u stored), 0x%x => 0x%x bytes\n",
+		argv[1],
+		nblocks,
+		nstored,
+		image_size,
+		payload_size);
+
+	return 0;
+}
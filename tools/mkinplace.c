@@ -0,0 +1,316 @@
+/*
+ * mkinplace.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Marks a QuickLZ compressed Mach-O ('hcaM') or ramdisk ('KSDR') load
+ * command for in-place decoding (see compressed/codecs.h). The decode
+ * is simulated to find how far the output can get ahead of the input,
+ * and the margin that keeps it from overwriting unread input is
+ * appended to the payload in an in-place trailer. LZSS payloads don't
+ * need one, they are streamed.
+ *
+ *   cc -o mkinplace tools/mkinplace.c
+ *   mkinplace <in> <out>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define kCommandMachO ((uint32_t)'hcaM')
+#define kCommandRamdisk ((uint32_t)'KSDR')
+
+/* Header sizes and where the flags are in them */
+#define MACHO_HEADER_SIZE 88
+#define MACHO_FLAGS_OFFSET 20
+#define RAMDISK_HEADER_SIZE 16
+#define RAMDISK_FLAGS_OFFSET 12
+
+#define kCodecFlagLZSS 0x100
+#define kCodecFlagQLZ 0x400
+#define kCodecFlagBlocks 0x1000
+#define kCodecFlagInPlace 0x4000
+
+#define kCodecInPlaceMagic ((uint32_t)'PLNI')
+
+static uint8_t* read_file(const char* path, uint32_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	uint8_t* buf;
+	long len;
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(len ? len : 1);
+	if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "%s: read failed\n", path);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+
+	fclose(f);
+	*size = (uint32_t)len;
+
+	return buf;
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * qlz_lead
+ *
+ * Walks a QuickLZ 1.5 packet the way qlz_decompress does, without
+ * producing anything, and returns the most the output ever gets
+ * ahead of the input: max(written - next unread) over every write.
+ * Literal runs are copied a word at a time, so they write 4 bytes
+ * even when fewer are literals. '*produced' gets the decoded size.
+ */
+static int64_t qlz_lead(const uint8_t* src, uint32_t srclen, uint32_t* produced)
+{
+	static const uint32_t bitlut[16] = {4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
+	uint32_t header;
+	uint32_t level;
+	uint32_t size;
+	uint32_t in;
+	uint32_t out = 0;
+	uint32_t cword = 1;
+	int64_t lead;
+
+	*produced = 0;
+
+	if (srclen < 3)
+		return 0;
+
+	header = (src[0] & 2) ? 9 : 3;
+	level = (src[0] >> 2) & 3;
+
+	if (srclen < header)
+		return 0;
+
+	size = (header == 9) ? get32(src + 5) : src[2];
+	in = header;
+
+	/* Stored, copied up from behind the header */
+	lead = -(int64_t)header;
+
+	if (!(src[0] & 1) || !size) {
+		*produced = size;
+		return lead;
+	}
+
+	for (;;) {
+		uint32_t fetch;
+
+		if (cword == 1) {
+			if (in + 4 > srclen) break;
+			cword = get32(src + in);
+			in += 4;
+		}
+
+		if (in + 4 > srclen) break;
+		fetch = get32(src + in);
+
+		if (cword & 1) {
+			uint32_t len;
+
+			cword >>= 1;
+
+			if (level == 1 || level == 2) {
+				if ((level == 1 && (fetch & 0xf)) || (level == 2 && (fetch & 28))) {
+					len = ((level == 1) ? (fetch & 0xf) : ((fetch >> 2) & 0x7)) + 2;
+					in += 2;
+				}
+				else {
+					len = src[in + 2];
+					in += 3;
+				}
+			}
+			else if ((fetch & 3) == 0) {
+				len = 3;
+				in += 1;
+			}
+			else if ((fetch & 2) == 0) {
+				len = 3;
+				in += 2;
+			}
+			else if ((fetch & 1) == 0) {
+				len = ((fetch >> 2) & 15) + 3;
+				in += 2;
+			}
+			else if ((fetch & 127) != 3) {
+				len = ((fetch >> 2) & 0x1f) + 2;
+				in += 3;
+			}
+			else {
+				len = ((fetch >> 7) & 255) + 3;
+				in += 4;
+			}
+
+			/* Matches come from the output */
+			if ((int64_t)out + len - in > lead)
+				lead = (int64_t)out + len - in;
+			out += len;
+		}
+		else if ((int64_t)out < (int64_t)size - 1 - 6 - 4) {
+			uint32_t n = bitlut[cword & 0xf];
+
+			cword >>= n;
+
+			if ((int64_t)out + 4 - (in + n) > lead)
+				lead = (int64_t)out + 4 - (in + n);
+			out += n;
+			in += n;
+		}
+		else {
+			/* The last few bytes are literals, one at a time */
+			while (out < size) {
+				if (cword == 1) {
+					in += 4;
+					cword = 1U << 31;
+				}
+
+				if ((int64_t)out + 1 - (in + 1) > lead)
+					lead = (int64_t)out + 1 - (in + 1);
+				out++;
+				in++;
+				cword >>= 1;
+			}
+			break;
+		}
+	}
+
+	/* A truncated packet comes back short */
+	*produced = (in > srclen) ? 0 : out;
+
+	return lead;
+}
+
+int main(int argc, char** argv)
+{
+	uint8_t* cmd;
+	uint32_t cmd_size;
+	uint32_t header_size;
+	uint32_t flags_offset;
+	uint32_t payload_size;
+	uint32_t decomp_size;
+	uint32_t produced;
+	uint32_t flags;
+	uint32_t margin;
+	uint8_t trailer[8];
+	int64_t lead;
+	int64_t need;
+	FILE* out;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: mkinplace <in> <out>\n");
+		return 1;
+	}
+
+	cmd = read_file(argv[1], &cmd_size);
+	if (!cmd)
+		return 1;
+
+	if (cmd_size >= 4 && get32(cmd) == kCommandMachO) {
+		header_size = MACHO_HEADER_SIZE;
+		flags_offset = MACHO_FLAGS_OFFSET;
+	}
+	else if (cmd_size >= 4 && get32(cmd) == kCommandRamdisk) {
+		header_size = RAMDISK_HEADER_SIZE;
+		flags_offset = RAMDISK_FLAGS_OFFSET;
+	}
+	else {
+		fprintf(stderr, "%s: not a Mach-O or ramdisk load command\n", argv[1]);
+		return 1;
+	}
+
+	if (cmd_size < header_size || get32(cmd + 4) != cmd_size) {
+		fprintf(stderr, "%s: command size doesn't match the file (0x%x vs 0x%x)\n",
+			argv[1],
+			cmd_size >= 8 ? get32(cmd + 4) : 0,
+			cmd_size);
+		return 1;
+	}
+
+	flags = get32(cmd + flags_offset);
+	decomp_size = get32(cmd + 8);
+	payload_size = cmd_size - header_size;
+
+	if (flags & kCodecFlagInPlace) {
+		fprintf(stderr, "%s: already has an in-place trailer\n", argv[1]);
+		return 1;
+	}
+
+	if ((flags & (kCodecFlagLZSS | kCodecFlagQLZ | kCodecFlagBlocks)) != kCodecFlagQLZ) {
+		fprintf(stderr, "%s: only QuickLZ payloads can be measured (flags 0x%x)\n", argv[1], flags);
+		return 1;
+	}
+
+	lead = qlz_lead(cmd + header_size, payload_size, &produced);
+
+	if (produced != decomp_size) {
+		fprintf(stderr, "%s: payload decodes to 0x%x bytes, the command says 0x%x\n",
+			argv[1],
+			produced,
+			decomp_size);
+		return 1;
+	}
+
+	/*
+	 * The payload ends at decomp_size + margin, so unread input
+	 * starts at decomp_size + margin - payload_size + consumed.
+	 */
+	need = lead + payload_size - decomp_size;
+	margin = (need > 0) ? (uint32_t)need : 0;
+
+	margin = (margin + 3) & ~3U;
+
+	put32(cmd + 4, cmd_size + sizeof(trailer));
+	put32(cmd + flags_offset, flags | kCodecFlagInPlace);
+
+	put32(trailer, margin);
+	put32(trailer + 4, kCodecInPlaceMagic);
+
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fwrite(cmd, cmd_size, 1, out);
+	fwrite(trailer, sizeof(trailer), 1, out);
+
+	if (fclose(out)) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	printf("%s: 0x%x => 0x%x bytes, in-place margin 0x%x (peak 0x%x instead of 0x%x)\n",
+		argv[2],
+		payload_size,
+		decomp_size,
+		margin,
+		decomp_size + margin,
+		decomp_size + payload_size);
+
+	return 0;
+}
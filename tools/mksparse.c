@@ -0,0 +1,183 @@
+/*
+ * mksparse.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Packs a ramdisk image into a sparse image (see compressed/sparse.h)
+ * that can be loaded with 'rdx', or with -c into a sparse ramdisk
+ * ('KSDR') command that can go into a TOC.
+ *
+ *   cc -o mksparse tools/mksparse.c
+ *   mksparse [-b block_size] [-c] <in> <out>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HOST_CODE 1
+#include "../compressed/sparse.h"
+
+#define kCommandRamdisk ((uint32_t)'KSDR')
+#define kCommandRamdiskFlags_Sparse 0x2000
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mksparse [-b block_size] [-c] <in> <out>\n");
+	fprintf(stderr, "  -b  block size, a multiple of 4 (default 4096)\n");
+	fprintf(stderr, "  -c  wrap the image in a ramdisk (KSDR) load command\n");
+	exit(1);
+}
+
+static uint8_t* read_file(const char* path, uint32_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	uint8_t* buf;
+	long len;
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	buf = malloc(len ? len : 1);
+	if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "%s: read failed\n", path);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+
+	fclose(f);
+	*size = (uint32_t)len;
+
+	return buf;
+}
+
+static int block_is_zero(const uint8_t* p, uint32_t len)
+{
+	while (len--) {
+		if (*p++)
+			return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t block_size = 4096;
+	int wrap = 0;
+	int ch;
+
+	uint8_t* image;
+	uint32_t image_size;
+	uint32_t nblocks;
+	uint32_t header_size;
+	uint32_t stored = 0;
+	uint32_t nstored = 0;
+	uint32_t i;
+
+	sparse_image_t* hdr;
+	FILE* out;
+
+	while ((ch = getopt(argc, argv, "b:c")) != -1) {
+		switch (ch) {
+			case 'b':
+				block_size = (uint32_t)strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				wrap = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2 || block_size == 0 || (block_size & 3))
+		usage();
+
+	image = read_file(argv[0], &image_size);
+	if (!image)
+		return 1;
+
+	nblocks = (image_size + block_size - 1) / block_size;
+	header_size = sizeof(sparse_image_t) + sparse_bitmap_words(nblocks) * sizeof(uint32_t);
+
+	hdr = calloc(1, header_size);
+	if (!hdr) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	hdr->magic = kSparseImageMagic;
+	hdr->block_size = block_size;
+	hdr->nblocks = nblocks;
+	hdr->image_size = image_size;
+	hdr->data_offset = header_size;
+
+	for (i = 0; i < nblocks; i++) {
+		uint32_t off = i * block_size;
+		uint32_t len = (image_size - off > block_size) ? block_size : image_size - off;
+
+		if (!block_is_zero(image + off, len)) {
+			hdr->bitmap[i / 32] |= (1U << (i % 32));
+			stored += len;
+			nstored++;
+		}
+	}
+
+	out = fopen(argv[1], "wb");
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (wrap) {
+		/* command_ramdisk_t */
+		uint32_t cmd[4];
+
+		cmd[0] = kCommandRamdisk;
+		cmd[1] = sizeof(cmd) + ((header_size + stored + 3) & ~3U);
+		cmd[2] = image_size;
+		cmd[3] = kCommandRamdiskFlags_Sparse;
+
+		fwrite(cmd, sizeof(cmd), 1, out);
+	}
+
+	fwrite(hdr, header_size, 1, out);
+
+	for (i = 0; i < nblocks; i++) {
+		uint32_t off = i * block_size;
+		uint32_t len = (image_size - off > block_size) ? block_size : image_size - off;
+
+		if (sparse_block_stored(hdr, i))
+			fwrite(image + off, len, 1, out);
+	}
+
+	if (wrap) {
+		/* Keep the next command word aligned */
+		static const uint8_t pad[4];
+		fwrite(pad, (4 - ((header_size + stored) & 3)) & 3, 1, out);
+	}
+
+	if (fclose(out)) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("%s: %u of %u blocks stored, 0x%x => 0x%x bytes\n",
+		argv[1],
+		nstored,
+		nblocks,
+		image_size,
+		header_size + stored);
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * workbench.c
+ * Copyright (c) 2013 Kristina Brooks
+ *
+ * Measures how the worker pool (main/workers.c) scales, with its
+ * pthread backend. Each job stands in for decompressing a driver:
+ * it fills a buffer from a byte stream the way a decoder would,
+ * mixing short literal runs with copies out of what it already
+ * wrote. The same jobs are run with 1 up to 'max' workers and the
+ * time and speedup of each are printed.
+ *
+ *   cc -O2 -pthread -o workbench tools/workbench.c
+ *   workbench [-j jobs] [-s job_size_kb] [max_workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define HOST_CODE 1
+#include "../main/workers.c"
+
+typedef struct {
+	uint8_t* buf;
+	uint32_t size;
+	uint32_t seed;
+	uint32_t sum;
+} bench_job_t;
+
+static uint32_t next_rand(uint32_t* x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+static void bench_job(void* arg)
+{
+	bench_job_t* job = (bench_job_t*)arg;
+	uint32_t x = job->seed;
+	uint32_t pos = 0;
+	uint32_t sum = 0;
+
+	while (pos < job->size) {
+		uint32_t r = next_rand(&x);
+		uint32_t len = 3 + (r & 15);
+
+		if (len > job->size - pos)
+			len = job->size - pos;
+
+		if ((r & 0x100) || pos < 4096) {
+			/* Literals */
+			for (uint32_t i = 0; i < len; i++)
+				job->buf[pos++] = (uint8_t)next_rand(&x);
+		}
+		else {
+			/* Copy from back in the window, byte by byte like LZSS */
+			uint32_t from = pos - 1 - ((r >> 12) & 4095);
+
+			for (uint32_t i = 0; i < len; i++)
+				job->buf[pos++] = job->buf[from++];
+		}
+	}
+
+	for (pos = 0; pos < job->size; pos += 64)
+		sum += job->buf[pos];
+
+	job->sum = sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(bench_job_t* jobs, unsigned int count)
+{
+	double start = now();
+
+	for (unsigned int i = 0; i < count; i++)
+		worker_pool_submit(bench_job, &jobs[i]);
+
+	worker_pool_wait();
+
+	return now() - start;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int count = 128;
+	unsigned int size_kb = 512;
+	unsigned int max = 4;
+	bench_job_t* jobs;
+	uint32_t check = 0;
+	double base = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "j:s:")) != -1) {
+		if (c == 'j')
+			count = atoi(optarg);
+		else if (c == 's')
+			size_kb = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: workbench [-j jobs] [-s job_size_kb] [max_workers]\n");
+			return 1;
+		}
+	}
+
+	if (optind < argc)
+		max = atoi(argv[optind]);
+
+	if (!count || !size_kb || !max) {
+		fprintf(stderr, "jobs, job size and workers must be positive\n");
+		return 1;
+	}
+
+	jobs = calloc(count, sizeof(bench_job_t));
+	if (!jobs)
+		return 1;
+
+	for (unsigned int i = 0; i < count; i++) {
+		jobs[i].size = size_kb * 1024;
+		jobs[i].seed = 0x9e3779b9 * (i + 1);
+		jobs[i].buf = malloc(jobs[i].size);
+
+		if (!jobs[i].buf)
+			return 1;
+	}
+
+	/* Fault the buffers in so the first run isn't penalized */
+	run(jobs, count);
+
+	printf("%u jobs of %u KiB\n", count, size_kb);
+
+	for (unsigned int workers = 1; workers <= max; workers++) {
+		char env[16];
+		double t;
+		uint32_t sum = 0;
+
+		snprintf(env, sizeof(env), "%u", workers);
+		setenv("BOOTKIT_WORKERS", env, 1);
+
+		t = run(jobs, count);
+
+		for (unsigned int i = 0; i < count; i++)
+			sum += jobs[i].sum;
+
+		if (workers == 1) {
+			base = t;
+			check = sum;
+		}
+		else if (sum != check) {
+			fprintf(stderr, "%u workers: results differ from 1 worker\n", workers);
+			return 1;
+		}
+
+		printf("%2u worker(s): %8.3f ms  %5.2fx\n", workers, t * 1000, base / t);
+	}
+
+	return 0;
+}